@@ -70,6 +70,20 @@ public:
     }
 };
 
+/**
+ * Keep the loads on either side of this call in order.
+ *
+ * x86 never reorders loads with other loads, so there this only has
+ * to stop the compiler.
+ */
+inline void readBarrier() {
+#if defined(__i386__) || defined(__x86_64__)
+    asm volatile("" ::: "memory");
+#else
+    __sync_synchronize();
+#endif
+}
+
 /**
  * Holder of atomic values.
  */
@@ -192,6 +206,162 @@ private:
     volatile T value;
 };
 
+/**
+ * Get the calling thread's slot number.
+ *
+ * Threads are numbered in the order they first ask.
+ */
+inline size_t getThreadSlot() {
+    static ThreadLocal<void*> slot;
+    static Atomic<size_t> nextSlot;
+    void *p = slot.get();
+    if (p == NULL) {
+        p = reinterpret_cast<void*>(++nextSlot);
+        slot.set(p);
+    }
+    return reinterpret_cast<size_t>(p) - 1;
+}
+
+/**
+ * A counter that's updated a lot more often than it's read.
+ *
+ * Updates go to one of several shards, each on a cache line of its
+ * own, picked by the updating thread, so threads updating at the
+ * same time mostly don't fight over a cache line.  Reading adds up
+ * the shards.
+ *
+ * Individual shards wrap around when a thread takes away what
+ * another one added, but the sum comes out right.  Unlike Atomic,
+ * updates don't return the new value, since getting it takes a
+ * read of every shard.  For checks on hot paths, getApprox() reads a
+ * total that the updates refresh whenever it may have drifted too far.
+ */
+template <typename T>
+class ShardedCounter {
+public:
+
+    //! Number of shards.
+    static const size_t SHARDS = 16;
+    /**
+     * A shard refreshes the approximate total once what it has added
+     * or taken away since is more than 1/2^DRIFT_SHIFT of the total.
+     */
+    static const int DRIFT_SHIFT = 8;
+
+    ShardedCounter(const T &initial = 0) {
+        set(initial);
+    }
+
+    T get() const {
+        T rv = 0;
+        for (size_t i = 0; i < SHARDS; ++i) {
+            rv += shards[i].value;
+        }
+        return rv;
+    }
+
+    /**
+     * Set the counter.
+     *
+     * Updates made at the same time may be lost.
+     */
+    void set(const T &newValue) {
+        shards[0].value = newValue;
+        shards[0].drift = 0;
+        for (size_t i = 1; i < SHARDS; ++i) {
+            shards[i].value = 0;
+            shards[i].drift = 0;
+        }
+        approx.value = newValue;
+        __sync_synchronize();
+    }
+
+    /**
+     * Get the total as of a recent update.
+     *
+     * It's off by at most SHARDS/2^DRIFT_SHIFT of itself (1/16), and
+     * costs a read of one mostly unchanging cache line.
+     */
+    T getApprox() const {
+        return approx.value;
+    }
+
+    operator T() const {
+        return get();
+    }
+
+    void operator =(const T &newValue) {
+        set(newValue);
+    }
+
+    void operator ++() {
+        incr(1);
+    }
+
+    void operator ++(int ignored) {
+        (void)ignored;
+        incr(1);
+    }
+
+    void operator --() {
+        decr(1);
+    }
+
+    void operator --(int ignored) {
+        (void)ignored;
+        decr(1);
+    }
+
+    void operator +=(const T &increment) {
+        incr(increment);
+    }
+
+    void operator -=(const T &decrement) {
+        decr(decrement);
+    }
+
+    void incr(const T &increment) {
+        Shard &s = shards[getThreadSlot() % SHARDS];
+        __sync_fetch_and_add(&s.value, increment);
+        noteUpdate(s, increment);
+    }
+
+    void decr(const T &decrement) {
+        Shard &s = shards[getThreadSlot() % SHARDS];
+        __sync_fetch_and_sub(&s.value, decrement);
+        noteUpdate(s, decrement);
+    }
+
+private:
+    // Each shard gets a cache line to itself.
+    struct __attribute__((aligned(CACHE_LINE_SIZE))) Shard {
+        volatile T value;
+        // How much was added or taken away since the last refresh.
+        // Threads sharing a shard may lose some of it, which only
+        // delays the refresh a little.
+        T          drift;
+    };
+
+    // Kept off the shards' lines, and off whatever the counter's
+    // owner keeps next to it.
+    struct __attribute__((aligned(CACHE_LINE_SIZE))) Total {
+        volatile T value;
+    };
+
+    void noteUpdate(Shard &s, const T &by) {
+        s.drift += by;
+        if (s.drift > (approx.value >> DRIFT_SHIFT)) {
+            s.drift = 0;
+            approx.value = get();
+        }
+    }
+
+    Shard shards[SHARDS];
+    Total approx;
+
+    DISALLOW_COPY_AND_ASSIGN(ShardedCounter);
+};
+
 /**
  * Atomic pointer.
  *
@@ -40,6 +40,9 @@ using SHARED_PTR_NAMESPACE::shared_ptr;
 #define UINT16_MAX 65535
 #endif /* UINT16_MAX */
 
+// Things written by different threads are kept this far apart.
+#define CACHE_LINE_SIZE 64
+
 // Stolen from http://google-styleguide.googlecode.com/svn/trunk/cppguide.xml
 // A macro to disallow the copy constructor and operator= functions
 // This should be used in the private: declarations for a class
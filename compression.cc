@@ -0,0 +1,203 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#include "config.h"
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <string>
+
+#include "compression.hh"
+
+// Hash table of recently seen three byte sequences.
+static const int hashBits = 12;
+// Literal runs are at most this long.
+static const size_t maxLiteral = 32;
+// Back references reach at most this far back...
+static const size_t maxOffset = 1 << 13;
+// ...and copy at most this much.
+static const size_t maxMatch = 7 + 255 + 2;
+// Smallest space saving worth paying decompression for, as a
+// fraction of the original size.
+static const size_t minSavingShift = 3;
+static const size_t headerSize = 4;
+
+static inline uint32_t hash3(const unsigned char *p) {
+    uint32_t v = (p[0] << 16) | (p[1] << 8) | p[2];
+    return ((v * 2654435761U) >> (32 - hashBits)) & ((1 << hashBits) - 1);
+}
+
+size_t ValueCompressor::compress(const char *input, size_t inlen,
+                                 char *output, size_t outlen) {
+    const unsigned char *in = reinterpret_cast<const unsigned char*>(input);
+    unsigned char *out = reinterpret_cast<unsigned char*>(output);
+    // Positions plus one, so zero is empty.
+    uint32_t table[1 << hashBits];
+    std::memset(table, 0, sizeof(table));
+
+    size_t ip = 0, op = 0;
+    if (outlen == 0) {
+        return 0;
+    }
+    // Each literal run is preceded by its length.
+    size_t run = op++;
+    size_t lit = 0;
+
+    while (ip < inlen) {
+        if (ip + 2 < inlen) {
+            uint32_t h = hash3(in + ip);
+            size_t ref = table[h];
+            table[h] = static_cast<uint32_t>(ip + 1);
+            if (ref != 0 && ip - ref < maxOffset
+                && std::memcmp(in + ref - 1, in + ip, 3) == 0) {
+                --ref;
+                size_t off = ip - ref - 1;
+                size_t limit = std::min(inlen - ip, maxMatch);
+                size_t len = 3;
+                while (len < limit && in[ref + len] == in[ip + len]) {
+                    ++len;
+                }
+
+                if (op + 3 + 1 > outlen) {
+                    return 0;
+                }
+                // Close the literal run, or take back its length byte.
+                if (lit > 0) {
+                    out[run] = static_cast<unsigned char>(lit - 1);
+                } else {
+                    --op;
+                }
+                size_t l = len - 2;
+                if (l < 7) {
+                    out[op++] = static_cast<unsigned char>((l << 5) | (off >> 8));
+                } else {
+                    out[op++] = static_cast<unsigned char>((7 << 5) | (off >> 8));
+                    out[op++] = static_cast<unsigned char>(l - 7);
+                }
+                out[op++] = static_cast<unsigned char>(off & 0xff);
+                run = op++;
+                lit = 0;
+
+                // Remember where the match went so later repeats of
+                // it are found, too.
+                size_t end = ip + len;
+                for (++ip; ip < end && ip + 2 < inlen; ++ip) {
+                    table[hash3(in + ip)] = static_cast<uint32_t>(ip + 1);
+                }
+                ip = end;
+                continue;
+            }
+        }
+
+        if (op + 1 > outlen) {
+            return 0;
+        }
+        out[op++] = in[ip++];
+        if (++lit == maxLiteral) {
+            out[run] = static_cast<unsigned char>(lit - 1);
+            if (op + 1 > outlen) {
+                return 0;
+            }
+            run = op++;
+            lit = 0;
+        }
+    }
+
+    if (lit > 0) {
+        out[run] = static_cast<unsigned char>(lit - 1);
+    } else {
+        --op;
+    }
+    return op;
+}
+
+size_t ValueCompressor::decompress(const char *input, size_t inlen,
+                                   char *output, size_t outlen) {
+    const unsigned char *in = reinterpret_cast<const unsigned char*>(input);
+    unsigned char *out = reinterpret_cast<unsigned char*>(output);
+    size_t ip = 0, op = 0;
+
+    while (ip < inlen) {
+        size_t ctrl = in[ip++];
+        if (ctrl < maxLiteral) {
+            size_t n = ctrl + 1;
+            if (ip + n > inlen || op + n > outlen) {
+                return 0;
+            }
+            std::memcpy(out + op, in + ip, n);
+            ip += n;
+            op += n;
+        } else {
+            size_t len = ctrl >> 5;
+            if (len == 7) {
+                if (ip >= inlen) {
+                    return 0;
+                }
+                len += in[ip++];
+            }
+            if (ip >= inlen) {
+                return 0;
+            }
+            size_t back = ((ctrl & 0x1f) << 8) + in[ip++] + 1;
+            len += 2;
+            if (back > op || op + len > outlen) {
+                return 0;
+            }
+            // Byte at a time: the source may overlap what's written.
+            const unsigned char *ref = out + op - back;
+            for (size_t i = 0; i < len; ++i) {
+                out[op + i] = ref[i];
+            }
+            op += len;
+        }
+    }
+    return op;
+}
+
+value_t ValueCompressor::compress(const value_t &v, EPStats &stats) {
+    hrtime_t start = gethrtime();
+    ++stats.numCompressions;
+
+    size_t len = v->length();
+    // Anything that doesn't save this much isn't kept.
+    size_t room = len - (len >> minSavingShift);
+    std::string buf(headerSize + room, '\0');
+    uint32_t raw = static_cast<uint32_t>(len);
+    for (size_t i = 0; i < headerSize; ++i) {
+        buf[i] = static_cast<char>(raw >> (8 * i));
+    }
+    size_t n = compress(v->getData(), len, &buf[headerSize], room);
+
+    value_t rv;
+    if (n > 0) {
+        rv.reset(Blob::New(buf.data(), headerSize + n));
+        ++stats.numCompressed;
+        stats.compressedInBytes.incr(len);
+        stats.compressedOutBytes.incr(headerSize + n);
+    }
+    stats.compressTime.incr((gethrtime() - start) / 1000);
+    return rv;
+}
+
+value_t ValueCompressor::decompress(const value_t &v, EPStats &stats) {
+    hrtime_t start = gethrtime();
+    ++stats.numDecompressions;
+
+    size_t len = rawLength(v);
+    Blob *b = Blob::New(len, '\0');
+    size_t n = decompress(v->getData() + headerSize, v->length() - headerSize,
+                          const_cast<char*>(b->getData()), len);
+    assert(n == len);
+    (void)n;
+
+    stats.decompressTime.incr((gethrtime() - start) / 1000);
+    return value_t(b);
+}
+
+size_t ValueCompressor::rawLength(const value_t &v) {
+    assert(v->length() >= headerSize);
+    const unsigned char *p = reinterpret_cast<const unsigned char*>(v->getData());
+    uint32_t rv = 0;
+    for (size_t i = 0; i < headerSize; ++i) {
+        rv |= static_cast<uint32_t>(p[i]) << (8 * i);
+    }
+    return rv;
+}
@@ -0,0 +1,78 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#ifndef COMPRESSION_H
+#define COMPRESSION_H 1
+
+#include "common.hh"
+#include "atomic.hh"
+#include "item.hh"
+#include "stats.hh"
+
+/**
+ * Compression of values kept in memory.
+ *
+ * The codec is a small LZ77 variant in the style of LZF: runs of
+ * literals and back references of up to 264 bytes within the last
+ * 8KB.  It doesn't compress as well as deflate, but it runs at memory
+ * speed in both directions, which is what matters for values that
+ * are decompressed on every read.
+ *
+ * A compressed value is a Blob holding the uncompressed length (four
+ * bytes, little endian) followed by the compressed stream.
+ */
+class ValueCompressor {
+public:
+
+    /**
+     * Compress a buffer.
+     *
+     * @param in the data to compress
+     * @param inlen the length of the data
+     * @param out where to put the compressed data
+     * @param outlen the room at out
+     *
+     * @return the compressed length, or 0 if it didn't fit in outlen
+     */
+    static size_t compress(const char *in, size_t inlen,
+                           char *out, size_t outlen);
+
+    /**
+     * Decompress a buffer.
+     *
+     * Malformed input is detected rather than trusted.
+     *
+     * @param in the compressed data
+     * @param inlen the length of the compressed data
+     * @param out where to put the decompressed data
+     * @param outlen the room at out
+     *
+     * @return the decompressed length, or 0 if the input was bad or
+     *         didn't fit in outlen
+     */
+    static size_t decompress(const char *in, size_t inlen,
+                             char *out, size_t outlen);
+
+    /**
+     * Compress a value if that makes it meaningfully smaller.
+     *
+     * @param v the value to compress
+     * @param stats where to count the compression
+     * @return the compressed value, or an empty value_t if it's not
+     *         worth it
+     */
+    static value_t compress(const value_t &v, EPStats &stats);
+
+    /**
+     * Decompress a value made by compress().
+     */
+    static value_t decompress(const value_t &v, EPStats &stats);
+
+    /**
+     * Get the uncompressed length of a value made by compress().
+     */
+    static size_t rawLength(const value_t &v);
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(ValueCompressor);
+};
+
+#endif /* COMPRESSION_H */
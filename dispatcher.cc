@@ -16,6 +16,8 @@
 #include "config.h"
 #include "dispatcher.hh"
 
+LockStats Dispatcher::lockStats("dispatcher");
+
 extern "C" {
     static void* launch_dispatcher_thread(void* arg);
 }
@@ -123,7 +123,7 @@ public:
  */
 class Dispatcher {
 public:
-    Dispatcher() : state(dispatcher_running) { }
+    Dispatcher() : mutex(&lockStats), state(dispatcher_running) { }
 
     ~Dispatcher() {
         stop();
@@ -193,6 +193,9 @@ private:
     std::priority_queue<TaskId, std::deque<TaskId >,
                         CompareTasks> queue;
     enum dispatcher_state state;
+
+    // All dispatchers are profiled together.
+    static LockStats lockStats;
 };
 
 #endif
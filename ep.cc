@@ -16,6 +16,9 @@
  */
 
 #include "config.h"
+#include <algorithm>
+#include <map>
+#include <set>
 #include <vector>
 #include <time.h>
 #include <string.h>
@@ -46,8 +49,8 @@ public:
         ep(e), core(capi), key(k), vbucket(vbid), rowid(r), cookie(c),
         init(gethrtime()), start(0) {
         assert(ep);
-        assert(core);
-        assert(cookie);
+        // Without a cookie nobody's waiting, so there's nobody to notify.
+        assert(core || !cookie);
     }
 
     bool callback(Dispatcher &d, TaskId t) {
@@ -70,6 +73,32 @@ private:
     hrtime_t start;
 };
 
+class BGFetchManyCallback : public DispatcherCallback {
+public:
+    BGFetchManyCallback(EventuallyPersistentStore *e, SERVER_CORE_API *capi,
+                        const std::vector<BGFetchItem> &i, const void *c) :
+        ep(e), core(capi), items(i), cookie(c), init(gethrtime()), start(0) {
+        assert(ep);
+        assert(core || !cookie);
+    }
+
+    bool callback(Dispatcher &d, TaskId t) {
+        (void)d; (void)t;
+        start = gethrtime();
+        ep->completeBGFetchMany(items, cookie, core, init, start);
+        return false;
+    }
+
+private:
+    EventuallyPersistentStore *ep;
+    SERVER_CORE_API           *core;
+    std::vector<BGFetchItem>   items;
+    const void                *cookie;
+
+    hrtime_t init;
+    hrtime_t start;
+};
+
 class SetVBStateCallback : public DispatcherCallback {
 public:
     SetVBStateCallback(RCPtr<VBucket> vb, SERVER_CORE_API *c)
@@ -88,21 +117,37 @@ private:
     SERVER_CORE_API *core;
 };
 
+LockStats EventuallyPersistentStore::vbsetLockStats("vbset");
+
 EventuallyPersistentStore::EventuallyPersistentStore(EventuallyPersistentEngine &theEngine,
-                                                     StrategicSqlite3 *t,
+                                                     const std::vector<StrategicSqlite3*> &dbs,
                                                      bool startVb0) :
     engine(theEngine), stats(engine.getEpStats()),
-    loadStorageKVPairCallback(vbuckets, stats), bgFetchDelay(0)
+    loadStorageKVPairCallback(vbuckets, stats), vbsetMutex(vbsetLockStats),
+    bgFetchDelay(0), hotKeys(HOT_KEYS_TRACKED)
 {
+    assert(!dbs.empty());
     doPersistence = getenv("EP_NO_PERSISTENCE") == NULL;
+    // Only the flushers drain the keys of items found expired.
+    HashTable::setKeepExpired(doPersistence);
     dispatcher = new Dispatcher();
-    flusher = new Flusher(this, dispatcher);
+    underlying = dbs[0];
+
+    for (size_t i = 0; i < dbs.size(); ++i) {
+        dbs[i]->setWriter(i, dbs.size());
+        // The first flusher shares its thread with background fetches,
+        // the others get their own.
+        FlushShard *fs = new FlushShard(dbs[i],
+                                        i == 0 ? dispatcher : new Dispatcher());
+        fs->flusher = new Flusher(this, fs->dispatcher, i);
+        flushShards.push_back(fs);
+    }
 
     stats.memOverhead = sizeof(EventuallyPersistentStore);
 
     setTxnSize(DEFAULT_TXN_SIZE);
-
-    underlying = t;
+    setCommitBudget(0);
+    setVisitorThreads(1);
 
     if (startVb0) {
         RCPtr<VBucket> vb(new VBucket(0, active, stats));
@@ -111,7 +156,6 @@ EventuallyPersistentStore::EventuallyPersistentStore(EventuallyPersistentEngine
 
     startDispatcher();
     startFlusher();
-    assert(underlying);
 }
 
 class VerifyStoredVisitor : public HashTableVisitor {
@@ -128,37 +172,71 @@ EventuallyPersistentStore::~EventuallyPersistentStore() {
     stopFlusher();
     dispatcher->stop();
 
-    delete flusher;
+    std::vector<FlushShard*>::iterator it;
+    for (it = flushShards.begin(); it != flushShards.end(); ++it) {
+        if ((*it)->dispatcher != dispatcher) {
+            (*it)->dispatcher->stop();
+            delete (*it)->dispatcher;
+        }
+        delete (*it)->flusher;
+        delete *it;
+    }
     delete dispatcher;
 }
 
 void EventuallyPersistentStore::startDispatcher() {
     dispatcher->start();
+    std::vector<FlushShard*>::iterator it;
+    for (it = flushShards.begin(); it != flushShards.end(); ++it) {
+        if ((*it)->dispatcher != dispatcher) {
+            (*it)->dispatcher->start();
+        }
+    }
 }
 
-
-const Flusher* EventuallyPersistentStore::getFlusher() {
-    return flusher;
+enum flusher_state EventuallyPersistentStore::getFlusherState() {
+    enum flusher_state rv = stopped;
+    std::vector<FlushShard*>::iterator it;
+    for (it = flushShards.begin(); it != flushShards.end(); ++it) {
+        rv = std::min(rv, (*it)->flusher->state());
+    }
+    return rv;
 }
 
 void EventuallyPersistentStore::startFlusher() {
-    flusher->start();
+    std::vector<FlushShard*>::iterator it;
+    for (it = flushShards.begin(); it != flushShards.end(); ++it) {
+        (*it)->flusher->start();
+    }
 }
 
 void EventuallyPersistentStore::stopFlusher() {
-    bool rv = flusher->stop();
-    if (rv) {
-        flusher->wait();
+    // Let them all finish up at once.
+    std::vector<bool> stopping;
+    std::vector<FlushShard*>::iterator it;
+    for (it = flushShards.begin(); it != flushShards.end(); ++it) {
+        stopping.push_back((*it)->flusher->stop());
+    }
+    for (size_t i = 0; i < flushShards.size(); ++i) {
+        if (stopping[i]) {
+            flushShards[i]->flusher->wait();
+        }
     }
 }
 
 bool EventuallyPersistentStore::pauseFlusher() {
-    flusher->pause();
+    std::vector<FlushShard*>::iterator it;
+    for (it = flushShards.begin(); it != flushShards.end(); ++it) {
+        (*it)->flusher->pause();
+    }
     return true;
 }
 
 bool EventuallyPersistentStore::resumeFlusher() {
-    flusher->resume();
+    std::vector<FlushShard*>::iterator it;
+    for (it = flushShards.begin(); it != flushShards.end(); ++it) {
+        (*it)->flusher->resume();
+    }
     return true;
 }
 
@@ -174,6 +252,27 @@ RCPtr<VBucket> EventuallyPersistentStore::getVBucket(uint16_t vbid,
     }
 }
 
+/**
+ * Copies out whether an item can be ejected, to avoid locking for
+ * evictions that can't happen.
+ */
+class EvictionReader : public HashTableReader {
+public:
+    EvictionReader() : found(false), resident(false), dirty(false) {}
+
+    void copy(StoredValue *v) {
+        found = v != NULL;
+        if (found) {
+            resident = v->isResident();
+            dirty = v->isDirty();
+        }
+    }
+
+    bool found;
+    bool resident;
+    bool dirty;
+};
+
 protocol_binary_response_status EventuallyPersistentStore::evictKey(const std::string &key,
                                                                     uint16_t vbucket,
                                                                     const char **msg) {
@@ -182,6 +281,20 @@ protocol_binary_response_status EventuallyPersistentStore::evictKey(const std::s
         return PROTOCOL_BINARY_RESPONSE_NOT_MY_VBUCKET;
     }
 
+    // Only an item that looks ejectable is worth taking the lock for.
+    EvictionReader er;
+    vb->ht.read(key, er);
+    if (!er.found) {
+        *msg = "Not found.";
+        return PROTOCOL_BINARY_RESPONSE_KEY_ENOENT;
+    } else if (!er.resident) {
+        *msg = "Already ejected.";
+        return PROTOCOL_BINARY_RESPONSE_SUCCESS;
+    } else if (er.dirty) {
+        *msg = "Can't eject: Dirty or a small object.";
+        return PROTOCOL_BINARY_RESPONSE_SUCCESS;
+    }
+
     int bucket_num = vb->ht.bucket(key);
     LockHolder lh(vb->ht.getMutex(bucket_num));
     StoredValue *v = vb->ht.unlocked_find(key, bucket_num);
@@ -190,7 +303,7 @@ protocol_binary_response_status EventuallyPersistentStore::evictKey(const std::s
 
     if (v) {
         if (v->isResident()) {
-            if (v->ejectValue(stats)) {
+            if (vb->ht.unlocked_ejectValue(v)) {
                 ++stats.numValueEjects;
                 ++stats.numNonResident;
                 *msg = "Ejected.";
@@ -225,9 +338,17 @@ ENGINE_ERROR_CODE EventuallyPersistentStore::set(const Item &item,
         }
     }
 
+    // Replicas have to take whatever their master has.
+    if (!force && vb->exceedsHardQuota(item)) {
+        ++stats.vbQuotaRejects;
+        return ENGINE_TMPFAIL;
+    }
+
     bool cas_op = (item.getCas() != 0);
 
-    mutation_type_t mtype = vb->ht.set(item);
+    noteAccess(vb, item.getKey());
+    StoredRef ref;
+    mutation_type_t mtype = vb->ht.set(item, &ref);
 
     if (cas_op && mtype == NOT_FOUND) {
         return ENGINE_KEY_ENOENT;
@@ -238,7 +359,7 @@ ENGINE_ERROR_CODE EventuallyPersistentStore::set(const Item &item,
     } else if (mtype == IS_LOCKED) {
         return ENGINE_KEY_EEXISTS;
     } else if (mtype == WAS_CLEAN || mtype == NOT_FOUND) {
-        queueDirty(item.getKey(), item.getVBucketId(), queue_op_set);
+        queueDirty(vb, item.getKey(), ref);
         if (mtype == NOT_FOUND) {
             stats.curr_items++;
         }
@@ -268,6 +389,50 @@ void EventuallyPersistentStore::setVBucketState(uint16_t vbid,
     queueDirty(VBucket::toString(to), vbid, queue_op_vb_set);
 }
 
+bool EventuallyPersistentStore::resizeHashTables(size_t stripes) {
+    bool rv(false);
+    std::vector<int> vbucketIds(vbuckets.getBuckets());
+    std::vector<int>::iterator it;
+    for (it = vbucketIds.begin(); it != vbucketIds.end(); ++it) {
+        RCPtr<VBucket> vb = vbuckets.getBucket(*it);
+        if (vb) {
+            vb->ht.resize();
+            if (vb->ht.migrate(stripes)) {
+                rv = true;
+            }
+        }
+    }
+    return rv;
+}
+
+size_t EventuallyPersistentStore::getHashResizes() {
+    size_t rv(0);
+    std::vector<int> vbucketIds(vbuckets.getBuckets());
+    std::vector<int>::iterator it;
+    for (it = vbucketIds.begin(); it != vbucketIds.end(); ++it) {
+        RCPtr<VBucket> vb = vbuckets.getBucket(*it);
+        if (vb) {
+            rv += vb->ht.getNumResizes();
+        }
+    }
+    return rv;
+}
+
+bool EventuallyPersistentStore::anyOverSoftQuota() {
+    if (stats.vbMemSoftQuota.get() == 0) {
+        return false;
+    }
+    std::vector<int> vbucketIds(vbuckets.getBuckets());
+    std::vector<int>::iterator it;
+    for (it = vbucketIds.begin(); it != vbucketIds.end(); ++it) {
+        RCPtr<VBucket> vb = vbuckets.getBucket(*it);
+        if (vb && vb->overSoftQuota()) {
+            return true;
+        }
+    }
+    return false;
+}
+
 bool EventuallyPersistentStore::deleteVBucket(uint16_t vbid) {
     // Lock to prevent a race condition between a failed update and add (and delete).
     LockHolder lh(vbsetMutex);
@@ -303,24 +468,76 @@ void EventuallyPersistentStore::completeBGFetch(const std::string &key,
 
     // Lock to prevent a race condition between a fetch for restore and delete
     LockHolder lh(vbsetMutex);
+    restoreFetched(key, vbucket, gcb.val);
+    lh.unlock();
 
+    recordBGFetchTimes(init, start, gethrtime());
+
+    if (cookie) {
+        core->notify_io_complete(cookie, gcb.val.getStatus());
+    }
+    delete gcb.val.getValue();
+}
+
+void EventuallyPersistentStore::completeBGFetchMany(const std::vector<BGFetchItem> &items,
+                                                    const void *cookie,
+                                                    SERVER_CORE_API *core,
+                                                    hrtime_t init, hrtime_t start) {
+    bgFetchQueue.decr(items.size());
+    stats.bg_fetched.incr(items.size());
+    ++stats.bgFetchBatches;
+    getLogger()->log(EXTENSION_LOG_DEBUG, NULL,
+                     "Completed a background fetch of %zd items, now at %zd\n",
+                     items.size(), bgFetchQueue.get());
+
+    // Read everything before taking the lock so deletes don't wait
+    // on the disk.
+    std::vector<GetValue> fetched(items.size());
+    for (size_t i = 0; i < items.size(); ++i) {
+        RememberingCallback<GetValue> gcb;
+        underlying->get(items[i].key, items[i].rowid, gcb);
+        gcb.waitForValue();
+        assert(gcb.fired);
+        fetched[i] = gcb.val;
+    }
+
+    LockHolder lh(vbsetMutex);
+    for (size_t i = 0; i < items.size(); ++i) {
+        restoreFetched(items[i].key, items[i].vbucket, fetched[i]);
+    }
+    lh.unlock();
+
+    recordBGFetchTimes(init, start, gethrtime());
+
+    // The requestor asks again for whatever it wants.
+    if (cookie) {
+        core->notify_io_complete(cookie, ENGINE_SUCCESS);
+    }
+    for (size_t i = 0; i < fetched.size(); ++i) {
+        delete fetched[i].getValue();
+    }
+}
+
+void EventuallyPersistentStore::restoreFetched(const std::string &key,
+                                               uint16_t vbucket,
+                                               GetValue &gv) {
     RCPtr<VBucket> vb = getVBucket(vbucket);
-    if (vb && vb->getState() == active && gcb.val.getStatus() == ENGINE_SUCCESS) {
+    if (vb && vb->getState() == active && gv.getStatus() == ENGINE_SUCCESS) {
         int bucket_num = vb->ht.bucket(key);
         LockHolder vblh(vb->ht.getMutex(bucket_num));
         StoredValue *v = vb->ht.unlocked_find(key, bucket_num);
 
         if (v) {
-            if (v->restoreValue(gcb.val.getValue()->getValue(), stats)) {
+            if (vb->ht.unlocked_restoreValue(v, gv.getValue()->getValue())) {
                 --stats.numNonResident;
             }
         }
     }
+}
 
-    lh.unlock();
-
-    hrtime_t stop = gethrtime();
-
+void EventuallyPersistentStore::recordBGFetchTimes(hrtime_t init,
+                                                   hrtime_t start,
+                                                   hrtime_t stop) {
     if (stop > start && start > init) {
         // skip the measurement if the counter wrapped...
         ++stats.bgNumOperations;
@@ -334,9 +551,6 @@ void EventuallyPersistentStore::completeBGFetch(const std::string &key,
         stats.bgMinLoad.setIfLess(l);
         stats.bgMaxLoad.setIfBigger(l);
     }
-
-    core->notify_io_complete(cookie, gcb.val.getStatus());
-    delete gcb.val.getValue();
 }
 
 void EventuallyPersistentStore::bgFetch(const std::string &key,
@@ -354,6 +568,222 @@ void EventuallyPersistentStore::bgFetch(const std::string &key,
     dispatcher->schedule(dcb, NULL, -1, bgFetchDelay);
 }
 
+void EventuallyPersistentStore::bgFetchMany(const std::vector<BGFetchItem> &items,
+                                            const void *cookie,
+                                            SERVER_CORE_API *core) {
+    assert(!items.empty());
+    shared_ptr<BGFetchManyCallback> dcb(new BGFetchManyCallback(this, core,
+                                                                items, cookie));
+    bgFetchQueue.incr(items.size());
+    getLogger()->log(EXTENSION_LOG_DEBUG, NULL,
+                     "Queued a background fetch of %zd items, now at %zd\n",
+                     items.size(), bgFetchQueue.get());
+    dispatcher->schedule(dcb, NULL, -1, bgFetchDelay);
+}
+
+// Lock stripes handed to a parallel visit thread at a time.
+static const int stripesPerPiece = 8;
+
+/**
+ * The work of a parallel visit, handed out a few lock stripes of a
+ * vbucket at a time.
+ */
+class ParallelVisit {
+public:
+
+    ParallelVisit(VBucketMap &vbm) : vbuckets(vbm), ids(vbm.getBuckets()),
+                                     current(0), nextLock(0), aborted(false) {}
+
+    /**
+     * Visit pieces with the given visitor until there are none left.
+     */
+    void run(VBucketVisitor &visitor) {
+        RCPtr<VBucket> vb;
+        int first(0), last(0);
+        int visiting(-1);
+        bool wanted(false);
+        while (next(vb, &first, &last)) {
+            if (vb->getId() != visiting) {
+                visiting = vb->getId();
+                wanted = visitor.visitBucket(visiting, vb->getState());
+            }
+            if (wanted) {
+                vb->ht.visitStripes(visitor, first, last);
+                if (!visitor.shouldContinue()) {
+                    LockHolder lh(mutex);
+                    aborted = true;
+                }
+            }
+        }
+    }
+
+private:
+
+    bool next(RCPtr<VBucket> &vb, int *first, int *last) {
+        LockHolder lh(mutex);
+        while (!aborted && current < ids.size()) {
+            RCPtr<VBucket> b = vbuckets.getBucket(ids[current]);
+            // We could've lost this along the way.
+            int nlocks = b ? static_cast<int>(b->ht.getNumLocks()) : 0;
+            if (nextLock < nlocks) {
+                vb = b;
+                *first = nextLock;
+                nextLock = std::min(nextLock + stripesPerPiece, nlocks);
+                *last = nextLock;
+                return true;
+            }
+            ++current;
+            nextLock = 0;
+        }
+        return false;
+    }
+
+    Mutex             mutex;
+    VBucketMap       &vbuckets;
+    std::vector<int>  ids;
+    size_t            current;
+    int               nextLock;
+    bool              aborted;
+};
+
+/**
+ * One thread of a parallel visit.
+ */
+class VisitWorker {
+public:
+    VisitWorker(ParallelVisit &w, VBucketVisitor *v) : work(w), visitor(v) {}
+
+    ParallelVisit  &work;
+    VBucketVisitor *visitor;
+    pthread_t       thread;
+};
+
+extern "C" {
+    static void* launch_visit_worker(void *arg) {
+        VisitWorker *vw = static_cast<VisitWorker*>(arg);
+        vw->work.run(*vw->visitor);
+        return NULL;
+    }
+}
+
+void EventuallyPersistentStore::parallelVisit(VBucketVisitor &visitor) {
+    size_t nthreads = getVisitorThreads();
+    ParallelVisit work(vbuckets);
+    std::vector<VisitWorker*> workers;
+    for (size_t i = 0; nthreads > 1 && i < nthreads; ++i) {
+        VBucketVisitor *v = visitor.forWorker();
+        if (v == NULL) {
+            break;
+        }
+        workers.push_back(new VisitWorker(work, v));
+    }
+
+    if (workers.empty()) {
+        visit(visitor);
+        return;
+    }
+
+    // The calling thread takes the first share, and any share a
+    // thread couldn't be started for.
+    std::vector<VisitWorker*> started;
+    for (size_t i = 1; i < workers.size(); ++i) {
+        if (pthread_create(&workers[i]->thread, NULL,
+                           launch_visit_worker, workers[i]) == 0) {
+            started.push_back(workers[i]);
+        } else {
+            getLogger()->log(EXTENSION_LOG_WARNING, NULL,
+                             "Error creating visitor thread, visiting with fewer\n");
+        }
+    }
+    work.run(*workers[0]->visitor);
+    for (size_t i = 0; i < started.size(); ++i) {
+        pthread_join(started[i]->thread, NULL);
+    }
+
+    for (size_t i = 0; i < workers.size(); ++i) {
+        if (workers[i]->visitor != &visitor) {
+            visitor.merge(*workers[i]->visitor);
+            delete workers[i]->visitor;
+        }
+        delete workers[i];
+    }
+}
+
+EventuallyPersistentStore::Position
+EventuallyPersistentStore::pauseResumeVisit(VBucketVisitor &visitor,
+                                            const Position &start,
+                                            size_t maxBuckets) {
+    Position pos(start);
+    std::vector<int> vbucketIds(vbuckets.getBuckets());
+    std::vector<int>::iterator it;
+    for (it = vbucketIds.begin(); it != vbucketIds.end(); ++it) {
+        int vbid = *it;
+        if (vbid < pos.vbid) {
+            continue;
+        } else if (vbid > pos.vbid) {
+            // The one we paused in went away.
+            pos = Position(vbid);
+        }
+
+        RCPtr<VBucket> vb = vbuckets.getBucket(vbid);
+        if (!pos.visiting) {
+            pos.visiting = visitor.visitBucket(vbid, vb ? vb->getState() : dead);
+        }
+        // We could've lost this along the way.
+        if (!pos.visiting || !vb) {
+            pos = Position(vbid + 1);
+            continue;
+        }
+
+        pos.htPos = vb->ht.pauseResumeVisit(visitor, pos.htPos, maxBuckets);
+        if (pos.htPos == vb->ht.endPosition()) {
+            pos = Position(vbid + 1);
+        }
+        return pos;
+    }
+
+    pos.done = true;
+    return pos;
+}
+
+/**
+ * Copies out everything a get needs.
+ */
+class GetReader : public HashTableReader {
+public:
+    GetReader() : found(false), resident(false), locked(false),
+                  compressed(false), flags(0), exptime(0), cas(0), id(-1) {}
+
+    void copy(StoredValue *v) {
+        found = v != NULL;
+        if (found) {
+            v->referenced();
+            resident = v->isResident();
+            locked = v->peekLocked(ep_current_time());
+            flags = v->getFlags();
+            exptime = v->getExptime();
+            cas = v->getCas();
+            id = v->getId();
+            // Decompressing waits until the read is known to be good.
+            compressed = v->isCompressed();
+            // Take the copy's reference rather than another one.
+            v->getStoredValue().swap(value);
+        } else {
+            value.reset();
+        }
+    }
+
+    bool       found;
+    bool       resident;
+    bool       locked;
+    bool       compressed;
+    uint32_t   flags;
+    rel_time_t exptime;
+    uint64_t   cas;
+    int64_t    id;
+    value_t    value;
+};
+
 GetValue EventuallyPersistentStore::get(const std::string &key,
                                         uint16_t vbucket,
                                         const void *cookie,
@@ -371,27 +801,132 @@ GetValue EventuallyPersistentStore::get(const std::string &key,
         }
     }
 
-    int bucket_num = vb->ht.bucket(key);
-    LockHolder lh(vb->ht.getMutex(bucket_num));
-    StoredValue *v = vb->ht.unlocked_find(key, bucket_num);
+    noteAccess(vb, key);
+    GetReader gr;
+    vb->ht.read(key, gr);
 
-    if (v) {
+    if (gr.found) {
         // If the value is not resident, wait for it...
-        if (!v->isResident()) {
-            bgFetch(key, vbucket, v->getId(), cookie, core);
+        if (!gr.resident) {
+            bgFetch(key, vbucket, gr.id, cookie, core);
             return GetValue(NULL, ENGINE_EWOULDBLOCK);
         }
 
+        if (gr.compressed) {
+            gr.value = ValueCompressor::decompress(gr.value, stats);
+        }
+
         // return an invalid cas value if the item is locked
-        GetValue rv(new Item(v->getKey(), v->getFlags(), v->getExptime(),
-                             v->getValue(),
-                             v->isLocked(ep_current_time()) ? -1 : v->getCas()));
-        lh.unlock();
-        return rv;
+        return GetValue(new Item(key, gr.flags, gr.exptime, gr.value,
+                                 gr.locked ? -1 : gr.cas));
     } else {
-        GetValue rv;
-        lh.unlock();
-        return rv;
+        return GetValue();
+    }
+}
+
+/**
+ * Where a key of a batch get lives.
+ */
+class BatchGetKey {
+public:
+    BatchGetKey(uint16_t vb, int l, int b, size_t i)
+        : vbid(vb), lock(l), bucket(b), idx(i) {}
+
+    bool operator <(const BatchGetKey &other) const {
+        if (vbid != other.vbid) {
+            return vbid < other.vbid;
+        }
+        return lock == other.lock ? idx < other.idx : lock < other.lock;
+    }
+
+    uint16_t vbid;
+    int      lock;
+    int      bucket;
+    // Where the key is in the request.
+    size_t   idx;
+};
+
+void EventuallyPersistentStore::getMany(const std::vector<std::pair<uint16_t,
+                                                                  std::string> > &keys,
+                                        std::vector<GetValue> &values,
+                                        const void *cookie,
+                                        SERVER_CORE_API *core) {
+    values.assign(keys.size(), GetValue());
+
+    // Look up each vbucket once, and hash every key while the
+    // buckets they land in are loaded into the cache.
+    std::map<uint16_t, RCPtr<VBucket> > vbs;
+    std::map<uint16_t, ENGINE_ERROR_CODE> refused;
+    std::vector<BatchGetKey> todo;
+    todo.reserve(keys.size());
+    for (size_t i = 0; i < keys.size(); ++i) {
+        uint16_t vbid = keys[i].first;
+        std::map<uint16_t, ENGINE_ERROR_CODE>::iterator r = refused.find(vbid);
+        if (r != refused.end()) {
+            values[i] = GetValue(NULL, r->second);
+            continue;
+        }
+
+        std::map<uint16_t, RCPtr<VBucket> >::iterator found = vbs.find(vbid);
+        if (found == vbs.end()) {
+            RCPtr<VBucket> vb = getVBucket(vbid);
+            ENGINE_ERROR_CODE err = ENGINE_SUCCESS;
+            if (!vb || vb->getState() == dead || vb->getState() == replica) {
+                err = ENGINE_NOT_MY_VBUCKET;
+            } else if (vb->getState() == pending && vb->addPendingOp(cookie)) {
+                err = ENGINE_EWOULDBLOCK;
+            }
+            if (err != ENGINE_SUCCESS) {
+                refused[vbid] = err;
+                values[i] = GetValue(NULL, err);
+                continue;
+            }
+            found = vbs.insert(std::make_pair(vbid, vb)).first;
+        }
+
+        noteAccess(found->second, keys[i].second);
+        HashTable &ht = found->second->ht;
+        int bucket_num = ht.bucket(keys[i].second);
+        ht.prefetchBucket(bucket_num);
+        todo.push_back(BatchGetKey(vbid, ht.getLockNum(bucket_num),
+                                   bucket_num, i));
+    }
+    std::sort(todo.begin(), todo.end());
+
+    std::vector<BGFetchItem> fetches;
+    rel_time_t now = ep_current_time();
+    std::vector<BatchGetKey>::iterator it = todo.begin();
+    while (it != todo.end()) {
+        HashTable &ht = vbs[it->vbid]->ht;
+        LockHolder lh(ht.getMutexForLock(it->lock));
+        std::vector<BatchGetKey>::iterator end = it;
+        for (; end != todo.end() && end->vbid == it->vbid
+                 && end->lock == it->lock; ++end) {
+            const std::string &key = keys[end->idx].second;
+            StoredValue *v = ht.unlocked_find(key, end->bucket);
+            if (v == NULL) {
+                continue;
+            }
+
+            v->referenced();
+            if (!v->isResident()) {
+                fetches.push_back(BGFetchItem(key, end->vbid, v->getId()));
+                values[end->idx] = GetValue(NULL, ENGINE_EWOULDBLOCK);
+                continue;
+            }
+
+            // return an invalid cas value if the item is locked
+            values[end->idx] = GetValue(new Item(key, v->getFlags(),
+                                                 v->getExptime(),
+                                                 v->getValue(stats),
+                                                 v->peekLocked(now)
+                                                 ? -1 : v->getCas()));
+        }
+        it = end;
+    }
+
+    if (!fetches.empty()) {
+        bgFetchMany(fetches, cookie, core);
     }
 }
 
@@ -419,12 +954,21 @@ bool EventuallyPersistentStore::getLocked(const std::string &key,
             return false;
         }
 
+        v->referenced();
+        if (!v->isResident()) {
+            // Page it in for the client's retry rather than block here.
+            bgFetch(key, vbucket, v->getId(), NULL, NULL);
+            GetValue rv(NULL, ENGINE_TMPFAIL);
+            cb.callback(rv);
+            return false;
+        }
+
         // acquire lock and increment cas value
 
         v->lock(currentTime + lockTimeout);
 
         Item *it = new Item(v->getKey(), v->getFlags(), v->getExptime(),
-                            v->getValue(), v->getCas());
+                            v->getValue(stats), v->getCas());
 
         it->setCas();
         v->setCas(it->getCas());
@@ -440,6 +984,32 @@ bool EventuallyPersistentStore::getLocked(const std::string &key,
     return true;
 }
 
+/**
+ * Copies out the stats for a key.
+ */
+class KeyStatsReader : public HashTableReader {
+public:
+    KeyStatsReader(struct key_stats &ks) : found(false), kstats(ks) {}
+
+    void copy(StoredValue *v) {
+        found = v != NULL;
+        if (found) {
+            kstats.dirty = v->isDirty();
+            kstats.exptime = v->getExptime();
+            kstats.flags = v->getFlags();
+            kstats.cas = v->getCas();
+            // TODO:  Know this somehow.
+            kstats.dirtied = 0; // v->getDirtied();
+            kstats.data_age = v->getDataAge();
+        }
+    }
+
+    bool found;
+
+private:
+    struct key_stats &kstats;
+};
+
 bool EventuallyPersistentStore::getKeyStats(const std::string &key,
                                             uint16_t vbucket,
                                             struct key_stats &kstats)
@@ -449,22 +1019,9 @@ bool EventuallyPersistentStore::getKeyStats(const std::string &key,
         return false;
     }
 
-    bool found = false;
-    int bucket_num = vb->ht.bucket(key);
-    LockHolder lh(vb->ht.getMutex(bucket_num));
-    StoredValue *v = vb->ht.unlocked_find(key, bucket_num);
-
-    found = (v != NULL);
-    if (found) {
-        kstats.dirty = v->isDirty();
-        kstats.exptime = v->getExptime();
-        kstats.flags = v->getFlags();
-        kstats.cas = v->getCas();
-        // TODO:  Know this somehow.
-        kstats.dirtied = 0; // v->getDirtied();
-        kstats.data_age = v->getDataAge();
-    }
-    return found;
+    KeyStatsReader ksr(kstats);
+    vb->ht.read(key, ksr);
+    return ksr.found;
 }
 
 void EventuallyPersistentStore::setMinDataAge(int to) {
@@ -491,6 +1048,7 @@ ENGINE_ERROR_CODE EventuallyPersistentStore::del(const std::string &key,
         }
     }
 
+    noteAccess(vb, key);
     bool existed = vb->ht.del(key);
     ENGINE_ERROR_CODE rv = existed ? ENGINE_SUCCESS : ENGINE_KEY_ENOENT;
 
@@ -501,6 +1059,30 @@ ENGINE_ERROR_CODE EventuallyPersistentStore::del(const std::string &key,
     return rv;
 }
 
+void EventuallyPersistentStore::deleteExpiredItems(std::list<std::pair<uint16_t,
+                                                                     std::string> > &keys,
+                                                   rel_time_t asOf) {
+    std::list<std::pair<uint16_t, std::string> >::iterator it = keys.begin();
+    while (it != keys.end()) {
+        bool deleted(false);
+        RCPtr<VBucket> vb = getVBucket(it->first, active);
+        if (vb) {
+            int bucket_num = vb->ht.bucket(it->second);
+            LockHolder lh(vb->ht.getMutex(bucket_num));
+            // It may have been deleted, or given a new life, since.
+            deleted = vb->ht.unlocked_delExpired(it->second, bucket_num, asOf);
+        }
+
+        if (deleted) {
+            queueDirty(it->second, it->first, queue_op_del);
+            stats.curr_items--;
+            ++it;
+        } else {
+            it = keys.erase(it);
+        }
+    }
+}
+
 void EventuallyPersistentStore::reset() {
     std::vector<int> buckets = vbuckets.getBuckets();
     std::vector<int>::iterator it;
@@ -513,62 +1095,96 @@ void EventuallyPersistentStore::reset() {
     queueDirty("", 0, queue_op_flush);
 }
 
-std::queue<QueuedItem>* EventuallyPersistentStore::beginFlush() {
-    std::queue<QueuedItem> *rv(NULL);
-    if (towrite.empty() && writing.empty()) {
-        stats.dirtyAge = 0;
+// The queue and todo counts are over all of the flushers, so they're
+// only ever adjusted by what one of them takes or puts back.
+// Put each run of items between barriers in flush order.
+static void sortForFlush(std::queue<DirtyItem> &q) {
+    std::vector<DirtyItem> items;
+    items.reserve(q.size());
+    while (!q.empty()) {
+        items.push_back(q.front());
+        q.pop();
+    }
+
+    std::vector<DirtyItem>::iterator start = items.begin(), it;
+    for (it = items.begin(); it != items.end(); ++it) {
+        if (it->isBarrier()) {
+            std::stable_sort(start, it);
+            start = it + 1;
+        }
+    }
+    std::stable_sort(start, items.end());
+
+    for (it = items.begin(); it != items.end(); ++it) {
+        q.push(*it);
+    }
+}
+
+void EventuallyPersistentStore::queueExpiredDeletes() {
+    std::vector<int> vbucketIds(vbuckets.getBuckets());
+    std::vector<int>::iterator it;
+    for (it = vbucketIds.begin(); it != vbucketIds.end(); ++it) {
+        RCPtr<VBucket> vb = vbuckets.getBucket(*it);
+        if (!vb) {
+            continue;
+        }
+        std::vector<std::string> keys;
+        vb->ht.takeExpired(keys);
+        // Replicas hear about deletes from their master, as with
+        // the expiry pager.
+        if (vb->getState() != active) {
+            continue;
+        }
+        std::vector<std::string>::iterator kit;
+        for (kit = keys.begin(); kit != keys.end(); ++kit) {
+            queueDirty(*kit, static_cast<uint16_t>(*it), queue_op_del);
+        }
+    }
+}
+
+std::queue<DirtyItem>* EventuallyPersistentStore::beginFlush(size_t shard) {
+    FlushShard *fs = flushShards[shard];
+    std::queue<DirtyItem> *rv(NULL);
+    if (shard == 0) {
+        // Items that expired where they were found were deleted
+        // without queueing the delete.
+        queueExpiredDeletes();
+    }
+    if (fs->towrite.empty() && fs->writing.empty()) {
+        if (stats.queue_size.get() == 0 && stats.flusher_todo.get() == 0) {
+            stats.dirtyAge = 0;
+        }
     } else {
-        assert(underlying);
-        towrite.getAll(writing);
-        stats.flusher_todo.set(writing.size());
-        stats.queue_size.set(towrite.size());
+        assert(fs->underlying);
+        fs->towrite.getAll(fs->writing);
+        sortForFlush(fs->writing);
+        stats.flusher_todo.incr(fs->writing.size());
+        stats.queue_size.decr(fs->writing.size());
         getLogger()->log(EXTENSION_LOG_DEBUG, NULL,
-                         "Flushing %d items with %d still in queue\n",
-                         writing.size(), towrite.size());
-        rv = &writing;
+                         "Flusher %d flushing %d items with %d still in queue\n",
+                         shard, fs->writing.size(), stats.queue_size.get());
+        rv = &fs->writing;
     }
     return rv;
 }
 
-void EventuallyPersistentStore::completeFlush(std::queue<QueuedItem> *rej,
+void EventuallyPersistentStore::completeFlush(size_t shard,
+                                              std::queue<DirtyItem> *rej,
                                               rel_time_t flush_start) {
+    FlushShard *fs = flushShards[shard];
     // Requeue the rejects.
-    stats.queue_size += rej->size();
+    stats.queue_size.incr(rej->size());
     while (!rej->empty()) {
-        writing.push(rej->front());
+        fs->writing.push(rej->front());
         rej->pop();
     }
 
-    stats.queue_size.set(towrite.size() + writing.size());
     rel_time_t complete_time = ep_current_time();
     stats.flushDuration.set(complete_time - flush_start);
     stats.flushDurationHighWat.set(std::max(stats.flushDuration.get(),
                                             stats.flushDurationHighWat.get()));
 }
 
-int EventuallyPersistentStore::flushSome(std::queue<QueuedItem> *q,
-                                         std::queue<QueuedItem> *rejectQueue) {
-    int tsz = getTxnSize();
-    underlying->begin();
-    int oldest = stats.min_data_age;
-    for (int i = 0; i < tsz && !q->empty() && bgFetchQueue == 0; i++) {
-        int n = flushOne(q, rejectQueue);
-        if (n != 0 && n < oldest) {
-            oldest = n;
-        }
-    }
-    rel_time_t cstart = ep_current_time();
-    while (!underlying->commit()) {
-        sleep(1);
-        stats.commitFailed++;
-    }
-    rel_time_t complete_time = ep_current_time();
-
-    stats.commit_time.set(complete_time - cstart);
-    return oldest;
-}
-
-
 // This class exists to create a closure around a few variables within
 // EventuallyPersistentStore::flushOne so that an object can be
 // requeued in case of failure to store in the underlying layer.
@@ -577,7 +1193,7 @@ class Requeuer : public Callback<std::pair<bool, int64_t> >,
                  public Callback<bool> {
 public:
 
-    Requeuer(const QueuedItem &qi, std::queue<QueuedItem> *q,
+    Requeuer(const DirtyItem &qi, std::queue<DirtyItem> *q,
              StoredValue *v, rel_time_t qd, rel_time_t d, struct EPStats *s) :
         queuedItem(qi), rq(q), sval(v), queued(qd), dirtied(d), stats(s) {
         assert(rq);
@@ -608,8 +1224,8 @@ public:
     }
 
 private:
-    const QueuedItem queuedItem;
-    std::queue<QueuedItem> *rq;
+    const DirtyItem queuedItem;
+    std::queue<DirtyItem> *rq;
     StoredValue *sval;
     rel_time_t queued;
     rel_time_t dirtied;
@@ -617,25 +1233,243 @@ private:
     DISALLOW_COPY_AND_ASSIGN(Requeuer);
 };
 
-int EventuallyPersistentStore::flushOneDeleteAll() {
-    underlying->reset();
+// Sets or deletes decided on by flushOneDelOrSet, handed to the store
+// together.  Each result is dealt with as a Requeuer would.
+class FlushBatch : public Callback<std::vector<std::pair<bool, int64_t> > >,
+                   public Callback<std::vector<bool> > {
+public:
+
+    FlushBatch(StrategicSqlite3 *u, std::queue<DirtyItem> *q, EPStats &s) :
+        underlying(u), rq(q), stats(s), epoch(NULL) {
+        assert(rq);
+    }
+
+    ~FlushBatch() {
+        assert(writes.empty());
+        assert(epoch == NULL);
+    }
+
+    /**
+     * Make room for one more write, and hold the epoch so an item
+     * looked up for it isn't freed before its results are in.
+     */
+    void hold() {
+        if (writes.size() >= MAX_FLUSH_BATCH) {
+            write();
+        }
+        if (epoch == NULL) {
+            epoch = new EpochHolder();
+        }
+    }
+
+    // Takes over val.
+    void set(const DirtyItem &qi, Item *val, StoredValue *v,
+             rel_time_t queued, rel_time_t dirtied) {
+        // Writes to one key must stay in order, so whatever was
+        // decided before this goes first.
+        if (!keys.empty()) {
+            writePending();
+        }
+        if (!pendingValues.insert(v).second) {
+            // Written again before the first write's results are in:
+            // an insert's rowid must be known so it isn't inserted
+            // twice.
+            writePending();
+            pendingValues.insert(v);
+            val->setId(v->getId());
+        }
+        items.push_back(val);
+        writes.push_back(Write(qi, v, queued, dirtied));
+    }
+
+    void del(const DirtyItem &qi, const std::string &key, rel_time_t queued) {
+        if (!items.empty()) {
+            writePending();
+        }
+        keys.push_back(std::make_pair(qi.getVBucketId(), key));
+        writes.push_back(Write(qi, NULL, queued, 0));
+    }
+
+    /**
+     * Write what's pending and let go of the epoch.
+     */
+    void write() {
+        writePending();
+        delete epoch;
+        epoch = NULL;
+    }
+
+    void callback(std::vector<std::pair<bool, int64_t> > &results) {
+        assert(results.size() == writes.size());
+        for (size_t i = 0; i < results.size(); ++i) {
+            Requeuer cb(writes[i].queuedItem, rq, writes[i].sval,
+                        writes[i].queued, writes[i].dirtied, &stats);
+            cb.callback(results[i]);
+        }
+    }
+
+    void callback(std::vector<bool> &results) {
+        assert(results.size() == writes.size());
+        for (size_t i = 0; i < results.size(); ++i) {
+            Requeuer cb(writes[i].queuedItem, rq, writes[i].sval,
+                        writes[i].queued, writes[i].dirtied, &stats);
+            bool deleted = results[i];
+            cb.callback(deleted);
+        }
+    }
+
+private:
+
+    void writePending() {
+        if (!items.empty()) {
+            underlying->setMany(items, *this);
+            std::vector<Item*>::iterator it;
+            for (it = items.begin(); it != items.end(); ++it) {
+                delete *it;
+            }
+            items.clear();
+            pendingValues.clear();
+        } else if (!keys.empty()) {
+            underlying->delMany(keys, *this);
+            keys.clear();
+        }
+        writes.clear();
+    }
+
+    class Write {
+    public:
+        Write(const DirtyItem &qi, StoredValue *v, rel_time_t qd, rel_time_t d) :
+            queuedItem(qi), sval(v), queued(qd), dirtied(d) {}
+
+        DirtyItem    queuedItem;
+        StoredValue *sval;
+        rel_time_t   queued;
+        rel_time_t   dirtied;
+    };
+
+    StrategicSqlite3                                *underlying;
+    std::queue<DirtyItem>                           *rq;
+    EPStats                                         &stats;
+    std::vector<Item*>                               items;
+    // The items with a set in `items'.
+    std::set<StoredValue*>                           pendingValues;
+    std::vector<std::pair<uint16_t, std::string> >   keys;
+    std::vector<Write>                               writes;
+    // Held from the first lookup for a batch until it's written.
+    EpochHolder                                     *epoch;
+    DISALLOW_COPY_AND_ASSIGN(FlushBatch);
+};
+
+int EventuallyPersistentStore::flushSome(size_t shard,
+                                         std::queue<DirtyItem> *q,
+                                         std::queue<DirtyItem> *rejectQueue) {
+    FlushShard *fs = flushShards[shard];
+    size_t tsz = getFlusherTxnSize(shard);
+    size_t flushed = 0;
+    fs->underlying->begin();
+    int oldest = stats.min_data_age;
+    // Only the first flusher holds up background fetches.
+    bool yield = fs->dispatcher == dispatcher;
+    FlushBatch batch(fs->underlying, rejectQueue, stats);
+    for (; flushed < tsz && !q->empty() && !(yield && bgFetchQueue > 0);
+         ++flushed) {
+        int n = flushOne(fs, q, rejectQueue, batch);
+        if (n != 0 && n < oldest) {
+            oldest = n;
+        }
+    }
+    batch.write();
+    rel_time_t cstart = ep_current_time();
+    hrtime_t hrstart = gethrtime();
+    useconds_t backoff = MIN_COMMIT_BACKOFF;
+    while (!fs->underlying->commit()) {
+        usleep(backoff);
+        backoff = std::min(backoff * 2, static_cast<useconds_t>(MAX_COMMIT_BACKOFF));
+        stats.commitFailed++;
+    }
+    rel_time_t complete_time = ep_current_time();
+    hrtime_t commitUsec = (gethrtime() - hrstart) / 1000;
+
+    stats.commit_time.set(complete_time - cstart);
+    int bucket = 0;
+    for (hrtime_t t = commitUsec; t > 0 && bucket < EPStats::COMMIT_HISTO_BUCKETS - 1;
+         t >>= 1) {
+        ++bucket;
+    }
+    stats.commitHisto[bucket]++;
+    adaptTxnSize(fs, flushed, !q->empty(), commitUsec);
+    return oldest;
+}
+
+// Commit time grows with the size of the transaction, so halve it
+// when a commit goes over budget, and grow it by a quarter when a full
+// one took under half the budget and more items are waiting.
+void EventuallyPersistentStore::adaptTxnSize(FlushShard *fs, size_t flushed,
+                                             bool more, hrtime_t commitUsec) {
+    size_t most = static_cast<size_t>(getTxnSize());
+    hrtime_t budget = static_cast<hrtime_t>(commitBudget.get()) * 1000;
+    size_t target = std::min(fs->txnSize.get(), most);
+    if (budget == 0) {
+        target = most;
+    } else if (commitUsec > budget) {
+        target = std::max(target / 2, static_cast<size_t>(MIN_ADAPTIVE_TXN_SIZE));
+    } else if (more && flushed >= target && commitUsec < budget / 2) {
+        target += target / 4 + 1;
+    }
+    fs->txnSize.set(std::min(target, most));
+}
+
+int EventuallyPersistentStore::flushOneDeleteAll(FlushShard *fs) {
+    fs->underlying->reset();
     return 1;
 }
 
 // While I actually know whether a delete or set was intended, I'm
 // still a bit better off running the older code that figures it out
 // based on what's in memory.
-int EventuallyPersistentStore::flushOneDelOrSet(QueuedItem &qi,
-                                           std::queue<QueuedItem> *rejectQueue) {
+int EventuallyPersistentStore::flushOneDelOrSet(FlushShard *fs, DirtyItem &qi,
+                                                std::queue<DirtyItem> *rejectQueue,
+                                                FlushBatch &batch) {
 
     RCPtr<VBucket> vb = getVBucket(qi.getVBucketId());
     if (!vb) {
         return 0;
     }
 
-    int bucket_num = vb->ht.bucket(qi.getKey());
+    std::string key;
+    int bucket_num;
+    StoredValue *v;
+    // Items deleted while their writes are pending aren't freed
+    // until the results are in.
+    batch.hold();
+    if (qi.isRef()) {
+        bucket_num = qi.getRef().bucket;
+    } else {
+        key = qi.getKey();
+        bucket_num = vb->ht.bucket(key);
+    }
     LockHolder lh(vb->ht.getMutex(bucket_num));
-    StoredValue *v = vb->ht.unlocked_find(qi.getKey(), bucket_num);
+    if (qi.isRef()) {
+        v = vb->ht.unlocked_find(qi.getRef());
+        if (v == NULL) {
+            // Deleted since, so the delete was queued (or, for
+            // expired items, will be by queueExpiredDeletes()).
+            return 0;
+        }
+        if (!fs->underlying->ownsKey(v->getKeyBytes(), v->getKeyLen())) {
+            // Another key has been given the address since; it's
+            // queued for the flusher that owns it.
+            return 0;
+        }
+        // Expired items are deleted on sight, as when found by key.
+        if (v->isExpired(ep_current_time())) {
+            key = v->getKey();
+            vb->ht.unlocked_del(key, bucket_num);
+            v = NULL;
+        }
+    } else {
+        v = vb->ht.unlocked_find(key, bucket_num);
+    }
 
     bool found = v != NULL;
     bool isDirty = (found && v->isDirty());
@@ -672,72 +1506,73 @@ int EventuallyPersistentStore::flushOneDelOrSet(QueuedItem &qi,
                                                stats.dirtyAgeHighWat.get()));
             stats.dataAgeHighWat.set(std::max(stats.dataAge.get(),
                                               stats.dataAgeHighWat.get()));
-            // Copy it for the duration.
-            val = new Item(qi.getKey(), v->getFlags(), v->getExptime(),
-                           v->getValue(), v->getCas(), v->getId(),
-                           qi.getVBucketId());
+            // Shares the value rather than copying it; only the key
+            // is copied out.
+            val = new Item(v->getKeyBytes(), v->getKeyLen(), v->getFlags(),
+                           v->getExptime(), v->getValue(stats), v->getCas(),
+                           v->getId(), qi.getVBucketId());
 
         }
     }
     lh.unlock();
 
     if (found && isDirty) {
-        Requeuer cb(qi, rejectQueue, v, queued, dirtied, &stats);
-        underlying->set(*val, cb);
+        batch.set(qi, val, v, queued, dirtied);
     } else if (!found) {
-        Requeuer cb(qi, rejectQueue, v, queued, dirtied, &stats);
-        underlying->del(qi.getKey(), qi.getVBucketId(), cb);
-    }
-
-    if (val != NULL) {
-        delete val;
+        batch.del(qi, key, queued);
     }
 
     return ret;
 }
 
-int EventuallyPersistentStore::flushOneDeleteVBucket(QueuedItem &qi,
-                                                     std::queue<QueuedItem> *rejectQueue) {
+int EventuallyPersistentStore::flushOneDeleteVBucket(FlushShard *fs, DirtyItem &qi,
+                                                     std::queue<DirtyItem> *rejectQueue) {
     getLogger()->log(EXTENSION_LOG_DEBUG, NULL,
                      "Deleting vbucket %d from disk\n", qi.getVBucketId());
-    if (!underlying->delVBucket(qi.getVBucketId())) {
+    if (!fs->underlying->delVBucket(qi.getVBucketId())) {
         rejectQueue->push(qi);
     }
     return 1;
 }
 
-int EventuallyPersistentStore::flushVBSet(QueuedItem &qi,
-                                          std::queue<QueuedItem> *rejectQueue) {
+int EventuallyPersistentStore::flushVBSet(FlushShard *fs, DirtyItem &qi,
+                                          std::queue<DirtyItem> *rejectQueue) {
 
-    if (!underlying->setVBState(qi.getVBucketId(), qi.getKey())) {
+    if (!fs->underlying->setVBState(qi.getVBucketId(), qi.getKey())) {
         rejectQueue->push(qi);
     }
     return 1;
 }
 
-int EventuallyPersistentStore::flushOne(std::queue<QueuedItem> *q,
-                                        std::queue<QueuedItem> *rejectQueue) {
+int EventuallyPersistentStore::flushOne(FlushShard *fs,
+                                        std::queue<DirtyItem> *q,
+                                        std::queue<DirtyItem> *rejectQueue,
+                                        FlushBatch &batch) {
 
-    QueuedItem qi = q->front();
+    DirtyItem qi = q->front();
     q->pop();
     stats.memOverhead.decr(qi.size());
     stats.flusher_todo--;
 
     int rv = 0;
+    if (qi.getOperation() != queue_op_set && qi.getOperation() != queue_op_del) {
+        // Nothing else is batched, so what's pending goes first.
+        batch.write();
+    }
     switch (qi.getOperation()) {
     case queue_op_flush:
-        rv = flushOneDeleteAll();
+        rv = flushOneDeleteAll(fs);
         break;
     case queue_op_vb_flush:
-        rv = flushOneDeleteVBucket(qi, rejectQueue);
+        rv = flushOneDeleteVBucket(fs, qi, rejectQueue);
         break;
     case queue_op_set:
         // FALLTHROUGH
     case queue_op_del:
-        rv = flushOneDelOrSet(qi, rejectQueue);
+        rv = flushOneDelOrSet(fs, qi, rejectQueue, batch);
         break;
     case queue_op_vb_set:
-        rv = flushVBSet(qi, rejectQueue);
+        rv = flushVBSet(fs, qi, rejectQueue);
         break;
     }
 
@@ -749,10 +1584,48 @@ void EventuallyPersistentStore::queueDirty(const std::string &key, uint16_t vbid
                                            enum queue_operation op) {
     if (doPersistence) {
         // Assume locked.
-        QueuedItem qi(key, vbid, op);
-        towrite.push(qi);
-        stats.memOverhead.incr(qi.size());
-        stats.totalEnqueued++;
-        stats.queue_size = towrite.size();
+        DirtyItem qi(key, vbid, op);
+        std::vector<FlushShard*>::iterator it;
+        switch (op) {
+        case queue_op_set:
+            // FALLTHROUGH
+        case queue_op_del:
+            // A key always goes to the same flusher, so its writes
+            // stay in order.
+            queueDirty(flushShards[underlying->shardOf(key) % flushShards.size()],
+                       qi);
+            break;
+        case queue_op_vb_set:
+            // The first flusher keeps the vbucket states.
+            queueDirty(flushShards[0], qi);
+            break;
+        case queue_op_flush:
+            // FALLTHROUGH
+        case queue_op_vb_flush:
+            // Each flusher empties its own shards.
+            for (it = flushShards.begin(); it != flushShards.end(); ++it) {
+                queueDirty(*it, qi);
+            }
+            break;
+        }
+    }
+}
+
+void EventuallyPersistentStore::queueDirty(const RCPtr<VBucket> &vb,
+                                           const std::string &key,
+                                           const StoredRef &ref) {
+    if (doPersistence) {
+        uint16_t lock = static_cast<uint16_t>(vb->ht.getLockNum(ref.bucket));
+        queueDirty(flushShards[underlying->shardOf(key) % flushShards.size()],
+                   DirtyItem(static_cast<uint16_t>(vb->getId()), ref, lock));
     }
 }
+
+void EventuallyPersistentStore::queueDirty(FlushShard *fs,
+                                           const DirtyItem &di) {
+    // Counted first so the flusher never takes more than is counted.
+    ++stats.queue_size;
+    fs->towrite.push(di);
+    stats.memOverhead.incr(di.size());
+    stats.totalEnqueued++;
+}
@@ -24,8 +24,11 @@
 #include <string.h>
 #include <time.h>
 #include <stdexcept>
+#include <algorithm>
 #include <iostream>
+#include <list>
 #include <queue>
+#include <vector>
 #include <unistd.h>
 
 #include <set>
@@ -41,13 +44,24 @@ extern EXTENSION_LOGGER_DESCRIPTOR *getLogger(void);
 #include "stored-value.hh"
 #include "atomic.hh"
 #include "dispatcher.hh"
+#include "hot-keys.hh"
 #include "vbucket.hh"
 
 #define DEFAULT_TXN_SIZE 50000
 #define MAX_TXN_SIZE 10000000
+// Adapted transactions don't shrink below this many items.
+#define MIN_ADAPTIVE_TXN_SIZE 10
+#define MAX_COMMIT_BUDGET 60000
+// Retries of a failed commit wait from the first up to the second (usec).
+#define MIN_COMMIT_BACKOFF 1000
+#define MAX_COMMIT_BACKOFF 1000000
+// Most writes handed to the store at once by a flusher.
+#define MAX_FLUSH_BATCH 256
 
 #define MAX_DATA_AGE_PARAM 86400
 #define MAX_BG_FETCH_DELAY 900
+#define MAX_VISITOR_THREADS 64
+#define MAX_HOT_KEY_SAMPLE 65536
 
 extern "C" {
     extern rel_time_t (*ep_current_time)();
@@ -61,6 +75,15 @@ enum queue_operation {
     queue_op_vb_set
 };
 
+enum flusher_state {
+    initializing,
+    running,
+    pausing,
+    paused,
+    stopping,
+    stopped
+};
+
 class QueuedItem {
 public:
     QueuedItem(const std::string &k, const uint16_t vb, enum queue_operation o)
@@ -86,6 +109,167 @@ private:
     rel_time_t dirtied;
 };
 
+/**
+ * Something the flusher is to persist.
+ *
+ * A set refers to the item where it is in memory rather than by key,
+ * so the key isn't copied and the flusher goes straight to it.
+ * Deletes (whose items are gone by then) and vbucket operations keep
+ * their key or state in a DirtyKey of their own, shared by the copies
+ * of the DirtyItem, where a set keeps the item; a queued set holds no
+ * more than the reference, vbucket, lock, operation and time.
+ */
+class DirtyItem {
+public:
+    DirtyItem(uint16_t vb, const StoredRef &r, uint16_t l)
+        : ptr(r.value), bucket(r.bucket), vbucket(vb), lock(l),
+          op(queue_op_set), dirtied(ep_current_time()) {}
+
+    DirtyItem(const std::string &k, uint16_t vb, enum queue_operation o)
+        : ptr(new DirtyKey(k)), bucket(0), vbucket(vb), lock(0), op(o),
+          dirtied(ep_current_time()) {
+        assert(o != queue_op_set);
+    }
+
+    DirtyItem(const DirtyItem &other)
+        : ptr(other.ptr), bucket(other.bucket), vbucket(other.vbucket),
+          lock(other.lock), op(other.op), dirtied(other.dirtied) {
+        hold();
+    }
+
+    ~DirtyItem() {
+        release();
+    }
+
+    DirtyItem &operator =(const DirtyItem &other) {
+        if (this != &other) {
+            other.hold();
+            release();
+            ptr = other.ptr;
+            bucket = other.bucket;
+            vbucket = other.vbucket;
+            lock = other.lock;
+            op = other.op;
+            dirtied = other.dirtied;
+        }
+        return *this;
+    }
+
+    //! The key or state of anything but a set.
+    const std::string &getKey(void) const {
+        assert(!isRef());
+        return static_cast<DirtyKey*>(ptr)->key;
+    }
+
+    //! Where the item to set is.
+    StoredRef getRef(void) const {
+        assert(isRef());
+        return StoredRef(static_cast<StoredValue*>(ptr), bucket);
+    }
+
+    //! Whether it refers to an item in memory rather than by key.
+    bool isRef(void) const { return op == queue_op_set; }
+    uint16_t getVBucketId(void) const { return vbucket; }
+    rel_time_t getDirtied(void) const { return dirtied; }
+    enum queue_operation getOperation(void) const {
+        return static_cast<enum queue_operation>(op);
+    }
+
+    //! Whether everything queued before it must be flushed before it.
+    bool isBarrier(void) const {
+        return op == queue_op_flush || op == queue_op_vb_flush;
+    }
+
+    /**
+     * Flush order: by vbucket, then by lock and bucket, so each lock
+     * is taken for a run of neighbouring items.
+     */
+    bool operator <(const DirtyItem &other) const {
+        if (vbucket != other.vbucket) {
+            return vbucket < other.vbucket;
+        }
+        if (lock != other.lock) {
+            return lock < other.lock;
+        }
+        return bucket < other.bucket;
+    }
+
+    size_t size() const {
+        if (isRef()) {
+            return sizeof(DirtyItem);
+        }
+        return sizeof(DirtyItem) + sizeof(DirtyKey) + getKey().size();
+    }
+
+private:
+
+    // The key of a queued delete or vbucket operation.
+    struct DirtyKey {
+        DirtyKey(const std::string &k) : refs(1), key(k) {}
+        volatile int refs;
+        std::string  key;
+    };
+
+    void hold() const {
+        if (!isRef()) {
+            __sync_add_and_fetch(&static_cast<DirtyKey*>(ptr)->refs, 1);
+        }
+    }
+
+    void release() {
+        if (!isRef()
+            && __sync_sub_and_fetch(&static_cast<DirtyKey*>(ptr)->refs, 1) == 0) {
+            delete static_cast<DirtyKey*>(ptr);
+        }
+    }
+
+    // The StoredValue of a set, or else the DirtyKey.
+    void       *ptr;
+    int         bucket;
+    uint16_t    vbucket;
+    uint16_t    lock;
+    uint8_t     op;
+    rel_time_t  dirtied;
+};
+
+class Flusher;
+class FlushBatch;
+
+/**
+ * What one flusher persists: the items queued for the DB shards it
+ * owns, and the connection it writes them with.
+ */
+class FlushShard {
+public:
+    FlushShard(StrategicSqlite3 *db, Dispatcher *d)
+        : underlying(db), dispatcher(d), flusher(NULL), txnSize(MAX_TXN_SIZE) {}
+
+    StrategicSqlite3        *underlying;
+    //! Shared with background fetches for the first shard only.
+    Dispatcher              *dispatcher;
+    Flusher                 *flusher;
+    AtomicQueue<DirtyItem>   towrite;
+    std::queue<DirtyItem>    writing;
+    //! Most items in a transaction while adapting to the commit budget.
+    Atomic<size_t>           txnSize;
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(FlushShard);
+};
+
+/**
+ * A key whose value is to be fetched from disk as part of a batch.
+ */
+class BGFetchItem {
+public:
+    BGFetchItem(const std::string &k, uint16_t vb, uint64_t r)
+        : key(k), vbucket(vb), rowid(r) {}
+
+    std::string key;
+    uint16_t    vbucket;
+    uint64_t    rowid;
+};
+
 /**
  * vbucket-aware hashtable visitor.
  */
@@ -108,13 +292,28 @@ public:
         return true;
     }
 
+    /**
+     * Get the visitor one thread of a parallel visit is to use.
+     *
+     * Return this if this visitor (visitBucket() included) may be
+     * used from several threads at once, or a new visitor holding
+     * that thread's own state, which is merge()d back and deleted
+     * once the visit is done.  By default a visitor can't be used in
+     * parallel and is used on one thread.
+     *
+     * @return the visitor for the thread, or NULL
+     */
+    virtual VBucketVisitor *forWorker() { return NULL; }
+
+    /**
+     * Take in what a thread's visitor from forWorker() found.
+     */
+    virtual void merge(VBucketVisitor &worker) { (void)worker; }
+
 protected:
     uint16_t currentBucket;
 };
 
-// Forward declaration
-class Flusher;
-
 /**
  * Helper class used to insert items into the storage by using
  * the KVStore::dump method to load items from the database
@@ -124,10 +323,20 @@ public:
     LoadStorageKVPairCallback(VBucketMap &vb, EPStats &st)
         : vbuckets(vb), stats(st) { }
 
-    void initVBucket(uint16_t vbid, vbucket_state_t state = pending) {
+    /**
+     * Create a vbucket if it doesn't already exist.
+     *
+     * @param vbid the vbucket ID
+     * @param state the state of a newly created vbucket
+     * @param numItems the number of items expected to be loaded into
+     *                 it (used to size its hash table)
+     */
+    void initVBucket(uint16_t vbid, vbucket_state_t state = pending,
+                     size_t numItems = 0) {
         RCPtr<VBucket> vb = vbuckets.getBucket(vbid);
         if (!vb) {
             vb.reset(new VBucket(vbid, state, stats));
+            vb->ht.reserve(numItems);
             vbuckets.addBucket(vb);
         }
     }
@@ -169,8 +378,13 @@ class EventuallyPersistentEngine;
 class EventuallyPersistentStore {
 public:
 
+    /**
+     * @param dbs a connection to the database for each flusher; the
+     *            first one is also used to read from it
+     */
     EventuallyPersistentStore(EventuallyPersistentEngine &theEngine,
-                              StrategicSqlite3 *t, bool startVb0);
+                              const std::vector<StrategicSqlite3*> &dbs,
+                              bool startVb0);
 
     ~EventuallyPersistentStore();
 
@@ -181,6 +395,26 @@ public:
     GetValue get(const std::string &key, uint16_t vbucket,
                  const void *cookie, SERVER_CORE_API *core);
 
+    /**
+     * Get a batch of items at once.
+     *
+     * All keys are hashed up front and sorted by vbucket and lock
+     * stripe, so each vbucket is looked up and each stripe locked
+     * once per batch.  The values that aren't resident are fetched
+     * from disk together, and the cookie is notified once when
+     * they're all in; their keys come back with ENGINE_EWOULDBLOCK
+     * like get() does.
+     *
+     * @param keys the vbucket and key of each item wanted
+     * @param values what was found for each key, in the same order;
+     *               the caller owns the items
+     * @param cookie the cookie of the requestor
+     * @param core the server API to notify the cookie with
+     */
+    void getMany(const std::vector<std::pair<uint16_t, std::string> > &keys,
+                 std::vector<GetValue> &values,
+                 const void *cookie, SERVER_CORE_API *core);
+
     void getFromUnderlying(const std::string &key, uint16_t vbucket,
                            shared_ptr<Callback<GetValue> > cb) {
         // TODO:  Get this implemented and try it some time.
@@ -237,12 +471,37 @@ public:
     bool pauseFlusher(void);
     bool resumeFlusher(void);
 
+    /**
+     * Get the state of the flushers.
+     *
+     * That's the state of the one furthest behind, so they're only
+     * paused once they all are, for instance.
+     */
+    enum flusher_state getFlusherState();
+
+    size_t getNumFlushers() {
+        return flushShards.size();
+    }
+
+    /**
+     * Get the most items the given flusher currently puts in a
+     * transaction.
+     */
+    size_t getFlusherTxnSize(size_t shard) {
+        size_t most = static_cast<size_t>(getTxnSize());
+        if (commitBudget.get() == 0) {
+            return most;
+        }
+        return std::min(flushShards[shard]->txnSize.get(), most);
+    }
+
     /**
      * Enqueue a background fetch for a key.
      *
      * @param the key to be bg fetched
      * @param vbucket the vbucket in which the key lives
-     * @param cookie the cookie of the requestor
+     * @param cookie the cookie of the requestor, or NULL if nobody's
+     *               waiting for the fetch
      */
     void bgFetch(const std::string &key,
                  uint16_t vbucket,
@@ -264,12 +523,41 @@ public:
                          SERVER_CORE_API *core,
                          hrtime_t init, hrtime_t start);
 
+    /**
+     * Enqueue one background fetch for several keys.
+     *
+     * @param items the keys to be bg fetched
+     * @param cookie the cookie of the requestor, or NULL if nobody's
+     *               waiting for the fetch; it's notified once all the
+     *               keys are fetched
+     */
+    void bgFetchMany(const std::vector<BGFetchItem> &items,
+                     const void *cookie,
+                     SERVER_CORE_API *core);
+
+    /**
+     * Complete a background fetch of several keys.
+     */
+    void completeBGFetchMany(const std::vector<BGFetchItem> &items,
+                             const void *cookie,
+                             SERVER_CORE_API *core,
+                             hrtime_t init, hrtime_t start);
+
     RCPtr<VBucket> getVBucket(uint16_t vbid);
     void setVBucketState(uint16_t vbid,
                          vbucket_state_t state,
                          SERVER_CORE_API *core);
     bool deleteVBucket(uint16_t vbid);
 
+    /**
+     * Start resizing any vbucket hash table whose load factor is out
+     * of range, and move along the resizes already in progress.
+     *
+     * @param stripes the number of lock stripes to migrate per table
+     * @return true if any hash table is still being resized
+     */
+    bool resizeHashTables(size_t stripes);
+
     void visit(VBucketVisitor &visitor) {
         std::vector<int> vbucketIds(vbuckets.getBuckets());
         std::vector<int>::iterator it;
@@ -284,6 +572,89 @@ public:
         }
     }
 
+    /**
+     * Delete the given items that have expired, queueing their
+     * deletion from disk.
+     *
+     * @param keys vbucket and key of the items that were found
+     *             expired; on return only the ones that were deleted
+     *             are left
+     * @param asOf the time the items were found expired at
+     */
+    void deleteExpiredItems(std::list<std::pair<uint16_t, std::string> > &keys,
+                            rel_time_t asOf);
+
+    /**
+     * Visit all items of all vbuckets on several threads at once.
+     *
+     * The vbuckets' hash tables are split up by lock stripe and the
+     * pieces handed out to the threads as they go.  Each thread gets
+     * its visitor from visitor.forWorker() and calls visitBucket() on
+     * it for each piece of a vbucket it takes on.  If the visitor
+     * can't be used in parallel, or only one thread is configured
+     * (see setVisitorThreads()), this is just visit().
+     *
+     * @param visitor the visitor
+     */
+    void parallelVisit(VBucketVisitor &visitor);
+
+    /**
+     * Set the number of threads parallelVisit() uses.
+     */
+    void setVisitorThreads(size_t to) {
+        visitorThreads.set(to == 0 ? 1 : to);
+    }
+
+    size_t getVisitorThreads() {
+        return visitorThreads.get();
+    }
+
+    /**
+     * True if any vbucket's items take more memory than the soft
+     * quota (see VBucket::overSoftQuota()).
+     */
+    bool anyOverSoftQuota();
+
+    /**
+     * A place in a visit of all vbuckets that can be resumed from.
+     */
+    class Position {
+    public:
+        //! The start of the first vbucket.
+        Position() : vbid(0), visiting(false), done(false) {}
+
+        //! True once every vbucket has been visited.
+        bool isDone() const { return done; }
+
+    private:
+        explicit Position(int vb) : vbid(vb), visiting(false), done(false) {}
+
+        int                 vbid;
+        // Whether the visitor took vbid and is walking its table.
+        bool                visiting;
+        bool                done;
+        HashTable::Position htPos;
+
+        friend class EventuallyPersistentStore;
+    };
+
+    /**
+     * Visit the items of the vbuckets a bounded piece at a time.
+     *
+     * Each call visits at most the given number of hash buckets of
+     * one vbucket (see HashTable::pauseResumeVisit()) and returns
+     * where to carry on, so a long walk can be spread over many
+     * dispatcher runs.  Pass the same visitor each time.
+     *
+     * @param visitor the visitor
+     * @param start where to start, from Position() or an earlier call
+     * @param maxBuckets the most hash buckets to visit
+     *
+     * @return where to resume; isDone() once all vbuckets are visited
+     */
+    Position pauseResumeVisit(VBucketVisitor &visitor, const Position &start,
+                              size_t maxBuckets);
+
     void visitDepth(HashTableDepthVisitor &visitor) {
         // TODO: Something smarter for multiple vbuckets.
         RCPtr<VBucket> vb = vbuckets.getBucket(0);
@@ -298,6 +669,11 @@ public:
         return vb->ht.getSize();
     }
 
+    /**
+     * Get the number of resizes of all the vbuckets' hash tables.
+     */
+    size_t getHashResizes();
+
     size_t getHashLocks() {
         // TODO: Something smarter for multiple vbuckets.
         RCPtr<VBucket> vb = vbuckets.getBucket(0);
@@ -307,12 +683,14 @@ public:
 
     void warmup() {
         std::map<uint16_t, std::string> state = underlying->listPersistedVbuckets();
+        std::map<uint16_t, size_t> counts = underlying->countPersistedItems();
         std::map<uint16_t, std::string>::iterator it;
         for (it = state.begin(); it != state.end(); ++it) {
             getLogger()->log(EXTENSION_LOG_DEBUG, NULL,
                              "Reloading vbucket %d - was in %s state\n",
                              it->first, it->second.c_str());
-            loadStorageKVPairCallback.initVBucket(it->first);
+            loadStorageKVPairCallback.initVBucket(it->first, pending,
+                                                  counts[it->first]);
         }
         underlying->dump(loadStorageKVPairCallback);
     }
@@ -325,7 +703,17 @@ public:
         txnSize.set(to);
     }
 
-    const Flusher* getFlusher();
+    /**
+     * Get how long (msec) commits are meant to take; 0 when every
+     * transaction is as big as getTxnSize() allows.
+     */
+    size_t getCommitBudget() {
+        return commitBudget.get();
+    }
+
+    void setCommitBudget(size_t to) {
+        commitBudget.set(to);
+    }
 
     bool getKeyStats(const std::string &key, uint16_t vbucket,
                      key_stats &kstats);
@@ -334,25 +722,64 @@ public:
                    Callback<GetValue> &cb,
                    rel_time_t currentTime, uint32_t lockTimeout);
 
+    /**
+     * Get the most used keys across all vbuckets, most used first.
+     *
+     * Each vbucket also keeps its own in VBucket::hotKeys.
+     *
+     * @param n the most keys to return
+     */
+    std::vector<HotKeys::Entry> getHotKeys(size_t n) {
+        return hotKeys.top(n);
+    }
+
+    //! Number of keys the store-wide hot keys keep track of.
+    static const size_t HOT_KEYS_TRACKED = 64;
+
 private:
 
     RCPtr<VBucket> getVBucket(uint16_t vbid, vbucket_state_t wanted_state);
 
+    // Count an operation on a key towards the hot keys if it's sampled.
+    void noteAccess(const RCPtr<VBucket> &vb, const std::string &key) {
+        size_t weight = HotKeys::sample();
+        if (weight != 0) {
+            hotKeys.record(key, weight);
+            vb->hotKeys.record(key, weight);
+        }
+    }
+
+    // Put a value fetched from disk back in memory; vbsetMutex must be held.
+    void restoreFetched(const std::string &key, uint16_t vbucket,
+                        GetValue &gv);
+    void recordBGFetchTimes(hrtime_t init, hrtime_t start, hrtime_t stop);
+    void adaptTxnSize(FlushShard *fs, size_t flushed, bool more,
+                      hrtime_t commitUsec);
+
     /* Queue an item to be written to persistent layer. */
     void queueDirty(const std::string &key, uint16_t vbid, enum queue_operation op);
-
-    std::queue<QueuedItem> *beginFlush();
-    void completeFlush(std::queue<QueuedItem> *rejects,
+    /* Queue a set by where it's stored; its bucket must not be locked. */
+    void queueDirty(const RCPtr<VBucket> &vb, const std::string &key,
+                    const StoredRef &ref);
+    void queueDirty(FlushShard *fs, const DirtyItem &di);
+
+    // Queue the disk deletes of items the hash tables expired.
+    void queueExpiredDeletes();
+    std::queue<DirtyItem> *beginFlush(size_t shard);
+    void completeFlush(size_t shard, std::queue<DirtyItem> *rejects,
                        rel_time_t flush_start);
 
-    int flushSome(std::queue<QueuedItem> *q,
-                  std::queue<QueuedItem> *rejectQueue);
-    int flushOne(std::queue<QueuedItem> *q,
-                 std::queue<QueuedItem> *rejectQueue);
-    int flushOneDeleteAll(void);
-    int flushOneDeleteVBucket(QueuedItem &qi, std::queue<QueuedItem> *rejectQueue);
-    int flushOneDelOrSet(QueuedItem &qi, std::queue<QueuedItem> *rejectQueue);
-    int flushVBSet(QueuedItem &qi, std::queue<QueuedItem> *rejectQueue);
+    int flushSome(size_t shard, std::queue<DirtyItem> *q,
+                  std::queue<DirtyItem> *rejectQueue);
+    int flushOne(FlushShard *fs, std::queue<DirtyItem> *q,
+                 std::queue<DirtyItem> *rejectQueue, FlushBatch &batch);
+    int flushOneDeleteAll(FlushShard *fs);
+    int flushOneDeleteVBucket(FlushShard *fs, DirtyItem &qi,
+                              std::queue<DirtyItem> *rejectQueue);
+    int flushOneDelOrSet(FlushShard *fs, DirtyItem &qi,
+                         std::queue<DirtyItem> *rejectQueue, FlushBatch &batch);
+    int flushVBSet(FlushShard *fs, DirtyItem &qi,
+                   std::queue<DirtyItem> *rejectQueue);
 
     friend class Flusher;
 
@@ -362,17 +789,20 @@ private:
     bool                       doPersistence;
     StrategicSqlite3          *underlying;
     Dispatcher                *dispatcher;
-    Flusher                   *flusher;
+    std::vector<FlushShard*>   flushShards;
     VBucketMap                 vbuckets;
     SyncObject                 mutex;
-    AtomicQueue<QueuedItem>    towrite;
-    std::queue<QueuedItem>     writing;
     pthread_t                  thread;
     LoadStorageKVPairCallback  loadStorageKVPairCallback;
     Atomic<int>                txnSize;
+    Atomic<size_t>             commitBudget;
+    Atomic<size_t>             visitorThreads;
     Atomic<size_t>             bgFetchQueue;
-    Mutex                      vbsetMutex;
+    ProfiledMutex              vbsetMutex;
     uint32_t                   bgFetchDelay;
+    HotKeys                    hotKeys;
+
+    static LockStats           vbsetLockStats;
 
     DISALLOW_COPY_AND_ASSIGN(EventuallyPersistentStore);
 };
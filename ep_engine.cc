@@ -212,9 +212,21 @@ extern "C" {
             } else if (strcmp(keyz, "max_txn_size") == 0) {
                 validate(v, 1, MAX_TXN_SIZE);
                 e->setTxnSize(v);
+            } else if (strcmp(keyz, "commit_budget") == 0) {
+                validate(v, 0, MAX_COMMIT_BUDGET);
+                e->setCommitBudget(static_cast<size_t>(v));
             } else if (strcmp(keyz, "bg_fetch_delay") == 0) {
                 validate(v, 0, MAX_BG_FETCH_DELAY);
                 e->setBGFetchDelay(static_cast<uint32_t>(v));
+            } else if (strcmp(keyz, "visitor_threads") == 0) {
+                validate(v, 1, MAX_VISITOR_THREADS);
+                e->setVisitorThreads(static_cast<size_t>(v));
+            } else if (strcmp(keyz, "hot_key_sample") == 0) {
+                validate(v, 0, MAX_HOT_KEY_SAMPLE);
+                HotKeys::setSampleRate(static_cast<size_t>(v));
+            } else if (strcmp(keyz, "lock_profiling") == 0) {
+                validate(v, 0, 1);
+                LockStats::setEnabled(v != 0);
             } else if (strcmp(keyz, "max_size") == 0) {
                 // Want more bits than int.
                 char *ptr = NULL;
@@ -227,6 +239,18 @@ extern "C" {
 
                 stats.mem_low_wat = percentOf(StoredValue::getMaxDataSize(stats), 0.6);
                 stats.mem_high_wat = percentOf(StoredValue::getMaxDataSize(stats), 0.75);
+            } else if (strcmp(keyz, "vb_mem_soft_quota") == 0
+                       || strcmp(keyz, "vb_mem_hard_quota") == 0) {
+                char *ptr = NULL;
+                uint64_t vsize = strtoull(valz, &ptr, 10);
+                validate(vsize, static_cast<uint64_t>(0),
+                         std::numeric_limits<uint64_t>::max());
+                EPStats &stats = e->getEpStats();
+                if (strcmp(keyz, "vb_mem_soft_quota") == 0) {
+                    stats.vbMemSoftQuota = vsize;
+                } else {
+                    stats.vbMemHardQuota = vsize;
+                }
             } else {
                 *msg = "Unknown config param";
                 rv = PROTOCOL_BINARY_RESPONSE_KEY_ENOENT;
@@ -661,6 +685,8 @@ extern "C" {
 
 static SERVER_EXTENSION_API *extensionApi;
 
+LockStats EventuallyPersistentEngine::tapNotifyLockStats("tap_notify");
+
 EXTENSION_LOGGER_DESCRIPTOR *getLogger(void) {
     if (extensionApi != NULL) {
         return (EXTENSION_LOGGER_DESCRIPTOR*)extensionApi->get_extension(EXTENSION_LOGGER);
@@ -671,9 +697,10 @@ EXTENSION_LOGGER_DESCRIPTOR *getLogger(void) {
 
 EventuallyPersistentEngine::EventuallyPersistentEngine(GET_SERVER_API get_server_api) :
     dbname("/tmp/test.db"), initFile(NULL), warmup(true), wait_for_warmup(true),
-    startVb0(true), sqliteDb(NULL), epstore(NULL), databaseInitTime(0),
+    startVb0(true), numFlushers(1), epstore(NULL), databaseInitTime(0),
     tapIdleTimeout(DEFAULT_TAP_IDLE_TIMEOUT), nextTapNoop(0),
-    startedEngineThreads(false), shutdown(false),
+    startedEngineThreads(false), tapNotifySync(&tapNotifyLockStats),
+    shutdown(false),
     getServerApi(get_server_api), getlExtension(NULL),
 #ifdef ENABLE_INTERNAL_TAP
     clientTap(NULL),
@@ -682,7 +709,8 @@ EventuallyPersistentEngine::EventuallyPersistentEngine(GET_SERVER_API get_server
     memLowWat(std::numeric_limits<size_t>::max()),
     memHighWat(std::numeric_limits<size_t>::max()),
     minDataAge(DEFAULT_MIN_DATA_AGE),
-    queueAgeCap(DEFAULT_QUEUE_AGE_CAP)
+    queueAgeCap(DEFAULT_QUEUE_AGE_CAP),
+    expiryPagerSleeptime(DEFAULT_EXPIRY_PAGER_SLEEPTIME)
 {
     interface.interface = 1;
     ENGINE_HANDLE_V1::get_info = EvpGetInfo;
@@ -759,7 +787,7 @@ extern "C" {
     static void* launch_backfill_thread(void *arg) {
         BackFillThreadData *bftd = static_cast<BackFillThreadData *>(arg);
 
-        bftd->epstore->visit(bftd->bfv);
+        bftd->epstore->parallelVisit(bftd->bfv);
         bftd->bfv.apply();
 
         delete bftd;
@@ -9,6 +9,7 @@
 #include "ep_extension.h"
 #include "dispatcher.hh"
 #include "item_pager.hh"
+#include "htresizer.hh"
 #include <memcached/util.h>
 #ifdef ENABLE_INTERNAL_TAP
 #include "tapclient.hh"
@@ -21,6 +22,7 @@
 #include <algorithm>
 #include <errno.h>
 #include <limits>
+#include <new>
 
 #include "command_ids.h"
 
@@ -38,6 +40,10 @@
 #define DEFAULT_QUEUE_AGE_CAP 900
 #endif
 
+#ifndef DEFAULT_EXPIRY_PAGER_SLEEPTIME
+#define DEFAULT_EXPIRY_PAGER_SLEEPTIME 3600
+#endif
+
 extern "C" {
     EXPORT_FUNCTION
     ENGINE_ERROR_CODE create_instance(uint64_t interface,
@@ -132,14 +138,29 @@ static void add_casted_stat(const char *k, const Atomic<T> &v,
     add_casted_stat(k, v.get(), add_stat, cookie);
 }
 
+template <typename T>
+static void add_casted_stat(const char *k, const ShardedCounter<T> &v,
+                            ADD_STAT add_stat, const void *cookie) {
+    add_casted_stat(k, v.get(), add_stat, cookie);
+}
+
 class StatVBucketVisitor : public VBucketVisitor {
 public:
-    StatVBucketVisitor(const void *c, ADD_STAT a) : cookie(c), add_stat(a) {}
+    StatVBucketVisitor(EventuallyPersistentStore *s, const void *c, ADD_STAT a)
+        : store(s), cookie(c), add_stat(a) {}
 
     bool visitBucket(uint16_t vbid, vbucket_state_t state) {
-        char buf[16];
+        char buf[32];
         snprintf(buf, sizeof(buf), "vb_%d", vbid);
         add_casted_stat(buf, VBucket::toString(state), add_stat, cookie);
+
+        RCPtr<VBucket> vb = store->getVBucket(vbid);
+        if (vb) {
+            snprintf(buf, sizeof(buf), "vb_%d:num_items", vbid);
+            add_casted_stat(buf, vb->size(), add_stat, cookie);
+            snprintf(buf, sizeof(buf), "vb_%d:mem_size", vbid);
+            add_casted_stat(buf, vb->getMemSize(), add_stat, cookie);
+        }
         return false;
     }
 
@@ -149,6 +170,69 @@ public:
     }
 
 private:
+    EventuallyPersistentStore *store;
+    const void *cookie;
+    ADD_STAT add_stat;
+};
+
+// Hot keys reported for the whole store, and for each vbucket.
+#define NUM_HOT_KEY_STATS 20
+#define NUM_VBUCKET_HOT_KEY_STATS 3
+
+/**
+ * Add stats for hot keys, named <prefix>hot_<rank>_<stat>.
+ */
+static void addHotKeyStats(const std::string &prefix,
+                           const std::vector<HotKeys::Entry> &keys,
+                           ADD_STAT add_stat, const void *cookie) {
+    char buf[64];
+    for (size_t i = 0; i < keys.size(); ++i) {
+        snprintf(buf, sizeof(buf), "%shot_%d_key", prefix.c_str(), (int)i);
+        add_casted_stat(buf, keys[i].key.c_str(), add_stat, cookie);
+        snprintf(buf, sizeof(buf), "%shot_%d_ops", prefix.c_str(), (int)i);
+        add_casted_stat(buf, keys[i].count, add_stat, cookie);
+        snprintf(buf, sizeof(buf), "%shot_%d_error", prefix.c_str(), (int)i);
+        add_casted_stat(buf, keys[i].error, add_stat, cookie);
+    }
+}
+
+/**
+ * Adds the hot keys of each vbucket, along with the hash table lock
+ * each one is under.
+ */
+class StatHotKeysVisitor : public VBucketVisitor {
+public:
+    StatHotKeysVisitor(EventuallyPersistentStore *s, const void *c, ADD_STAT a)
+        : store(s), cookie(c), add_stat(a) {}
+
+    bool visitBucket(uint16_t vbid, vbucket_state_t state) {
+        (void)state;
+        RCPtr<VBucket> vb = store->getVBucket(vbid);
+        if (!vb) {
+            return false;
+        }
+
+        char prefix[16];
+        snprintf(prefix, sizeof(prefix), "vb_%d:", vbid);
+        std::vector<HotKeys::Entry> keys(vb->hotKeys.top(NUM_VBUCKET_HOT_KEY_STATS));
+        addHotKeyStats(prefix, keys, add_stat, cookie);
+
+        char buf[64];
+        for (size_t i = 0; i < keys.size(); ++i) {
+            snprintf(buf, sizeof(buf), "%shot_%d_lock", prefix, (int)i);
+            add_casted_stat(buf, vb->ht.getLockNum(vb->ht.bucket(keys[i].key)),
+                            add_stat, cookie);
+        }
+        return false;
+    }
+
+    void visit(StoredValue* v) {
+        (void)v;
+        assert(false); // this does not happen
+    }
+
+private:
+    EventuallyPersistentStore *store;
     const void *cookie;
     ADD_STAT add_stat;
 };
@@ -174,12 +258,18 @@ public:
         resetStats();
 
         if (config != NULL) {
-            char *dbn = NULL, *initf = NULL, *svaltype = NULL;
+            char *dbn = NULL, *initf = NULL, *svaltype = NULL, *htlayout = NULL;
+            char *hthash = NULL;
             size_t htBuckets = 0;
             size_t htLocks = 0;
+            bool htHugePages = false;
             size_t maxSize = 0;
+            size_t vbMemSoftQuota = 0;
+            size_t vbMemHardQuota = 0;
+            size_t inlineValueSize = HashTable::getDefaultInlineValueSize();
+            size_t compressionThreshold = StoredValue::getCompressionThreshold();
 
-            const int max_items = 20;
+            const int max_items = 29;
             struct config_item items[max_items];
             int ii = 0;
             memset(items, 0, sizeof(items));
@@ -228,11 +318,51 @@ public:
             items[ii].datatype = DT_SIZE;
             items[ii].value.dt_size = &htLocks;
 
+            ++ii;
+            items[ii].key = "ht_layout";
+            items[ii].datatype = DT_STRING;
+            items[ii].value.dt_string = &htlayout;
+
+            ++ii;
+            items[ii].key = "ht_hash";
+            items[ii].datatype = DT_STRING;
+            items[ii].value.dt_string = &hthash;
+
+            ++ii;
+            items[ii].key = "ht_huge_pages";
+            items[ii].datatype = DT_BOOL;
+            items[ii].value.dt_bool = &htHugePages;
+
+            ++ii;
+            items[ii].key = "inline_value_size";
+            items[ii].datatype = DT_SIZE;
+            items[ii].value.dt_size = &inlineValueSize;
+
+            ++ii;
+            items[ii].key = "compression_threshold";
+            items[ii].datatype = DT_SIZE;
+            items[ii].value.dt_size = &compressionThreshold;
+
+            ++ii;
+            items[ii].key = "flushers";
+            items[ii].datatype = DT_SIZE;
+            items[ii].value.dt_size = &numFlushers;
+
             ++ii;
             items[ii].key = "max_size";
             items[ii].datatype = DT_SIZE;
             items[ii].value.dt_size = &maxSize;
 
+            ++ii;
+            items[ii].key = "vb_mem_soft_quota";
+            items[ii].datatype = DT_SIZE;
+            items[ii].value.dt_size = &vbMemSoftQuota;
+
+            ++ii;
+            items[ii].key = "vb_mem_hard_quota";
+            items[ii].datatype = DT_SIZE;
+            items[ii].value.dt_size = &vbMemHardQuota;
+
 #ifdef ENABLE_INTERNAL_TAP
             ++ii;
             items[ii].key = "tap_peer";
@@ -254,6 +384,11 @@ public:
             items[ii].key = "config_file";
             items[ii].datatype = DT_CONFIGFILE;
 
+            ++ii;
+            items[ii].key = "exp_pager_stime";
+            items[ii].datatype = DT_SIZE;
+            items[ii].value.dt_size = &expiryPagerSleeptime;
+
             ++ii;
             items[ii].key = "max_item_size";
             items[ii].datatype = DT_SIZE;
@@ -293,15 +428,40 @@ public:
                 if (initf != NULL) {
                     initFile = initf;
                 }
+                // Each flusher owns at least one DB shard.
+                if (numFlushers < 1 || numFlushers > NUMBER_OF_SHARDS) {
+                    getLogger()->log(EXTENSION_LOG_WARNING, NULL,
+                                     "Can't have %d flushers; using %d\n",
+                                     static_cast<int>(numFlushers),
+                                     numFlushers < 1 ? 1 : NUMBER_OF_SHARDS);
+                    numFlushers = numFlushers < 1 ? 1 : NUMBER_OF_SHARDS;
+                }
                 HashTable::setDefaultNumBuckets(htBuckets);
                 HashTable::setDefaultNumLocks(htLocks);
+                HashTable::setHugePages(htHugePages);
+                HashTable::setDefaultInlineValueSize(inlineValueSize);
+                StoredValue::setCompressionThreshold(compressionThreshold);
                 StoredValue::setMaxDataSize(stats, maxSize);
+                stats.vbMemSoftQuota = vbMemSoftQuota;
+                stats.vbMemHardQuota = vbMemHardQuota;
 
                 if (svaltype && !HashTable::setDefaultStorageValueType(svaltype)) {
                     getLogger()->log(EXTENSION_LOG_WARNING, NULL,
                                      "Unhandled storage value type: %s",
                                      svaltype);
                 }
+
+                if (htlayout && !HashTable::setDefaultLayout(htlayout)) {
+                    getLogger()->log(EXTENSION_LOG_WARNING, NULL,
+                                     "Unhandled hash table layout: %s",
+                                     htlayout);
+                }
+
+                if (hthash && !HashTable::setDefaultHashFunction(hthash)) {
+                    getLogger()->log(EXTENSION_LOG_WARNING, NULL,
+                                     "Unhandled hash function: %s",
+                                     hthash);
+                }
             }
         }
 
@@ -312,11 +472,14 @@ public:
         if (ret == ENGINE_SUCCESS) {
             time_t start = time(NULL);
             try {
-                MultiDBSqliteStrategy *strategy =
-                    new MultiDBSqliteStrategy(*this, dbname,
-                                              initFile,
-                                              NUMBER_OF_SHARDS);
-                sqliteDb = new StrategicSqlite3(*this, strategy);
+                // One connection per flusher.
+                for (size_t i = 0; i < numFlushers; ++i) {
+                    MultiDBSqliteStrategy *strategy =
+                        new MultiDBSqliteStrategy(*this, dbname,
+                                                  initFile,
+                                                  NUMBER_OF_SHARDS);
+                    sqliteDbs.push_back(new StrategicSqlite3(*this, strategy));
+                }
             } catch (std::exception& e) {
                 std::stringstream ss;
                 ss << "Failed to create database: " << e.what() << std::endl;
@@ -331,7 +494,7 @@ public:
             }
 
             databaseInitTime = time(NULL) - start;
-            epstore = new EventuallyPersistentStore(*this, sqliteDb, startVb0);
+            epstore = new EventuallyPersistentStore(*this, sqliteDbs, startVb0);
             setMinDataAge(minDataAge);
             setQueueAgeCap(queueAgeCap);
 
@@ -363,9 +526,8 @@ public:
             // If requested, don't complete the initialization until the
             // flusher transitions out of the initializing state (i.e
             // warmup is finished).
-            const Flusher *flusher = epstore->getFlusher();
-            if (wait_for_warmup && flusher) {
-                while (flusher->state() == initializing) {
+            if (wait_for_warmup) {
+                while (epstore->getFlusherState() == initializing) {
                     sleep(1);
                 }
             }
@@ -384,6 +546,16 @@ public:
 
             shared_ptr<DispatcherCallback> cb(new ItemPager(epstore, stats));
             epstore->getDispatcher()->schedule(cb, NULL, 5, 10);
+
+            if (expiryPagerSleeptime > 0) {
+                shared_ptr<DispatcherCallback> exp_cb(new ExpiryPager(this, epstore, stats,
+                                                                      expiryPagerSleeptime));
+                epstore->getDispatcher()->schedule(exp_cb, NULL, 5,
+                                                   static_cast<double>(expiryPagerSleeptime));
+            }
+
+            shared_ptr<DispatcherCallback> hrcb(new HashtableResizer(epstore));
+            epstore->getDispatcher()->schedule(hrcb, NULL, 5, 10);
         }
 
         if (ret == ENGINE_SUCCESS) {
@@ -488,6 +660,12 @@ public:
             rv = doHashStats(cookie, add_stat);
         } else if (nkey == 7 && strncmp(stat_key, "vbucket", 7) == 0) {
             rv = doVBucketStats(cookie, add_stat);
+        } else if (nkey == 7 && strncmp(stat_key, "hotkeys", 7) == 0) {
+            rv = doHotKeyStats(cookie, add_stat);
+        } else if (nkey == 5 && strncmp(stat_key, "locks", 5) == 0) {
+            rv = doLockStats(cookie, add_stat);
+        } else if (nkey == 7 && strncmp(stat_key, "flusher", 7) == 0) {
+            rv = doFlusherStats(cookie, add_stat);
         } else if (nkey > 4 && strncmp(stat_key, "key ", 4) == 0) {
             // Non-validating, non-blocking version
             rv = doKeyStats(cookie, add_stat, &stat_key[4], nkey-4, false);
@@ -1011,7 +1189,7 @@ public:
                 v.reserve(ndata+2);
                 v.append(static_cast<const char*>(data), ndata);
                 v.append("\r\n");
-                shared_ptr<const Blob> vblob(Blob::New(v));
+                value_t vblob(Blob::New(v));
 
                 Item *item = new Item(k, flags, exptime, vblob);
                 item->setVBucketId(vbucket);
@@ -1095,7 +1273,7 @@ public:
         if (!epstore->pauseFlusher()) {
             getLogger()->log(EXTENSION_LOG_INFO, NULL,
                              "Attempted to stop flusher in state [%s]\n",
-                             epstore->getFlusher()->stateName());
+                             Flusher::stateName(epstore->getFlusherState()));
             *msg = "Flusher not running.";
             rv = PROTOCOL_BINARY_RESPONSE_EINVAL;
         }
@@ -1108,7 +1286,7 @@ public:
         if (!epstore->resumeFlusher()) {
             getLogger()->log(EXTENSION_LOG_INFO, NULL,
                              "Attempted to start flusher in state [%s]\n",
-                             epstore->getFlusher()->stateName());
+                             Flusher::stateName(epstore->getFlusherState()));
             *msg = "Flusher not shut down.";
             rv = PROTOCOL_BINARY_RESPONSE_EINVAL;
         }
@@ -1131,6 +1309,7 @@ public:
         stats.pagerRuns.set(0);
         stats.numValueEjects.set(0);
         stats.numFailedEjects.set(0);
+        stats.lockedReads.set(0);
         stats.io_num_read.set(0);
         stats.io_num_write.set(0);
         stats.io_read_bytes.set(0);
@@ -1146,6 +1325,17 @@ public:
         stats.pendingOpsTotal.set(0);
         stats.pendingOpsMax.set(0);
         stats.pendingOpsMaxDuration.set(0);
+        stats.numCompressions.set(0);
+        stats.numCompressed.set(0);
+        stats.compressedInBytes.set(0);
+        stats.compressedOutBytes.set(0);
+        stats.compressTime.set(0);
+        stats.numDecompressions.set(0);
+        stats.decompressTime.set(0);
+        for (int i = 0; i < EPStats::COMMIT_HISTO_BUCKETS; ++i) {
+            stats.commitHisto[i].set(0);
+        }
+        LockStats::resetAll();
     }
 
     void setMinDataAge(int to) {
@@ -1160,6 +1350,14 @@ public:
         epstore->setTxnSize(to);
     }
 
+    void setCommitBudget(size_t to) {
+        epstore->setCommitBudget(to);
+    }
+
+    void setVisitorThreads(size_t to) {
+        epstore->setVisitorThreads(to);
+    }
+
     void setBGFetchDelay(uint32_t to) {
         epstore->setBGFetchDelay(to);
     }
@@ -1221,7 +1419,10 @@ public:
 
     ~EventuallyPersistentEngine() {
         delete epstore;
-        delete sqliteDb;
+        std::vector<StrategicSqlite3*>::iterator it;
+        for (it = sqliteDbs.begin(); it != sqliteDbs.end(); ++it) {
+            delete *it;
+        }
         delete getlExtension;
     }
 
@@ -1237,6 +1438,20 @@ public:
         return stats;
     }
 
+    // The stats keep their counter shards on cache lines of their
+    // own, which plain new doesn't promise to line up.
+    static void *operator new(size_t n) {
+        void *p = NULL;
+        if (posix_memalign(&p, CACHE_LINE_SIZE, n) != 0) {
+            throw std::bad_alloc();
+        }
+        return p;
+    }
+
+    static void operator delete(void *p) {
+        free(p);
+    }
+
 private:
     EventuallyPersistentEngine(GET_SERVER_API get_server_api);
     friend ENGINE_ERROR_CODE create_instance(uint64_t interface,
@@ -1394,6 +1609,7 @@ private:
     }
 
     friend class BackFillVisitor;
+    friend class ExpiryPager;
     bool setEvents(const std::string &name,
                    std::list<QueuedItem> *q)
     {
@@ -1535,6 +1751,15 @@ private:
                         epstats.queue_age_cap, add_stat, cookie);
         add_casted_stat("ep_max_txn_size",
                         epstore->getTxnSize(), add_stat, cookie);
+        add_casted_stat("ep_commit_budget",
+                        epstore->getCommitBudget(), add_stat, cookie);
+        add_casted_stat("ep_visitor_threads",
+                        epstore->getVisitorThreads(), add_stat, cookie);
+        add_casted_stat("ep_hot_key_sample",
+                        HotKeys::getSampleRate(), add_stat, cookie);
+        add_casted_stat("ep_lock_profiling",
+                        LockStats::isEnabled() ? "true" : "false",
+                        add_stat, cookie);
         add_casted_stat("ep_data_age",
                         epstats.dataAge, add_stat, cookie);
         add_casted_stat("ep_data_age_highwat",
@@ -1556,7 +1781,9 @@ private:
         add_casted_stat("ep_flusher_todo",
                         epstats.flusher_todo, add_stat, cookie);
         add_casted_stat("ep_flusher_state",
-                        epstore->getFlusher()->stateName(),
+                        Flusher::stateName(epstore->getFlusherState()),
+                        add_stat, cookie);
+        add_casted_stat("ep_flushers", epstore->getNumFlushers(),
                         add_stat, cookie);
         add_casted_stat("ep_commit_time",
                         epstats.commit_time, add_stat, cookie);
@@ -1576,17 +1803,60 @@ private:
         add_casted_stat("ep_total_cache_size", StoredValue::getTotalCacheSize(stats),
                         add_stat, cookie);
         add_casted_stat("ep_oom_errors", stats.oom_errors, add_stat, cookie);
+        add_casted_stat("ep_vb_mem_soft_quota", epstats.vbMemSoftQuota,
+                        add_stat, cookie);
+        add_casted_stat("ep_vb_mem_hard_quota", epstats.vbMemHardQuota,
+                        add_stat, cookie);
+        add_casted_stat("ep_vb_quota_rejects", epstats.vbQuotaRejects,
+                        add_stat, cookie);
         add_casted_stat("ep_storage_type",
                         HashTable::getDefaultStorageValueTypeStr(),
                         add_stat, cookie);
+        add_casted_stat("ep_inline_value_size",
+                        HashTable::getDefaultInlineValueSize(),
+                        add_stat, cookie);
+        add_casted_stat("ep_compression_threshold",
+                        StoredValue::getCompressionThreshold(),
+                        add_stat, cookie);
         add_casted_stat("ep_bg_fetched", epstats.bg_fetched, add_stat,
                         cookie);
+        add_casted_stat("ep_bg_fetch_batches", epstats.bgFetchBatches,
+                        add_stat, cookie);
         add_casted_stat("ep_num_pager_runs", epstats.pagerRuns, add_stat,
                         cookie);
+        add_casted_stat("ep_exp_pager_stime", expiryPagerSleeptime, add_stat,
+                        cookie);
+        add_casted_stat("ep_num_expiry_pager_runs", epstats.expiryPagerRuns,
+                        add_stat, cookie);
+        add_casted_stat("ep_expired", epstats.expired, add_stat, cookie);
+        add_casted_stat("ep_expired_last_run", epstats.expiredLastRun,
+                        add_stat, cookie);
         add_casted_stat("ep_num_value_ejects", epstats.numValueEjects, add_stat,
                         cookie);
         add_casted_stat("ep_num_eject_failures", epstats.numFailedEjects, add_stat,
                         cookie);
+        add_casted_stat("ep_num_locked_reads", epstats.lockedReads, add_stat,
+                        cookie);
+        add_casted_stat("ep_slabs", epstats.numSlabs, add_stat, cookie);
+        add_casted_stat("ep_slab_bytes", epstats.slabBytes, add_stat, cookie);
+        add_casted_stat("ep_slab_used_bytes", epstats.slabUsedBytes, add_stat,
+                        cookie);
+        add_casted_stat("ep_slab_requested_bytes", epstats.slabRequestedBytes,
+                        add_stat, cookie);
+        add_casted_stat("ep_compressions", epstats.numCompressions,
+                        add_stat, cookie);
+        add_casted_stat("ep_compressed_values", epstats.numCompressed,
+                        add_stat, cookie);
+        add_casted_stat("ep_compressed_in_bytes",
+                        epstats.compressedInBytes, add_stat, cookie);
+        add_casted_stat("ep_compressed_out_bytes",
+                        epstats.compressedOutBytes, add_stat, cookie);
+        add_casted_stat("ep_compress_time", epstats.compressTime,
+                        add_stat, cookie);
+        add_casted_stat("ep_decompressions", epstats.numDecompressions,
+                        add_stat, cookie);
+        add_casted_stat("ep_decompress_time", epstats.decompressTime,
+                        add_stat, cookie);
 
         if (warmup) {
             add_casted_stat("ep_warmup_thread",
@@ -1648,21 +1918,111 @@ private:
     }
 
     ENGINE_ERROR_CODE doVBucketStats(const void *cookie, ADD_STAT add_stat) {
-        StatVBucketVisitor svbv(cookie, add_stat);
+        StatVBucketVisitor svbv(epstore, cookie, add_stat);
         epstore->visit(svbv);
         return ENGINE_SUCCESS;
     }
 
+    ENGINE_ERROR_CODE doHotKeyStats(const void *cookie, ADD_STAT add_stat) {
+        addHotKeyStats("", epstore->getHotKeys(NUM_HOT_KEY_STATS), add_stat,
+                       cookie);
+        StatHotKeysVisitor hkv(epstore, cookie, add_stat);
+        epstore->visit(hkv);
+        return ENGINE_SUCCESS;
+    }
+
     ENGINE_ERROR_CODE doHashStats(const void *cookie, ADD_STAT add_stat) {
         HashTableDepthStatVisitor depthVisitor;
         epstore->visitDepth(depthVisitor);
         add_casted_stat("ep_hash_bucket_size", epstore->getHashSize(), add_stat, cookie);
         add_casted_stat("ep_hash_num_locks", epstore->getHashLocks(), add_stat, cookie);
+        add_casted_stat("ep_hash_layout", HashTable::getDefaultLayoutStr(),
+                        add_stat, cookie);
+        add_casted_stat("ep_hash_function", HashTable::getDefaultHashFunctionStr(),
+                        add_stat, cookie);
+        add_casted_stat("ep_hash_huge_pages",
+                        HashTable::getHugePages() ? "true" : "false",
+                        add_stat, cookie);
+        add_casted_stat("ep_hash_num_resizes", epstore->getHashResizes(), add_stat, cookie);
         add_casted_stat("ep_hash_min_depth", depthVisitor.min, add_stat, cookie);
         add_casted_stat("ep_hash_max_depth", depthVisitor.max, add_stat, cookie);
         return ENGINE_SUCCESS;
     }
 
+    static void addLockStat(const char *name, LockStats *ls, uint64_t val,
+                            ADD_STAT add_stat, const void *cookie) {
+        char lock[80];
+        assert(strlen(name) + strlen(ls->getName()) + 2 < sizeof(lock));
+        sprintf(lock, "%s:%s", ls->getName(), name);
+        add_casted_stat(lock, val, add_stat, cookie);
+    }
+
+    static void addLockHisto(const char *name, LockStats *ls, int bucket,
+                             uint64_t val, ADD_STAT add_stat,
+                             const void *cookie) {
+        if (val == 0) {
+            return;
+        }
+        char range[40];
+        if (bucket == LockStats::HISTO_BUCKETS - 1) {
+            snprintf(range, sizeof(range), "%s_%llu_inf_us", name,
+                     (unsigned long long)LockStats::bucketStart(bucket));
+        } else {
+            snprintf(range, sizeof(range), "%s_%llu_%llu_us", name,
+                     (unsigned long long)LockStats::bucketStart(bucket),
+                     (unsigned long long)LockStats::bucketStart(bucket + 1));
+        }
+        addLockStat(range, ls, val, add_stat, cookie);
+    }
+
+    ENGINE_ERROR_CODE doLockStats(const void *cookie, ADD_STAT add_stat) {
+        std::vector<LockStats*> all(LockStats::getAll());
+        for (size_t i = 0; i < all.size(); ++i) {
+            LockStats *ls = all[i];
+            addLockStat("acquisitions", ls, ls->getAcquisitions(),
+                        add_stat, cookie);
+            addLockStat("contended", ls, ls->getContended(), add_stat, cookie);
+            addLockStat("wait_usec", ls, ls->getWaitTime() / 1000,
+                        add_stat, cookie);
+            addLockStat("hold_samples", ls, ls->getHoldSamples(),
+                        add_stat, cookie);
+            addLockStat("hold_usec", ls, ls->getHoldTime() / 1000,
+                        add_stat, cookie);
+            for (int b = 0; b < LockStats::HISTO_BUCKETS; ++b) {
+                addLockHisto("wait", ls, b, ls->getWaitHisto(b),
+                             add_stat, cookie);
+                addLockHisto("hold", ls, b, ls->getHoldHisto(b),
+                             add_stat, cookie);
+            }
+        }
+        return ENGINE_SUCCESS;
+    }
+
+    ENGINE_ERROR_CODE doFlusherStats(const void *cookie, ADD_STAT add_stat) {
+        char name[40];
+        for (size_t i = 0; i < epstore->getNumFlushers(); ++i) {
+            snprintf(name, sizeof(name), "flusher_%d:txn_size", static_cast<int>(i));
+            add_casted_stat(name, epstore->getFlusherTxnSize(i), add_stat, cookie);
+        }
+        EPStats &epstats = getEpStats();
+        for (int b = 0; b < EPStats::COMMIT_HISTO_BUCKETS; ++b) {
+            size_t val = epstats.commitHisto[b].get();
+            if (val == 0) {
+                continue;
+            }
+            if (b == EPStats::COMMIT_HISTO_BUCKETS - 1) {
+                snprintf(name, sizeof(name), "commit_%llu_inf_us",
+                         (unsigned long long)LockStats::bucketStart(b));
+            } else {
+                snprintf(name, sizeof(name), "commit_%llu_%llu_us",
+                         (unsigned long long)LockStats::bucketStart(b),
+                         (unsigned long long)LockStats::bucketStart(b + 1));
+            }
+            add_casted_stat(name, val, add_stat, cookie);
+        }
+        return ENGINE_SUCCESS;
+    }
+
     template <typename T>
     static void addTapStat(const char *name, TapConnection *tc, T val,
                            ADD_STAT add_stat, const void *cookie) {
@@ -1929,7 +2289,8 @@ private:
     bool wait_for_warmup;
     bool startVb0;
     SERVER_HANDLE_V1 *serverApi;
-    StrategicSqlite3 *sqliteDb;
+    size_t numFlushers;
+    std::vector<StrategicSqlite3*> sqliteDbs;
     EventuallyPersistentStore *epstore;
     std::map<const void*, TapConnection*> tapConnectionMap;
     std::map<const std::string, const void*> backfillValidityMap;
@@ -1943,6 +2304,7 @@ private:
     pthread_t notifyThreadId;
     bool startedEngineThreads;
     SyncObject tapNotifySync;
+    static LockStats tapNotifyLockStats;
     volatile bool shutdown;
     GET_SERVER_API getServerApi;
     union {
@@ -1962,6 +2324,7 @@ private:
     size_t memHighWat;
     size_t minDataAge;
     size_t queueAgeCap;
+    size_t expiryPagerSleeptime;
     EPStats stats;
 };
 
@@ -2000,6 +2363,17 @@ public:
         return valid;
     }
 
+    VBucketVisitor *forWorker() {
+        // Each thread queues up its own keys.
+        return new BackFillVisitor(engine, name, filter, validityToken);
+    }
+
+    void merge(VBucketVisitor &worker) {
+        BackFillVisitor &bfv = static_cast<BackFillVisitor&>(worker);
+        queue->splice(queue->end(), *bfv.queue);
+        valid = valid && bfv.valid;
+    }
+
     void apply(void) {
         setEvents();
         if (valid) {
@@ -2009,6 +2383,13 @@ public:
 
 private:
 
+    BackFillVisitor(EventuallyPersistentEngine *e, const std::string &n,
+                    const VBucketFilter &f, const void *token):
+        VBucketVisitor(), engine(e), name(n),
+        queue(new std::list<QueuedItem>),
+        filter(f), validityToken(token),
+        maxBackfillSize(250000), valid(true) { }
+
     void setEvents() {
         if (checkValidity()) {
             if (!queue->empty()) {
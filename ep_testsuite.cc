@@ -863,6 +863,37 @@ static enum test_result test_expiry(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
     return SUCCESS;
 }
 
+static enum test_result test_expiry_pager(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    const char *key = "test_expiry_pager";
+
+    item *it = NULL;
+
+    ENGINE_ERROR_CODE rv;
+    rv = h1->allocate(h, NULL, &it, key, strlen(key), 10, 0, 1);
+    check(rv == ENGINE_SUCCESS, "Allocation failed.");
+
+    uint64_t cas = 0;
+    rv = h1->store(h, NULL, it, &cas, OPERATION_SET, 0);
+    check(rv == ENGINE_SUCCESS, "Set failed.");
+    h1->release(h, NULL, it);
+    check(get_int_stat(h, h1, "ep_exp_pager_stime") == 1,
+          "Incorrect expiry pager sleep time.");
+
+    // Nobody asks for it, so only the pager can notice it's gone.
+    int tries = 0;
+    while (get_int_stat(h, h1, "ep_expired_last_run") == 0) {
+        check(++tries < 100, "Expiry pager never removed the item.");
+        usleep(100000);
+    }
+    check(get_int_stat(h, h1, "ep_expired") == 1, "Expected one item expired.");
+    verify_curr_items(h, h1, 0, "expiry pager");
+
+    check(h1->get(h, NULL, &it, key, strlen(key), 0) == ENGINE_KEY_ENOENT,
+          "Item didn't expire");
+
+    return SUCCESS;
+}
+
 static enum test_result test_vb_del_pending(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
     const void *cookie = testHarness.create_cookie();
     testHarness.set_ewouldblock_handling(cookie, false);
@@ -1347,6 +1378,28 @@ static enum test_result test_io_stats(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
     return SUCCESS;
 }
 
+static enum test_result test_compression_stats(ENGINE_HANDLE *h,
+                                               ENGINE_HANDLE_V1 *h1) {
+    std::string value(1000, 'a');
+    item *i = NULL;
+    check(store(h, h1, NULL, OPERATION_SET, "a", value.c_str(), &i) == ENGINE_SUCCESS,
+          "Failed to store a compressible value.");
+    check_key_value(h, h1, "a", value.c_str(), value.length());
+    check(get_int_stat(h, h1, "ep_compressed_values") == 1,
+          "Expected the value to be kept compressed.");
+    check(get_int_stat(h, h1, "ep_decompressions") >= 1,
+          "Expected reading the value to decompress it.");
+
+    h1->reset_stats(h, NULL);
+    check(get_int_stat(h, h1, "ep_compressions") == 0 &&
+          get_int_stat(h, h1, "ep_compressed_values") == 0 &&
+          get_int_stat(h, h1, "ep_compressed_in_bytes") == 0 &&
+          get_int_stat(h, h1, "ep_compressed_out_bytes") == 0 &&
+          get_int_stat(h, h1, "ep_decompressions") == 0,
+          "Expected reset stats to set the compression counters to zero");
+    return SUCCESS;
+}
+
 static enum test_result test_bg_stats(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
     h1->reset_stats(h, NULL);
     wait_for_persisted_value(h, h1, "a", "b\r\n");
@@ -1755,6 +1808,294 @@ static enum test_result test_max_size_settings(ENGINE_HANDLE *h,
     return SUCCESS;
 }
 
+static enum test_result test_visitor_threads_settings(ENGINE_HANDLE *h,
+                                                      ENGINE_HANDLE_V1 *h1) {
+    check(get_int_stat(h, h1, "ep_visitor_threads") == 1,
+          "Incorrect initial visitor threads.");
+
+    check(set_flush_param(h, h1, "visitor_threads", "4"),
+          "Failed to set visitor threads.");
+    check(get_int_stat(h, h1, "ep_visitor_threads") == 4,
+          "Incorrect new visitor threads.");
+
+    check(!set_flush_param(h, h1, "visitor_threads", "0"),
+          "Set zero visitor threads.");
+    check(get_int_stat(h, h1, "ep_visitor_threads") == 4,
+          "Visitor threads changed by a bad value.");
+
+    return SUCCESS;
+}
+
+static enum test_result test_hot_keys(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    check(set_flush_param(h, h1, "hot_key_sample", "1"),
+          "Failed to set hot key sampling.");
+    check(get_int_stat(h, h1, "ep_hot_key_sample") == 1,
+          "Incorrect hot key sampling.");
+
+    item *i = NULL;
+    check(store(h, h1, NULL, OPERATION_SET, "cold", "v", &i) == ENGINE_SUCCESS,
+          "Failed to store an item.");
+    for (int j = 0; j < 10; ++j) {
+        check(store(h, h1, NULL, OPERATION_SET, "hot", "v", &i) == ENGINE_SUCCESS,
+              "Failed to store an item.");
+    }
+
+    vals.clear();
+    check(h1->get_stats(h, NULL, "hotkeys", 7, add_stats) == ENGINE_SUCCESS,
+          "Failed to get hot key stats.");
+    check(vals["hot_0_key"] == "hot", "Expected the hot key first.");
+    check(vals["hot_0_ops"] == "10", "Expected ten ops on the hot key.");
+    check(vals["hot_1_key"] == "cold", "Expected the cold key second.");
+    check(vals["vb_0:hot_0_key"] == "hot", "Expected the hot key in vb 0.");
+    check(vals.find("vb_0:hot_0_lock") != vals.end(),
+          "Expected the hot key's lock.");
+
+    check(!set_flush_param(h, h1, "hot_key_sample", "-1"),
+          "Set a negative hot key sampling.");
+    check(set_flush_param(h, h1, "hot_key_sample", "100"),
+          "Failed to reset hot key sampling.");
+    return SUCCESS;
+}
+
+static enum test_result test_vb_mem_quota(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    check(set_vbucket_state(h, h1, 1, "active"), "Failed to set vbucket state.");
+    check(set_flush_param(h, h1, "vb_mem_hard_quota", "2048"),
+          "Failed to set the hard quota.");
+    check(get_int_stat(h, h1, "ep_vb_mem_hard_quota") == 2048,
+          "Incorrect hard quota.");
+
+    item *i = NULL;
+    std::string value(200, 'x');
+    ENGINE_ERROR_CODE ret = ENGINE_SUCCESS;
+    int stored = 0;
+    for (; stored < 100; ++stored) {
+        char key[16];
+        snprintf(key, sizeof(key), "key%d", stored);
+        ret = store(h, h1, NULL, OPERATION_SET, key, value.c_str(), &i);
+        if (ret != ENGINE_SUCCESS) {
+            break;
+        }
+    }
+    check(ret == ENGINE_TMPFAIL, "Expected a temporary failure over the quota.");
+    check(stored > 0, "Expected some items to fit.");
+    check(get_int_stat(h, h1, "ep_vb_quota_rejects") == 1,
+          "Expected one rejected set.");
+
+    // Only the vbucket over its quota is turned away.
+    check(store(h, h1, NULL, OPERATION_SET, "key", value.c_str(), &i,
+                0, 1) == ENGINE_SUCCESS,
+          "Failed to store in another vbucket.");
+
+    vals.clear();
+    check(h1->get_stats(h, NULL, "vbucket", 7, add_stats) == ENGINE_SUCCESS,
+          "Failed to get vbucket stats.");
+    check(atoi(vals["vb_0:num_items"].c_str()) == stored,
+          "Incorrect number of items in vb 0.");
+    check(atoi(vals["vb_1:num_items"].c_str()) == 1,
+          "Incorrect number of items in vb 1.");
+    int memSize = atoi(vals["vb_0:mem_size"].c_str());
+    check(memSize > 0 && memSize <= 2048, "Incorrect memory size of vb 0.");
+
+    check(set_flush_param(h, h1, "vb_mem_hard_quota", "0"),
+          "Failed to turn off the hard quota.");
+    check(store(h, h1, NULL, OPERATION_SET, "last", value.c_str(), &i)
+          == ENGINE_SUCCESS,
+          "Failed to store without a quota.");
+    return SUCCESS;
+}
+
+static enum test_result test_lock_stats(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    h1->reset_stats(h, NULL);
+    item *i = NULL;
+    for (int j = 0; j < 10; ++j) {
+        check(store(h, h1, NULL, OPERATION_SET, "key", "v", &i) == ENGINE_SUCCESS,
+              "Failed to store an item.");
+    }
+
+    vals.clear();
+    check(h1->get_stats(h, NULL, "locks", 5, add_stats) == ENGINE_SUCCESS,
+          "Failed to get lock stats.");
+    check(atoi(vals["hash_stripe:acquisitions"].c_str()) >= 10,
+          "Expected the hash table locks to be counted.");
+    check(vals.find("hash_stripe:contended") != vals.end(),
+          "Expected contended hash table locks.");
+    check(vals.find("vbset:acquisitions") != vals.end(),
+          "Expected the vbset lock.");
+    check(vals.find("tap_notify:wait_usec") != vals.end(),
+          "Expected the tap notify lock.");
+    check(vals.find("dispatcher:hold_usec") != vals.end(),
+          "Expected the dispatcher lock.");
+    check(vals.find("flusher_task:hold_samples") != vals.end(),
+          "Expected the flusher lock.");
+
+    check(set_flush_param(h, h1, "lock_profiling", "0"),
+          "Failed to turn off lock profiling.");
+    vals.clear();
+    check(h1->get_stats(h, NULL, NULL, 0, add_stats) == ENGINE_SUCCESS,
+          "Failed to get stats.");
+    check(vals["ep_lock_profiling"] == "false", "Expected lock profiling off.");
+    vals.clear();
+    check(h1->get_stats(h, NULL, "locks", 5, add_stats) == ENGINE_SUCCESS,
+          "Failed to get lock stats.");
+    std::string before = vals["hash_stripe:acquisitions"];
+    check(store(h, h1, NULL, OPERATION_SET, "key", "v", &i) == ENGINE_SUCCESS,
+          "Failed to store an item.");
+    vals.clear();
+    check(h1->get_stats(h, NULL, "locks", 5, add_stats) == ENGINE_SUCCESS,
+          "Failed to get lock stats.");
+    check(vals["hash_stripe:acquisitions"] == before,
+          "Expected no counting with profiling off.");
+
+    check(!set_flush_param(h, h1, "lock_profiling", "2"),
+          "Set an invalid lock profiling value.");
+    check(set_flush_param(h, h1, "lock_profiling", "1"),
+          "Failed to turn lock profiling back on.");
+    return SUCCESS;
+}
+
+static enum test_result test_sharded_flushers(ENGINE_HANDLE *h,
+                                              ENGINE_HANDLE_V1 *h1) {
+    check(get_int_stat(h, h1, "ep_flushers") == 4, "Expected four flushers.");
+
+    item *i = NULL;
+    for (int j = 0; j < 100; ++j) {
+        char key[16];
+        snprintf(key, sizeof(key), "key%d", j);
+        check(store(h, h1, NULL, OPERATION_SET, key, key, &i) == ENGINE_SUCCESS,
+              "Failed to store an item.");
+    }
+    for (int j = 0; j < 100; j += 2) {
+        char key[16];
+        snprintf(key, sizeof(key), "key%d", j);
+        check(h1->remove(h, NULL, key, strlen(key), 0, 0) == ENGINE_SUCCESS,
+              "Failed to delete an item.");
+    }
+
+    // Read back what they wrote with a single flusher.
+    testHarness.reload_engine(&h, &h1,
+                              testHarness.engine_path,
+                              testHarness.default_engine_cfg,
+                              true);
+    check(get_int_stat(h, h1, "ep_flushers") == 1, "Expected one flusher.");
+    for (int j = 0; j < 100; ++j) {
+        char key[16];
+        snprintf(key, sizeof(key), "key%d", j);
+        if (j % 2 == 0) {
+            check(verify_key(h, h1, key) == ENGINE_KEY_ENOENT,
+                  "Expected a deleted item to stay deleted.");
+        } else {
+            check_key_value(h, h1, key, key, strlen(key));
+        }
+    }
+    return SUCCESS;
+}
+
+static enum test_result test_batched_deletes(ENGINE_HANDLE *h,
+                                             ENGINE_HANDLE_V1 *h1) {
+    item *i = NULL;
+    for (int j = 0; j < 100; ++j) {
+        char key[16];
+        snprintf(key, sizeof(key), "key%d", j);
+        check(store(h, h1, NULL, OPERATION_SET, key, key, &i) == ENGINE_SUCCESS,
+              "Failed to store an item.");
+    }
+    while (get_int_stat(h, h1, "ep_total_persisted") < 100) {
+        usleep(100);
+    }
+
+    // Enough to be deleted several at a time.
+    for (int j = 0; j < 60; ++j) {
+        char key[16];
+        snprintf(key, sizeof(key), "key%d", j);
+        check(h1->remove(h, NULL, key, strlen(key), 0, 0) == ENGINE_SUCCESS,
+              "Failed to delete an item.");
+    }
+    while (get_int_stat(h, h1, "ep_total_persisted") < 160) {
+        usleep(100);
+    }
+    check(get_int_stat(h, h1, "ep_total_persisted") == 160,
+          "Expected each delete to be counted once.");
+
+    testHarness.reload_engine(&h, &h1,
+                              testHarness.engine_path,
+                              testHarness.default_engine_cfg,
+                              true);
+    for (int j = 0; j < 100; ++j) {
+        char key[16];
+        snprintf(key, sizeof(key), "key%d", j);
+        if (j < 60) {
+            check(verify_key(h, h1, key) == ENGINE_KEY_ENOENT,
+                  "Expected a deleted item to stay deleted.");
+        } else {
+            check_key_value(h, h1, key, key, strlen(key));
+        }
+    }
+    return SUCCESS;
+}
+
+static enum test_result test_commit_budget(ENGINE_HANDLE *h,
+                                           ENGINE_HANDLE_V1 *h1) {
+    check(get_int_stat(h, h1, "ep_commit_budget") == 0,
+          "Expected no commit budget by default.");
+    vals.clear();
+    check(h1->get_stats(h, NULL, "flusher", 7, add_stats) == ENGINE_SUCCESS,
+          "Failed to get flusher stats.");
+    check(atoi(vals["flusher_0:txn_size"].c_str()) == get_int_stat(h, h1, "ep_max_txn_size"),
+          "Expected full size transactions without a budget.");
+
+    check(set_flush_param(h, h1, "commit_budget", "100"),
+          "Failed to set the commit budget.");
+    check(get_int_stat(h, h1, "ep_commit_budget") == 100,
+          "Expected the new commit budget.");
+    check(!set_flush_param(h, h1, "commit_budget", "60001"),
+          "Set an invalid commit budget.");
+
+    h1->reset_stats(h, NULL);
+    wait_for_persisted_value(h, h1, "key", "value");
+    vals.clear();
+    check(h1->get_stats(h, NULL, "flusher", 7, add_stats) == ENGINE_SUCCESS,
+          "Failed to get flusher stats.");
+    int commits = 0;
+    std::map<std::string, std::string>::iterator it;
+    for (it = vals.begin(); it != vals.end(); ++it) {
+        if (it->first.compare(0, 7, "commit_") == 0) {
+            commits += atoi(it->second.c_str());
+        }
+    }
+    check(commits >= 1, "Expected the commit to be counted.");
+    int tsz = atoi(vals["flusher_0:txn_size"].c_str());
+    check(tsz >= 1 && tsz <= get_int_stat(h, h1, "ep_max_txn_size"),
+          "Expected the transaction size within bounds.");
+    return SUCCESS;
+}
+
+static enum test_result test_commit_budget_shrinks(ENGINE_HANDLE *h,
+                                                   ENGINE_HANDLE_V1 *h1) {
+    check(set_flush_param(h, h1, "commit_budget", "1"),
+          "Failed to set the commit budget.");
+    // No commit of this many items fits in a millisecond.
+    item *i = NULL;
+    char value[256];
+    memset(value, 'x', sizeof(value) - 1);
+    value[sizeof(value) - 1] = 0x00;
+    for (int j = 0; j < 5000; ++j) {
+        char key[16];
+        snprintf(key, sizeof(key), "key%d", j);
+        check(store(h, h1, NULL, OPERATION_SET, key, value, &i) == ENGINE_SUCCESS,
+              "Failed to store an item.");
+    }
+    while (get_int_stat(h, h1, "ep_total_persisted") < 5000) {
+        usleep(100);
+    }
+
+    vals.clear();
+    check(h1->get_stats(h, NULL, "flusher", 7, add_stats) == ENGINE_SUCCESS,
+          "Failed to get flusher stats.");
+    check(atoi(vals["flusher_0:txn_size"].c_str()) < get_int_stat(h, h1, "ep_max_txn_size"),
+          "Expected smaller transactions after going over the budget.");
+    return SUCCESS;
+}
+
 engine_test_t* get_tests(void) {
 
     static engine_test_t tests[]  = {
@@ -1764,6 +2105,17 @@ engine_test_t* get_tests(void) {
          "max_size=4096;ht_locks=1;ht_size=3"},
         {"test max_size changes", test_max_size_settings, NULL, teardown,
          "max_size=1000;ht_locks=1;ht_size=3"},
+        {"test visitor_threads changes", test_visitor_threads_settings, NULL,
+         teardown, NULL},
+        {"test hot keys", test_hot_keys, NULL, teardown, NULL},
+        {"test vbucket memory quota", test_vb_mem_quota, NULL, teardown, NULL},
+        {"test lock stats", test_lock_stats, NULL, teardown, NULL},
+        {"test sharded flushers", test_sharded_flushers, NULL, teardown,
+         "flushers=4"},
+        {"test batched deletes", test_batched_deletes, NULL, teardown, NULL},
+        {"test commit budget", test_commit_budget, NULL, teardown, NULL},
+        {"test commit budget shrinks transactions", test_commit_budget_shrinks,
+         NULL, teardown, NULL},
         {"test whitespace dbname", test_whitespace_db, NULL, teardown,
          "dbname=" WHITESPACE_DB ";ht_locks=1;ht_size=3"},
         {"get miss", test_get_miss, NULL, teardown, NULL},
@@ -1782,10 +2134,14 @@ engine_test_t* get_tests(void) {
         {"flush", test_flush, NULL, teardown, NULL},
         {"flush multi vbuckets", test_flush_multiv, NULL, teardown, NULL},
         {"expiry", test_expiry, NULL, teardown, NULL},
+        {"expiry pager", test_expiry_pager, NULL, teardown,
+         "exp_pager_stime=1"},
         // Stats tests
         {"stats", test_stats, NULL, teardown, NULL},
         {"io stats", test_io_stats, NULL, teardown, NULL},
         {"bg stats", test_bg_stats, NULL, teardown, NULL},
+        {"compression stats", test_compression_stats, NULL, teardown,
+         "compression_threshold=64"},
         {"mem stats", test_mem_stats, NULL, teardown, NULL},
         {"stats key", NULL, NULL, teardown, NULL},
         {"stats vkey", NULL, NULL, teardown, NULL},
@@ -19,6 +19,8 @@
 
 #include "flusher.hh"
 
+LockStats Flusher::taskLockStats("flusher_task");
+
 bool FlusherStepper::callback(Dispatcher &d, TaskId t) {
     return flusher->step(d, t);
 }
@@ -60,7 +62,7 @@ static bool validTransition(enum flusher_state from,
     return rv;
 }
 
-const char * Flusher::stateName(enum flusher_state st) const {
+const char * Flusher::stateName(enum flusher_state st) {
     static const char * const stateNames[] = {
         "initializing", "running", "pausing", "paused", "stopping", "stopped"
     };
@@ -100,17 +102,19 @@ enum flusher_state Flusher::state() const {
 
 void Flusher::initialize(TaskId tid) {
     assert(task.get() == tid.get());
-    getLogger()->log(EXTENSION_LOG_DEBUG, NULL,
-                     "Initializing flusher; warming up\n");
-
-    time_t startTime = time(NULL);
-    store->warmup();
-    store->stats.warmupTime.set(time(NULL) - startTime);
-    store->stats.warmupComplete.set(true);
-    store->stats.curr_items.incr(store->stats.warmedUp.get());
-
-    getLogger()->log(EXTENSION_LOG_DEBUG, NULL,
-                     "Warmup completed in %ds\n", store->stats.warmupTime.get());
+    if (shard == 0) {
+        getLogger()->log(EXTENSION_LOG_DEBUG, NULL,
+                         "Initializing flusher; warming up\n");
+
+        time_t startTime = time(NULL);
+        store->warmup();
+        store->stats.warmupTime.set(time(NULL) - startTime);
+        store->stats.warmupComplete.set(true);
+        store->stats.curr_items.incr(store->stats.warmedUp.get());
+
+        getLogger()->log(EXTENSION_LOG_DEBUG, NULL,
+                         "Warmup completed in %ds\n", store->stats.warmupTime.get());
+    }
     transition_state(running);
 }
 
@@ -135,6 +139,10 @@ bool Flusher::step(Dispatcher &d, TaskId tid) {
     try {
         switch (_state) {
         case initializing:
+            if (shard != 0 && !store->stats.warmupComplete.get()) {
+                d.snooze(tid, 1);
+                return true;
+            }
             initialize(tid);
             return true;
         case paused:
@@ -198,11 +206,11 @@ int Flusher::doFlush() {
     // On a fresh entry, flushQueue is null and we need to build one.
     if (!flushQueue) {
         flushRv = store->stats.min_data_age;
-        flushQueue = store->beginFlush();
+        flushQueue = store->beginFlush(shard);
         if (flushQueue) {
             getLogger()->log(EXTENSION_LOG_DEBUG, NULL,
                              "Beginning a write queue flush.\n");
-            rejectQueue = new std::queue<QueuedItem>();
+            rejectQueue = new std::queue<DirtyItem>();
             flushStart = ep_current_time();
         }
     }
@@ -210,7 +218,7 @@ int Flusher::doFlush() {
     // Now do the every pass thing.
     if (flushQueue) {
         if (!flushQueue->empty()) {
-            int n = store->flushSome(flushQueue, rejectQueue);
+            int n = store->flushSome(shard, flushQueue, rejectQueue);
             if (_state == pausing) {
                 transition_state(paused);
             }
@@ -218,7 +226,7 @@ int Flusher::doFlush() {
         }
 
         if (flushQueue->empty()) {
-            store->completeFlush(rejectQueue, flushStart);
+            store->completeFlush(shard, rejectQueue, flushStart);
             getLogger()->log(EXTENSION_LOG_INFO, NULL,
                              "Completed a flush, age of oldest item was %ds\n",
                              flushRv);
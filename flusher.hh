@@ -6,15 +6,6 @@
 #include "ep.hh"
 #include "dispatcher.hh"
 
-enum flusher_state {
-    initializing,
-    running,
-    pausing,
-    paused,
-    stopping,
-    stopped
-};
-
 class Flusher;
 
 class FlusherStepper : public DispatcherCallback {
@@ -25,11 +16,17 @@ private:
     Flusher *flusher;
 };
 
+/**
+ * Writes the dirty items of one of the store's FlushShards.
+ *
+ * The first flusher also warms the store up; the others wait for it
+ * to be done before they start.
+ */
 class Flusher {
 public:
-    Flusher(EventuallyPersistentStore *st, Dispatcher *d) :
-        store(st), _state(initializing), dispatcher(d),
-        flushQueue(NULL) {
+    Flusher(EventuallyPersistentStore *st, Dispatcher *d, size_t s) :
+        store(st), _state(initializing), taskMutex(taskLockStats),
+        dispatcher(d), shard(s), flushQueue(NULL) {
     }
     ~Flusher() {
         if (_state != stopped) {
@@ -55,6 +52,7 @@ public:
 
     enum flusher_state state() const;
     const char * stateName() const;
+    static const char * stateName(enum flusher_state st);
 private:
     int doFlush();
     void completeFlush();
@@ -62,17 +60,19 @@ private:
 
     EventuallyPersistentStore *store;
     volatile enum flusher_state _state;
-    Mutex taskMutex;
+    ProfiledMutex taskMutex;
     TaskId task;
     Dispatcher *dispatcher;
-    const char * stateName(enum flusher_state st) const;
+    size_t shard;
 
     // Current flush cycle state.
     int                     flushRv;
-    std::queue<QueuedItem> *flushQueue;
-    std::queue<QueuedItem> *rejectQueue;
+    std::queue<DirtyItem> *flushQueue;
+    std::queue<DirtyItem> *rejectQueue;
     rel_time_t              flushStart;
 
+    static LockStats        taskLockStats;
+
     DISALLOW_COPY_AND_ASSIGN(Flusher);
 };
 
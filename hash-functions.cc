@@ -0,0 +1,219 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#include "config.h"
+#include <cassert>
+
+#include "hash-functions.hh"
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <cpuid.h>
+#define HAVE_HARDWARE_CRC32C 1
+#endif
+
+// Built from halves because compilers on 32 bit systems whine about
+// large integer constants.
+static inline uint64_t u64(uint32_t hi, uint32_t lo) {
+    return (static_cast<uint64_t>(hi) << 32) | lo;
+}
+
+static const uint64_t wordMultiplier = u64(0xc6a4a793, 0x5bd1e995);
+static const uint64_t finalMultiplier1 = u64(0xff51afd7, 0xed558ccd);
+static const uint64_t finalMultiplier2 = u64(0xc4ceb9fe, 0x1a85ec53);
+
+static inline uint64_t load(const char *p) {
+    uint64_t rv;
+    memcpy(&rv, p, sizeof(rv));
+    return rv;
+}
+
+// The trailing partial word, zero padded.  Byte by byte rather than
+// a variable length memcpy(), which isn't inlined.
+static inline uint64_t loadTail(const char *p, size_t n) {
+    const unsigned char *u = reinterpret_cast<const unsigned char*>(p);
+    uint64_t rv = 0;
+    while (n > 0) {
+        rv = (rv << 8) | u[--n];
+    }
+    return rv;
+}
+
+static inline uint64_t rotate(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+// Spread every input bit over the whole output.
+static inline uint64_t finish(uint64_t h) {
+    h ^= h >> 33;
+    h *= finalMultiplier1;
+    h ^= h >> 33;
+    h *= finalMultiplier2;
+    h ^= h >> 33;
+    return h;
+}
+
+uint64_t KeyHash::word(const char *str, size_t len) {
+    const int r = 47;
+    uint64_t h = len * wordMultiplier;
+    const char *end = str + (len & ~static_cast<size_t>(7));
+
+    for (; str != end; str += 8) {
+        uint64_t k = load(str);
+        k *= wordMultiplier;
+        k ^= k >> r;
+        k *= wordMultiplier;
+        h ^= k;
+        h *= wordMultiplier;
+    }
+
+    if (len & 7) {
+        h ^= loadTail(str, len & 7);
+        h *= wordMultiplier;
+    }
+
+    return finish(h);
+}
+
+/*
+ * CRC32C runs two lanes over each word: one over the word as loaded
+ * and one with its halves swapped.  Each lane is a different linear
+ * function of the key, so together (and after the final mix) they
+ * make a proper 64-bit hash rather than 32 bits spread thin.  The
+ * key length seeds both lanes so zero padding doesn't collide.
+ */
+
+namespace {
+    class Crc32cTable {
+    public:
+        Crc32cTable() {
+            for (uint32_t i = 0; i < 256; ++i) {
+                uint32_t c = i;
+                for (int j = 0; j < 8; ++j) {
+                    c = (c >> 1) ^ (0x82f63b78 & (0 - (c & 1)));
+                }
+                t[i] = c;
+            }
+        }
+
+        uint32_t step(uint32_t crc, uint64_t k) const {
+            for (int i = 0; i < 8; ++i) {
+                crc = t[(crc ^ k) & 0xff] ^ (crc >> 8);
+                k >>= 8;
+            }
+            return crc;
+        }
+
+    private:
+        uint32_t t[256];
+    };
+
+    const Crc32cTable crc32cTable;
+}
+
+static inline uint64_t combine(uint32_t a, uint32_t b) {
+    return finish(u64(b, a));
+}
+
+uint64_t KeyHash::crc32cSoftware(const char *str, size_t len) {
+    uint32_t a = ~static_cast<uint32_t>(len);
+    uint32_t b = static_cast<uint32_t>(len);
+    const char *end = str + (len & ~static_cast<size_t>(7));
+
+    for (; str != end; str += 8) {
+        uint64_t k = load(str);
+        a = crc32cTable.step(a, k);
+        b = crc32cTable.step(b, rotate(k, 32));
+    }
+
+    if (len & 7) {
+        uint64_t k = loadTail(str, len & 7);
+        a = crc32cTable.step(a, k);
+        b = crc32cTable.step(b, rotate(k, 32));
+    }
+
+    return combine(a, b);
+}
+
+#ifdef HAVE_HARDWARE_CRC32C
+__attribute__((target("sse4.2")))
+static uint64_t crc32cHardware(const char *str, size_t len) {
+    uint64_t a = ~static_cast<uint32_t>(len);
+    uint64_t b = static_cast<uint32_t>(len);
+    const char *end = str + (len & ~static_cast<size_t>(7));
+
+    for (; str != end; str += 8) {
+        uint64_t k = load(str);
+        a = __builtin_ia32_crc32di(a, k);
+        b = __builtin_ia32_crc32di(b, rotate(k, 32));
+    }
+
+    if (len & 7) {
+        uint64_t k = loadTail(str, len & 7);
+        a = __builtin_ia32_crc32di(a, k);
+        b = __builtin_ia32_crc32di(b, rotate(k, 32));
+    }
+
+    return combine(static_cast<uint32_t>(a), static_cast<uint32_t>(b));
+}
+
+static bool cpuHasCrc32c() {
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+        return false;
+    }
+    return (ecx & bit_SSE4_2) != 0;
+}
+#endif
+
+bool KeyHash::hardwareCrc32c() {
+#ifdef HAVE_HARDWARE_CRC32C
+    // Looked up on first use so it's safe during static initialization.
+    static const bool rv = cpuHasCrc32c();
+    return rv;
+#else
+    return false;
+#endif
+}
+
+KeyHash::function_t KeyHash::implementation(enum hash_function_type t) {
+    function_t rv = NULL;
+    switch (t) {
+    case word_hash:
+        rv = word;
+        break;
+    case crc32c_hash:
+#ifdef HAVE_HARDWARE_CRC32C
+        rv = hardwareCrc32c() ? crc32cHardware : crc32cSoftware;
+#else
+        rv = crc32cSoftware;
+#endif
+        break;
+    default:
+        abort();
+    }
+    return rv;
+}
+
+enum hash_function_type KeyHash::fastest() {
+    return hardwareCrc32c() ? crc32c_hash : word_hash;
+}
+
+bool KeyHash::parse(const char *s, enum hash_function_type *t) {
+    bool rv = false;
+    if (s && strcmp(s, "word") == 0) {
+        *t = word_hash;
+        rv = true;
+    } else if (s && strcmp(s, "crc32c") == 0) {
+        *t = crc32c_hash;
+        rv = true;
+    }
+    return rv;
+}
+
+const char *KeyHash::name(enum hash_function_type t) {
+    const char *rv = "unknown";
+    switch (t) {
+    case word_hash: rv = "word"; break;
+    case crc32c_hash: rv = "crc32c"; break;
+    default: abort();
+    }
+    return rv;
+}
@@ -0,0 +1,87 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#ifndef HASH_FUNCTIONS_H
+#define HASH_FUNCTIONS_H 1
+
+#include <cstring>
+
+#include "common.hh"
+
+/**
+ * Available key hash functions.
+ */
+enum hash_function_type {
+    word_hash,                  //!< Multiply/xor over eight byte words.
+    crc32c_hash                 //!< Two CRC32C lanes, in hardware if possible.
+};
+
+/**
+ * 64-bit key hashes.
+ *
+ * A key is hashed once and the result is carved up by its users.  The
+ * hash table takes the low bits for its bucket number, which in turn
+ * pick the lock stripe and the bucket fingerprint, and the database
+ * shard is picked from the high bits.
+ *
+ * A function's result doesn't depend on the CPU it runs on, only its
+ * speed does: CRC32C uses the SSE4.2 instruction when the processor
+ * has one and a table driven loop otherwise.
+ */
+class KeyHash {
+public:
+
+    //! A function hashing the given bytes.
+    typedef uint64_t (*function_t)(const char *str, size_t len);
+
+    /**
+     * Hash a key eight bytes at a time with a multiply/xor mix.
+     */
+    static uint64_t word(const char *str, size_t len);
+
+    /**
+     * Hash a key with CRC32C using the fastest implementation this
+     * machine supports.
+     */
+    static uint64_t crc32c(const char *str, size_t len) {
+        return implementation(crc32c_hash)(str, len);
+    }
+
+    /**
+     * Hash a key with CRC32C without any help from the CPU.
+     */
+    static uint64_t crc32cSoftware(const char *str, size_t len);
+
+    /**
+     * True if this CPU computes CRC32C in hardware.
+     */
+    static bool hardwareCrc32c();
+
+    /**
+     * Get the fastest implementation of the given hash function.
+     */
+    static function_t implementation(enum hash_function_type t);
+
+    /**
+     * Get the hash function that's fastest on this machine.
+     */
+    static enum hash_function_type fastest();
+
+    /**
+     * Look up a hash function by name.
+     *
+     * @param s either "word" or "crc32c"
+     * @param t where to store the hash function
+     *
+     * @return true if the name was recognized
+     */
+    static bool parse(const char *s, enum hash_function_type *t);
+
+    /**
+     * Get the name of the given hash function.
+     */
+    static const char *name(enum hash_function_type t);
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(KeyHash);
+};
+
+#endif /* HASH_FUNCTIONS_H */
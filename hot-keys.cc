@@ -0,0 +1,80 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#include "config.h"
+#include <algorithm>
+
+#include "hot-keys.hh"
+
+Atomic<size_t> HotKeys::sampleRate(100);
+
+// Countdown to the next operation this thread records; NULL until
+// it has recorded one.
+static ThreadLocal<void*> countdown;
+
+void HotKeys::record(const std::string &key, uint64_t weight) {
+    SpinLockHolder lh(&lock);
+    std::vector<Entry>::iterator it, least = entries.end();
+    for (it = entries.begin(); it != entries.end(); ++it) {
+        if (it->key == key) {
+            it->count += weight;
+            return;
+        }
+        if (least == entries.end() || it->count < least->count) {
+            least = it;
+        }
+    }
+
+    if (entries.size() < capacity) {
+        entries.push_back(Entry(key, weight, 0));
+    } else if (least != entries.end()) {
+        least->key = key;
+        least->error = least->count;
+        least->count += weight;
+    }
+}
+
+std::vector<HotKeys::Entry> HotKeys::top(size_t n) {
+    std::vector<Entry> rv;
+    {
+        SpinLockHolder lh(&lock);
+        rv = entries;
+    }
+    std::sort(rv.begin(), rv.end());
+    if (rv.size() > n) {
+        rv.resize(n, Entry("", 0, 0));
+    }
+    return rv;
+}
+
+void HotKeys::reset() {
+    SpinLockHolder lh(&lock);
+    entries.clear();
+}
+
+size_t HotKeys::sample() {
+    size_t rate = sampleRate.get();
+    if (rate == 0) {
+        return 0;
+    }
+
+    size_t left = reinterpret_cast<size_t>(countdown.get());
+    // Don't keep counting down from before the rate was lowered.
+    if (left > rate) {
+        left = rate;
+    }
+    if (left > 1) {
+        countdown.set(reinterpret_cast<void*>(left - 1));
+        return 0;
+    }
+    countdown.set(reinterpret_cast<void*>(rate));
+    // A thread's first operation is recorded too, which is close
+    // enough.
+    return rate;
+}
+
+void HotKeys::setSampleRate(size_t to) {
+    sampleRate.set(to);
+}
+
+size_t HotKeys::getSampleRate() {
+    return sampleRate.get();
+}
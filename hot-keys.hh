@@ -0,0 +1,98 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#ifndef HOT_KEYS_H
+#define HOT_KEYS_H 1
+
+#include <string>
+#include <vector>
+
+#include "common.hh"
+#include "atomic.hh"
+
+/**
+ * Keeps track of the most used keys in a bounded amount of memory.
+ *
+ * This is the Space-Saving algorithm: at most `capacity' keys are
+ * counted, and a key that isn't counted yet takes over the slot of
+ * the least counted one, inheriting its count as a possible
+ * overcount.  Any key that takes more than 1/capacity of the
+ * operations is sure to be among them, and its count is high by at
+ * most its error.
+ *
+ * Only a sample of the operations is recorded; see sample().
+ */
+class HotKeys {
+public:
+
+    /**
+     * A key being counted.
+     */
+    class Entry {
+    public:
+        Entry(const std::string &k, uint64_t c, uint64_t e)
+            : key(k), count(c), error(e) {}
+
+        bool operator <(const Entry &other) const {
+            return count > other.count;
+        }
+
+        std::string key;
+        //! Estimated number of operations on the key.
+        uint64_t    count;
+        //! How much of count may belong to keys counted in its place.
+        uint64_t    error;
+    };
+
+    /**
+     * Construct a HotKeys counting at most the given number of keys.
+     */
+    explicit HotKeys(size_t cap) : capacity(cap) {}
+
+    /**
+     * Count operations on a key.
+     *
+     * @param key the key
+     * @param weight the number of operations
+     */
+    void record(const std::string &key, uint64_t weight);
+
+    /**
+     * Get the most used keys, most used first.
+     *
+     * @param n the most keys to return
+     */
+    std::vector<Entry> top(size_t n);
+
+    /**
+     * Forget everything counted so far.
+     */
+    void reset();
+
+    /**
+     * Decide whether to record the current operation.
+     *
+     * One operation in getSampleRate() is picked, counted per thread
+     * so the hot paths don't share anything to decide.
+     *
+     * @return 0 to skip this operation, otherwise the number of
+     *         operations it stands for
+     */
+    static size_t sample();
+
+    /**
+     * Record one operation in this many (0 turns tracking off).
+     */
+    static void setSampleRate(size_t to);
+
+    static size_t getSampleRate();
+
+private:
+    SpinLock           lock;
+    size_t             capacity;
+    std::vector<Entry> entries;
+
+    static Atomic<size_t> sampleRate;
+
+    DISALLOW_COPY_AND_ASSIGN(HotKeys);
+};
+
+#endif /* HOT_KEYS_H */
@@ -0,0 +1,21 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+#include "config.h"
+
+#include "common.hh"
+#include "htresizer.hh"
+#include "ep.hh"
+
+// Number of lock stripes migrated per hash table on each run.
+static const size_t stripesPerRun = 16;
+
+bool HashtableResizer::callback(Dispatcher &d, TaskId t) {
+    bool resizing = store->resizeHashTables(stripesPerRun);
+    // Frees whatever was retired by threads that have since gone
+    // quiet, even if nobody else retires anything.
+    Epoch::advance();
+
+    // Keep coming back quickly while buckets are in flight.
+    d.snooze(t, resizing ? 0.1 : 10);
+    return true;
+}
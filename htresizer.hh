@@ -0,0 +1,31 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#ifndef HTRESIZER_HH
+#define HTRESIZER_HH 1
+
+#include "common.hh"
+#include "dispatcher.hh"
+
+// Forward declaration.
+class EventuallyPersistentStore;
+
+/**
+ * Dispatcher job that grows or shrinks vbucket hash tables as their
+ * item counts change.
+ */
+class HashtableResizer : public DispatcherCallback {
+public:
+
+    /**
+     * Construct a HashtableResizer.
+     *
+     * @param s the store (where we'll visit)
+     */
+    HashtableResizer(EventuallyPersistentStore *s) : store(s) {}
+
+    bool callback(Dispatcher &d, TaskId t);
+
+private:
+    EventuallyPersistentStore *store;
+};
+
+#endif /* HTRESIZER_HH */
@@ -12,8 +12,13 @@
 #include "locks.hh"
 #include "atomic.hh"
 
+class BlobPtr;
+
 /**
  * A blob is a minimal sized storage for data up to 2^32 bytes long.
+ *
+ * Blobs are reference counted through BlobPtr, with the count kept
+ * in the blob itself.
  */
 class Blob {
 public:
@@ -91,21 +96,113 @@ public:
 
 private:
 
-    explicit Blob(const char *start, const size_t len) : size(static_cast<uint32_t>(len)) {
+    explicit Blob(const char *start, const size_t len) :
+        size(static_cast<uint32_t>(len)), refcount(0) {
         std::memcpy(data, start, len);
     }
 
-    explicit Blob(const char c, const size_t len) : size(static_cast<uint32_t>(len)) {
+    explicit Blob(const char c, const size_t len) :
+        size(static_cast<uint32_t>(len)), refcount(0) {
         std::memset(data, c, len);
     }
 
+    friend class BlobPtr;
+
+    void incref() const {
+        __sync_add_and_fetch(&refcount, 1);
+    }
+
+    // True when that was the last reference.
+    bool decref() const {
+        return __sync_sub_and_fetch(&refcount, 1) == 0;
+    }
+
     const uint32_t size;
+    mutable uint32_t refcount;
     char data[1];
 
     DISALLOW_COPY_AND_ASSIGN(Blob);
 };
 
-typedef shared_ptr<const Blob> value_t;
+/**
+ * A counted reference to a Blob.
+ *
+ * Works like a shared_ptr<const Blob>, but the count lives in the
+ * Blob so a value is a single allocation and a reference a single
+ * pointer.  swap() hands a reference over without touching the count.
+ */
+class BlobPtr {
+public:
+
+    explicit BlobPtr(const Blob *b = NULL) : blob(b) {
+        if (blob) {
+            blob->incref();
+        }
+    }
+
+    BlobPtr(const BlobPtr &other) : blob(other.blob) {
+        if (blob) {
+            blob->incref();
+        }
+    }
+
+    ~BlobPtr() {
+        if (blob && blob->decref()) {
+            delete blob;
+        }
+    }
+
+    BlobPtr &operator =(const BlobPtr &other) {
+        BlobPtr tmp(other);
+        swap(tmp);
+        return *this;
+    }
+
+    /**
+     * Drop this reference and take one to the given blob instead.
+     */
+    void reset(const Blob *b = NULL) {
+        BlobPtr tmp(b);
+        swap(tmp);
+    }
+
+    /**
+     * Exchange references with another BlobPtr.
+     */
+    void swap(BlobPtr &other) {
+        const Blob *tmp = blob;
+        blob = other.blob;
+        other.blob = tmp;
+    }
+
+    const Blob *get() const {
+        return blob;
+    }
+
+    const Blob &operator *() const {
+        return *blob;
+    }
+
+    const Blob *operator ->() const {
+        return blob;
+    }
+
+    bool operator !() const {
+        return blob == NULL;
+    }
+
+    typedef const Blob *BlobPtr::*unspecified_bool_type;
+
+    //! True if this refers to a blob, without converting to an int.
+    operator unspecified_bool_type() const {
+        return blob ? &BlobPtr::blob : NULL;
+    }
+
+private:
+    const Blob *blob;
+};
+
+typedef BlobPtr value_t;
 
 /**
  * The Item structure we use to pass information between the memcached
@@ -135,13 +232,22 @@ public:
     }
 
     Item(const std::string &k, const int fl, const rel_time_t exp,
-         value_t val, uint64_t theCas = 0,  int64_t i = -1, uint16_t vbid = 0) :
+         const value_t &val, uint64_t theCas = 0,  int64_t i = -1, uint16_t vbid = 0) :
         flags(fl), exptime(exp), value(val), cas(theCas), id(i), vbucketId(vbid)
     {
         assert(id != 0);
         key.assign(k);
     }
 
+    Item(const void *k, uint16_t nk, const int fl, const rel_time_t exp,
+         const value_t &val, uint64_t theCas = 0, int64_t i = -1,
+         uint16_t vbid = 0) :
+        flags(fl), exptime(exp), value(val), cas(theCas), id(i), vbucketId(vbid)
+    {
+        assert(id != 0);
+        key.assign(static_cast<const char*>(k), nk);
+    }
+
     Item(const void *k, uint16_t nk, const int fl, const rel_time_t exp,
          const void *dta, const size_t nb, uint64_t theCas = 0,
          int64_t i = -1, uint16_t vbid = 0) :
@@ -170,6 +276,11 @@ public:
         return id;
     }
 
+    void setId(int64_t to) {
+        assert(to != 0);
+        id = to;
+    }
+
     int getNKey() const {
         return static_cast<int>(key.length());
     }
@@ -1,37 +1,84 @@
 /* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
 
 #include "config.h"
+#include <algorithm>
 #include <iostream>
-#include <cstdlib>
 
 #include "common.hh"
 #include "item_pager.hh"
 #include "ep.hh"
+#include "ep_engine.h"
 
 static const double threshold = 75.0;
 
+// Hash buckets to page through per dispatcher run.
+static const size_t bucketsPerRun = 1024;
+
+// A vbucket over its soft quota is paged down to this share of it,
+// as the watermarks do for the whole store.
+static const double quotaLowWater = 0.8;
+
 /**
  * As part of the ItemPager, visit all of the objects in memory and
- * eject some within a constrained probability
+ * eject the values of the ones that haven't been read lately.
+ *
+ * This is a clock: each item's NRU value counts the paging rounds
+ * since it was last read.  Items that have gone MAX_NRU_VALUE rounds
+ * unread are ejected, as long as that doesn't overshoot the share of
+ * memory we were asked for; everything else gets a round older.
+ * Vbuckets over their soft quota are asked for more.
  */
 class PagingVisitor : public VBucketVisitor {
 public:
 
     /**
      * Construct a PagingVisitor that will attempt to evict the given
-     * percentage of objects.
+     * percentage of memory.
      *
-     * @param pcnt percentage of objects to attempt to evict (0-1)
+     * @param s the store (to find the vbuckets' quotas)
+     * @param st the stats
+     * @param pcnt percentage of item memory to attempt to free (0-1)
      */
-    PagingVisitor(EPStats &st, double pcnt) : stats(st), percent(pcnt),
-                                              ejected(0), failedEjects(0) {}
+    PagingVisitor(EventuallyPersistentStore *s, EPStats &st, double pcnt) :
+        store(s), stats(st), percent(pcnt), bucketPercent(pcnt),
+        ejected(0), failedEjects(0), aged(0), wantedBytes(0),
+        freedBytes(0) {}
+
+    bool visitBucket(uint16_t vbid, vbucket_state_t state) {
+        VBucketVisitor::visitBucket(vbid, state);
+        bucketPercent = percent;
+        RCPtr<VBucket> vb = store->getVBucket(vbid);
+        if (vb && vb->overSoftQuota()) {
+            double used = static_cast<double>(vb->getMemSize());
+            double quota = static_cast<double>(stats.vbMemSoftQuota.get());
+            bucketPercent = std::max(percent,
+                                     (used - quota * quotaLowWater) / used);
+        }
+        return bucketPercent > 0;
+    }
 
     void visit(StoredValue *v) {
+        // An inline value takes no memory of its own to give back,
+        // and a non-resident one has already given it.
+        if (v->isInline() || !v->isResident()) {
+            return;
+        }
 
-        double r = static_cast<double>(std::rand()) / static_cast<double>(RAND_MAX);
-        if (percent >= r) {
-            if (v->ejectValue(stats)) {
+        size_t size = v->size();
+        wantedBytes += bucketPercent * static_cast<double>(size);
+        if (v->getNRUValue() < StoredValue::MAX_NRU_VALUE) {
+            v->incrNRUValue();
+            ++aged;
+            return;
+        }
+
+        // Keep pace with what's been seen so far, so a run of cold
+        // items at the start of the walk doesn't take it all.
+        if (static_cast<double>(freedBytes) < wantedBytes) {
+            RCPtr<VBucket> vb = store->getVBucket(currentBucket);
+            if (vb && vb->ht.unlocked_ejectValue(v)) {
                 ++ejected;
+                freedBytes += size - v->size();
             } else {
                 ++failedEjects;
             }
@@ -52,38 +99,173 @@ public:
      */
     size_t numFailedEjects() { return failedEjects; }
 
+    /**
+     * True if there weren't enough cold items to free what was asked
+     * for, but some items got older and may be cold next round.
+     */
+    bool shortOfColdItems() {
+        return aged > 0 && static_cast<double>(freedBytes) < wantedBytes;
+    }
+
+    VBucketVisitor *forWorker() {
+        return new PagingVisitor(store, stats, percent);
+    }
+
+    void merge(VBucketVisitor &worker) {
+        PagingVisitor &pv = static_cast<PagingVisitor&>(worker);
+        ejected += pv.ejected;
+        failedEjects += pv.failedEjects;
+        aged += pv.aged;
+        wantedBytes += pv.wantedBytes;
+        freedBytes += pv.freedBytes;
+    }
+
+    //! Where the walk is at between dispatcher runs.
+    EventuallyPersistentStore::Position position;
+
 private:
-    EPStats &stats;
-    double   percent;
-    size_t   ejected;
-    size_t   failedEjects;
+    EventuallyPersistentStore *store;
+    EPStats                   &stats;
+    double                     percent;
+    // What's asked of the vbucket being visited.
+    double                     bucketPercent;
+    size_t                     ejected;
+    size_t                     failedEjects;
+    size_t                     aged;
+    double                     wantedBytes;
+    size_t                     freedBytes;
 };
 
 bool ItemPager::callback(Dispatcher &d, TaskId t) {
-    double current = static_cast<double>(StoredValue::getCurrentSize(stats));
-    double upper = static_cast<double>(stats.mem_high_wat);
-    double lower = static_cast<double>(stats.mem_low_wat);
-    if (current > upper) {
+    if (!pager) {
+        double current = static_cast<double>(StoredValue::getCurrentSize(stats));
+        double upper = static_cast<double>(stats.mem_high_wat);
+        double lower = static_cast<double>(stats.mem_low_wat);
+        double toKill = 0;
+        if (current > upper) {
+            toKill = (current - static_cast<double>(lower)) / current;
+            getLogger()->log(EXTENSION_LOG_INFO, NULL,
+                             "Using %zd bytes of memory, paging out %0f%% of items.\n",
+                             StoredValue::getCurrentSize(stats), (toKill*100.0));
+        } else if (store->anyOverSoftQuota()) {
+            getLogger()->log(EXTENSION_LOG_INFO, NULL,
+                             "Paging out vbuckets over their soft quota.\n");
+        } else {
+            d.snooze(t, 10);
+            return true;
+        }
 
         ++stats.pagerRuns;
 
-        double toKill = (current - static_cast<double>(lower)) / current;
+        pager.reset(new PagingVisitor(store, stats, toKill));
+
+        if (store->getVisitorThreads() > 1) {
+            // With that many hands it's quick enough to do in one go.
+            store->parallelVisit(*pager);
+            d.snooze(t, completePaging());
+            return true;
+        }
+    }
+
+    // Walk a piece at a time so nobody waits long on a stripe lock
+    // and other tasks get their turn in between.
+    pager->position = store->pauseResumeVisit(*pager, pager->position,
+                                              bucketsPerRun);
+    if (!pager->position.isDone()) {
+        d.snooze(t, 0);
+        return true;
+    }
 
-        getLogger()->log(EXTENSION_LOG_INFO, NULL,
-                         "Using %zd bytes of memory, paging out %0f%% of items.\n",
-                         StoredValue::getCurrentSize(stats), (toKill*100.0));
+    d.snooze(t, completePaging());
+    return true;
+}
 
-        PagingVisitor pv(stats, toKill);
-        store->visit(pv);
+double ItemPager::completePaging() {
+    stats.numValueEjects.incr(pager->numEjected());
+    stats.numNonResident.incr(pager->numEjected());
+    stats.numFailedEjects.incr(pager->numFailedEjects());
 
-        stats.numValueEjects.incr(pv.numEjected());
-        stats.numNonResident.incr(pv.numEjected());
-        stats.numFailedEjects.incr(pv.numFailedEjects());
+    getLogger()->log(EXTENSION_LOG_INFO, NULL,
+                     "Paged out %d values\n", pager->numEjected());
 
-        getLogger()->log(EXTENSION_LOG_INFO, NULL,
-                         "Paged out %d values\n", pv.numEjected());
+    // Go around again right away if this round only aged items that
+    // will be cold next time and memory is still too high.
+    bool again = pager->shortOfColdItems()
+        && (StoredValue::getCurrentSize(stats) > stats.mem_high_wat.get()
+            || store->anyOverSoftQuota());
+    pager.reset();
+    return again ? 0 : 10;
+}
+
+/**
+ * As part of the ExpiryPager, find the expired items in the active
+ * vbuckets.
+ *
+ * Nothing is deleted while the hash table is being walked; the keys
+ * are collected and deleted after each piece of the walk.
+ */
+class ExpiredItemsVisitor : public VBucketVisitor {
+public:
+
+    /**
+     * Construct an ExpiredItemsVisitor.
+     *
+     * @param now the time to check expiry against
+     */
+    ExpiredItemsVisitor(rel_time_t now) : startTime(now), expired(0) {}
+
+    bool visitBucket(uint16_t vbid, vbucket_state_t state) {
+        VBucketVisitor::visitBucket(vbid, state);
+        // Replicas hear about it from their master.
+        return state == active;
+    }
+
+    void visit(StoredValue *v) {
+        if (v->isExpired(startTime)) {
+            found.push_back(std::make_pair(currentBucket, v->getKey()));
+        }
+    }
+
+    //! The time items are checked against.
+    rel_time_t startTime;
+    //! Keys found expired since they were last dealt with.
+    std::list<std::pair<uint16_t, std::string> > found;
+    //! Number of items deleted so far.
+    size_t expired;
+    //! Where the walk is at between dispatcher runs.
+    EventuallyPersistentStore::Position position;
+};
+
+bool ExpiryPager::callback(Dispatcher &d, TaskId t) {
+    if (!pager) {
+        pager.reset(new ExpiredItemsVisitor(ep_current_time()));
     }
 
-    d.snooze(t, 10);
+    pager->position = store->pauseResumeVisit(*pager, pager->position,
+                                              bucketsPerRun);
+    if (!pager->found.empty()) {
+        store->deleteExpiredItems(pager->found, pager->startTime);
+        std::list<std::pair<uint16_t, std::string> >::iterator it;
+        for (it = pager->found.begin(); it != pager->found.end(); ++it) {
+            engine->addDeleteEvent(it->second, it->first);
+        }
+        pager->expired += pager->found.size();
+        stats.expired.incr(pager->found.size());
+        pager->found.clear();
+    }
+
+    if (!pager->position.isDone()) {
+        d.snooze(t, 0);
+        return true;
+    }
+
+    ++stats.expiryPagerRuns;
+    stats.expiredLastRun.set(pager->expired);
+    getLogger()->log(EXTENSION_LOG_INFO, NULL,
+                     "Expiry pager deleted %d expired items\n",
+                     pager->expired);
+    pager.reset();
+
+    d.snooze(t, sleepTime);
     return true;
 }
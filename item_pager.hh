@@ -6,12 +6,20 @@
 #include "dispatcher.hh"
 #include "stats.hh"
 
-// Forward declaration.
+// Forward declarations.
+class EventuallyPersistentEngine;
 class EventuallyPersistentStore;
+class PagingVisitor;
+class ExpiredItemsVisitor;
 
 /**
  * Dispatcher job responsible for periodically pushing data out of
  * memory.
+ *
+ * A paging walk over the vbuckets is done a bounded number of hash
+ * buckets per run, or all at once if there are several visitor
+ * threads to share it.  Values that haven't been read for a few
+ * walks are the ones that go.
  */
 class ItemPager : public DispatcherCallback {
 public:
@@ -28,8 +36,47 @@ public:
     bool callback(Dispatcher &d, TaskId t);
 
 private:
+    // Returns how long to wait before the next walk.
+    double completePaging();
+
     EventuallyPersistentStore *store;
     EPStats                   &stats;
+    // The walk in progress, if any.
+    shared_ptr<PagingVisitor>  pager;
+};
+
+/**
+ * Dispatcher job that deletes expired items.
+ *
+ * Expired items are otherwise only deleted when they're looked up.
+ * Every so often this walks the active vbuckets, a bounded number of
+ * hash buckets per run, and deletes what has expired, both from disk
+ * and for tap clients.
+ */
+class ExpiryPager : public DispatcherCallback {
+public:
+
+    /**
+     * Construct an ExpiryPager.
+     *
+     * @param e the engine (to tell tap clients)
+     * @param s the store (where we'll visit)
+     * @param st the stats
+     * @param stime seconds to wait between walks
+     */
+    ExpiryPager(EventuallyPersistentEngine *e, EventuallyPersistentStore *s,
+                EPStats &st, size_t stime) :
+        engine(e), store(s), stats(st), sleepTime(static_cast<double>(stime)) {}
+
+    bool callback(Dispatcher &d, TaskId t);
+
+private:
+    EventuallyPersistentEngine      *engine;
+    EventuallyPersistentStore       *store;
+    EPStats                         &stats;
+    double                           sleepTime;
+    // The walk in progress, if any.
+    shared_ptr<ExpiredItemsVisitor>  pager;
 };
 
 #endif /* ITEM_PAGER_HH */
@@ -15,13 +15,17 @@
  *
  * It is a very bad idea to unlock a lock held by a LockHolder without
  * using the LockHolder::unlock method.
+ *
+ * Locks with LockStats have their contention and (sampled) hold
+ * times counted (see Mutex::getLockStats()).
  */
 class LockHolder {
 public:
     /**
      * Acquire the lock in the given mutex.
      */
-    LockHolder(Mutex &m) : mutex(m), locked(false) {
+    LockHolder(Mutex &m) : mutex(m), locked(false), heldSince(0),
+                           condWaited(0) {
         lock();
     }
 
@@ -36,7 +40,7 @@ public:
      * Relock a lock that was manually unlocked.
      */
     void lock() {
-        mutex.acquire();
+        heldSince = mutex.profiledAcquire(condWaited);
         locked = true;
     }
 
@@ -46,13 +50,16 @@ public:
     void unlock() {
         if (locked) {
             locked = false;
-            mutex.release();
+            mutex.profiledRelease(heldSince, condWaited);
         }
     }
 
 private:
     Mutex &mutex;
     bool locked;
+    // When a timed hold started (0 if it isn't timed).
+    hrtime_t heldSince;
+    hrtime_t condWaited;
 
     DISALLOW_COPY_AND_ASSIGN(LockHolder);
 };
@@ -66,12 +73,17 @@ public:
     /**
      * Acquire a series of locks.
      *
-     * @param m beginning of an array of locks
+     * @param m beginning of an array of locks (of any Mutex type)
      * @param n the number of locks to lock
      */
-    MultiLockHolder(Mutex *m, size_t n) : mutexes(m),
-                                          locked(NULL),
-                                          n_locks(n) {
+    template <typename M>
+    MultiLockHolder(M *m, size_t n) : mutexes(NULL),
+                                      locked(NULL),
+                                      n_locks(n) {
+        mutexes = new Mutex*[n];
+        for (size_t i = 0; i < n; i++) {
+            mutexes[i] = &m[i];
+        }
         locked = new bool[n];
         lock();
     }
@@ -79,6 +91,7 @@ public:
     ~MultiLockHolder() {
         unlock();
         delete[] locked;
+        delete[] mutexes;
     }
 
     /**
@@ -86,7 +99,9 @@ public:
      */
     void lock() {
         for (size_t i = 0; i < n_locks; i++) {
-            mutexes[i].acquire();
+            // Holds of the whole series aren't timed.
+            hrtime_t condWaited(0);
+            mutexes[i]->profiledAcquire(condWaited);
             locked[i] = true;
         }
     }
@@ -98,13 +113,13 @@ public:
         for (size_t i = 0; i < n_locks; i++) {
             if (locked[i]) {
                 locked[i] = false;
-                mutexes[i].release();
+                mutexes[i]->release();
             }
         }
     }
 
 private:
-    Mutex  *mutexes;
+    Mutex **mutexes;
     bool   *locked;
     size_t  n_locks;
 
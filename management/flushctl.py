@@ -30,11 +30,17 @@ def stop(mc):
 if __name__ == '__main__':
 
     c = clitool.CliTool("""Available params:
-    min_data_age   - minimum data age before flushing data"
-    queue_age_cap  - maximum queue age before flushing data"
-    max_txn_size   - maximum number of items in a flusher transaction
-    bg_fetch_delay - delay before executing a bg fetch (test feature)
-    max_size       - max memory used by the server""")
+    min_data_age      - minimum data age before flushing data"
+    queue_age_cap     - maximum queue age before flushing data"
+    max_txn_size      - maximum number of items in a flusher transaction
+    commit_budget     - msec a commit may take; adapts txn size (0: off)
+    bg_fetch_delay    - delay before executing a bg fetch (test feature)
+    visitor_threads   - threads used to walk all items (paging, backfill)
+    hot_key_sample    - track hot keys from one op in this many (0: off)
+    lock_profiling    - count lock contention (1: on, 0: off)
+    max_size          - max memory used by the server
+    vb_mem_soft_quota - page out a vbucket's items beyond this (0: none)
+    vb_mem_hard_quota - refuse sets to a vbucket beyond this (0: none)""")
 
     c.addCommand('stop', stop)
     c.addCommand('start', 'start_persistence')
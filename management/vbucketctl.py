@@ -7,7 +7,9 @@ def listvb(mc, auth="none", username="", password=""):
         mc.sasl_auth_plain(username, password)
     vbs = mc.stats('vbucket')
     for (vb, state) in sorted(list(vbs.items())):
-        print "vbucket", vb[3:], state
+        # Skip the per-vbucket numbers (vb_N:stat).
+        if ':' not in vb:
+            print "vbucket", vb[3:], state
 
 def setvb(mc, vbid, vbstate, auth="none", username="", password=""):
     if auth == "sasl":
@@ -9,9 +9,214 @@
 #include <cerrno>
 #include <cstring>
 #include <cassert>
+#include <vector>
 
 #include "common.hh"
 
+/**
+ * Contention numbers for a lock, or a class of locks (such as all of
+ * the hash table stripes) that share one.
+ *
+ * Acquisitions try the lock first; only when that fails is the wait
+ * timed, so an uncontended acquisition costs one counter update on a
+ * cache line mostly used by the acquiring thread.  Hold times are
+ * only measured for one acquisition in HOLD_SAMPLE.
+ *
+ * LockStats register themselves so all of them can be listed (see
+ * getAll()); they're meant to be static.
+ */
+class LockStats {
+public:
+
+    //! Number of wait and hold time histogram buckets.
+    static const int HISTO_BUCKETS = 20;
+    //! One hold in this many (per thread, roughly) is timed.
+    static const uint64_t HOLD_SAMPLE = 64;
+
+    explicit LockStats(const char *n) : name(n) {
+        reset();
+        pthread_mutex_lock(&registryLock());
+        registry().push_back(this);
+        pthread_mutex_unlock(&registryLock());
+    }
+
+    ~LockStats() {
+        pthread_mutex_lock(&registryLock());
+        std::vector<LockStats*> &r = registry();
+        for (size_t i = 0; i < r.size(); ++i) {
+            if (r[i] == this) {
+                r.erase(r.begin() + i);
+                break;
+            }
+        }
+        pthread_mutex_unlock(&registryLock());
+    }
+
+    const char *getName() const { return name; }
+
+    /**
+     * Count an acquisition.
+     *
+     * @return true if its hold is to be timed
+     */
+    bool acquired() {
+        return __sync_add_and_fetch(&shards[shard()].acquisitions, 1)
+            % HOLD_SAMPLE == 0;
+    }
+
+    /**
+     * Count an acquisition that had to wait, and how long for.
+     */
+    void contended(hrtime_t waited) {
+        __sync_add_and_fetch(&shards[shard()].contended, 1);
+        __sync_add_and_fetch(&waitTime, waited);
+        __sync_add_and_fetch(&waitHisto[histoBucket(waited)], 1);
+    }
+
+    /**
+     * Record how long a sampled hold took.
+     */
+    void held(hrtime_t duration) {
+        __sync_add_and_fetch(&holdSamples, 1);
+        __sync_add_and_fetch(&holdTime, duration);
+        __sync_add_and_fetch(&holdHisto[histoBucket(duration)], 1);
+    }
+
+    uint64_t getAcquisitions() const {
+        uint64_t rv = 0;
+        for (size_t i = 0; i < SHARDS; ++i) {
+            rv += shards[i].acquisitions;
+        }
+        return rv;
+    }
+
+    uint64_t getContended() const {
+        uint64_t rv = 0;
+        for (size_t i = 0; i < SHARDS; ++i) {
+            rv += shards[i].contended;
+        }
+        return rv;
+    }
+
+    //! Total time spent waiting (ns).
+    uint64_t getWaitTime() const { return waitTime; }
+    uint64_t getHoldSamples() const { return holdSamples; }
+    //! Total time the sampled holds took (ns).
+    uint64_t getHoldTime() const { return holdTime; }
+    uint64_t getWaitHisto(int bucket) const { return waitHisto[bucket]; }
+    uint64_t getHoldHisto(int bucket) const { return holdHisto[bucket]; }
+
+    /**
+     * Get where a histogram bucket starts (usec).
+     *
+     * Bucket 0 is under a microsecond, and each bucket after it is
+     * twice as wide as the one before.  The last one has no end.
+     */
+    static uint64_t bucketStart(int bucket) {
+        return bucket == 0 ? 0 : static_cast<uint64_t>(1) << (bucket - 1);
+    }
+
+    /**
+     * Forget everything counted so far.
+     *
+     * Updates made at the same time may be lost.
+     */
+    void reset() {
+        for (size_t i = 0; i < SHARDS; ++i) {
+            shards[i].acquisitions = 0;
+            shards[i].contended = 0;
+        }
+        waitTime = holdTime = holdSamples = 0;
+        for (int i = 0; i < HISTO_BUCKETS; ++i) {
+            waitHisto[i] = holdHisto[i] = 0;
+        }
+    }
+
+    /**
+     * Get all of the LockStats there are.
+     */
+    static std::vector<LockStats*> getAll() {
+        pthread_mutex_lock(&registryLock());
+        std::vector<LockStats*> rv(registry());
+        pthread_mutex_unlock(&registryLock());
+        return rv;
+    }
+
+    /**
+     * Reset all of the LockStats there are.
+     */
+    static void resetAll() {
+        pthread_mutex_lock(&registryLock());
+        std::vector<LockStats*> &r = registry();
+        for (size_t i = 0; i < r.size(); ++i) {
+            r[i]->reset();
+        }
+        pthread_mutex_unlock(&registryLock());
+    }
+
+    /**
+     * Turn lock profiling on or off everywhere.
+     */
+    static void setEnabled(bool to) {
+        enabledFlag() = to;
+    }
+
+    static bool isEnabled() {
+        return enabledFlag();
+    }
+
+private:
+
+    static const size_t SHARDS = 16;
+
+    // Per thread (mostly) counts, each on a cache line of its own.
+    struct __attribute__((aligned(CACHE_LINE_SIZE))) Shard {
+        volatile uint64_t acquisitions;
+        volatile uint64_t contended;
+    };
+
+    static size_t shard() {
+        // Thread IDs are addresses a few pages apart, or counters.
+        size_t t = (size_t)pthread_self();
+        return ((t >> 12) ^ t) % SHARDS;
+    }
+
+    static int histoBucket(hrtime_t ns) {
+        uint64_t usec = ns / 1000;
+        int rv = 0;
+        while (usec > 0 && rv < HISTO_BUCKETS - 1) {
+            usec >>= 1;
+            ++rv;
+        }
+        return rv;
+    }
+
+    static std::vector<LockStats*> &registry() {
+        static std::vector<LockStats*> all;
+        return all;
+    }
+
+    static pthread_mutex_t &registryLock() {
+        static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+        return lock;
+    }
+
+    static volatile bool &enabledFlag() {
+        static volatile bool enabled = true;
+        return enabled;
+    }
+
+    const char        *name;
+    Shard              shards[SHARDS];
+    volatile uint64_t  waitTime;
+    volatile uint64_t  holdTime;
+    volatile uint64_t  holdSamples;
+    volatile uint64_t  waitHisto[HISTO_BUCKETS];
+    volatile uint64_t  holdHisto[HISTO_BUCKETS];
+
+    DISALLOW_COPY_AND_ASSIGN(LockStats);
+};
+
 /**
  * Abstraction built on top of pthread mutexes
  */
@@ -39,13 +244,18 @@ public:
         }
     }
 
+    /**
+     * Get the LockStats this lock is profiled in, if any.
+     */
+    virtual LockStats *getLockStats() { return NULL; }
+
 protected:
 
     // The holders of locks twiddle these flags.
     friend class LockHolder;
     friend class MultiLockHolder;
 
-    void acquire() {
+    virtual void acquire() {
         int e;
         if ((e = pthread_mutex_lock(&mutex)) != 0) {
             std::string message = "MUTEX ERROR: Failed to acquire lock: ";
@@ -55,7 +265,7 @@ protected:
         setHolder();
     }
 
-    void release() {
+    virtual void release() {
 #ifndef WIN32
         assert(holder == pthread_self());
         holder = 0;
@@ -68,6 +278,72 @@ protected:
         }
     }
 
+    /**
+     * Acquire the lock if nobody holds it.
+     *
+     * @return true if it was acquired
+     */
+    virtual bool tryAcquire() {
+        int e = pthread_mutex_trylock(&mutex);
+        if (e == EBUSY) {
+            return false;
+        } else if (e != 0) {
+            std::string message = "MUTEX ERROR: Failed to try lock: ";
+            message.append(std::strerror(e));
+            throw std::runtime_error(message);
+        }
+        setHolder();
+        return true;
+    }
+
+    /**
+     * Get the total time spent waiting on a condition while holding
+     * this lock (which doesn't count as holding it), if it's known.
+     */
+    virtual hrtime_t getCondWaitTime() { return 0; }
+
+    /**
+     * Acquire the lock, counting it in the lock's LockStats.
+     *
+     * @param condWaited set to getCondWaitTime() if the hold is timed
+     * @return when the hold started if it's timed, otherwise 0
+     */
+    hrtime_t profiledAcquire(hrtime_t &condWaited) {
+        LockStats *ls = LockStats::isEnabled() ? getLockStats() : NULL;
+        if (ls == NULL) {
+            acquire();
+            return 0;
+        }
+
+        hrtime_t now = 0;
+        if (!tryAcquire()) {
+            hrtime_t start = gethrtime();
+            acquire();
+            now = gethrtime();
+            ls->contended(now - start);
+        }
+        if (!ls->acquired()) {
+            return 0;
+        }
+        condWaited = getCondWaitTime();
+        return now != 0 ? now : gethrtime();
+    }
+
+    /**
+     * Release a lock taken with profiledAcquire().
+     */
+    void profiledRelease(hrtime_t heldSince, hrtime_t condWaited) {
+        if (heldSince != 0) {
+            LockStats *ls = getLockStats();
+            hrtime_t held = gethrtime() - heldSince;
+            hrtime_t waited = getCondWaitTime() - condWaited;
+            if (ls != NULL && held >= waited) {
+                ls->held(held - waited);
+            }
+        }
+        release();
+    }
+
     void setHolder() {
 #ifndef WIN32
         holder = pthread_self();
@@ -82,4 +358,79 @@ protected:
     DISALLOW_COPY_AND_ASSIGN(Mutex);
 };
 
+/**
+ * A Mutex profiled in the given LockStats.
+ */
+class ProfiledMutex : public Mutex {
+public:
+    explicit ProfiledMutex(LockStats &ls) : Mutex(), lockStats(ls) {}
+
+    LockStats *getLockStats() { return &lockStats; }
+
+private:
+    LockStats &lockStats;
+
+    DISALLOW_COPY_AND_ASSIGN(ProfiledMutex);
+};
+
+/**
+ * A Mutex that counts every acquisition and release.
+ *
+ * The sequence is odd while the lock is held.  A reader that doesn't
+ * take the lock reads the sequence before and after it looks at the
+ * data the lock protects; if it was even and didn't change, nobody
+ * held the lock in between (a seqlock).
+ */
+class SeqMutex : public Mutex {
+public:
+    SeqMutex() : Mutex(), seq(0) {}
+
+    /**
+     * Get the current sequence number.
+     */
+    size_t sequence() const {
+        return seq;
+    }
+
+protected:
+
+    void acquire() {
+        Mutex::acquire();
+        __sync_add_and_fetch(&seq, 1);
+    }
+
+    bool tryAcquire() {
+        if (!Mutex::tryAcquire()) {
+            return false;
+        }
+        __sync_add_and_fetch(&seq, 1);
+        return true;
+    }
+
+    void release() {
+        __sync_add_and_fetch(&seq, 1);
+        Mutex::release();
+    }
+
+private:
+    volatile size_t seq;
+
+    DISALLOW_COPY_AND_ASSIGN(SeqMutex);
+};
+
+/**
+ * A SeqMutex with a cache line to itself.
+ *
+ * Arrays of these (hash table lock stripes) don't have threads
+ * working on neighbouring locks taking the line away from each other.
+ * They have to be allocated aligned to make that so.
+ */
+class __attribute__((aligned(CACHE_LINE_SIZE))) PaddedSeqMutex : public SeqMutex {
+public:
+    PaddedSeqMutex() : SeqMutex() {}
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(PaddedSeqMutex);
+};
+
 #endif
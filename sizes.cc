@@ -38,11 +38,13 @@ int main(int argc, char **argv) {
     display("... Bodies Union", sizeof(union stored_value_bodies));
 
     display("Stored Value Factory", sizeof(StoredValueFactory));
+    display("Slab Arena", sizeof(SlabArena));
     display("Blob", sizeof(Blob));
     display("value_t", sizeof(value_t));
     display("HashTable", sizeof(HashTable));
     display("Item", sizeof(Item));
     display("QueuedItem", sizeof(QueuedItem));
+    display("DirtyItem", sizeof(DirtyItem));
     display("VBucket", sizeof(VBucket));
     display("VBucketHolder", sizeof(VBucketHolder));
     display("VBucketMap", sizeof(VBucketMap));
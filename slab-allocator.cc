@@ -0,0 +1,259 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#include "config.h"
+#include <cassert>
+#include <cstdlib>
+#include <new>
+
+#include "slab-allocator.hh"
+
+/**
+ * The header at the start of each slab.
+ */
+class Slab {
+public:
+    SlabArena *arena;
+    Slab      *prev;
+    Slab      *next;
+    // Chunks that were released, linked through their first word.
+    void      *freeList;
+    // Chunks from here on were never handed out.
+    char      *unused;
+    char      *end;
+    uint32_t   cls;
+    // The stripe of the arena the slab belongs to.
+    uint32_t   stripe;
+    size_t     used;
+};
+
+// Chunks start at the first granule after the header.
+static const size_t slabHeaderSize = SlabArena::chunkSize(sizeof(Slab));
+
+static inline size_t sizeClass(size_t n) {
+    assert(n > 0 && n <= SlabArena::MAX_CHUNK);
+    return (n - 1) / SlabArena::GRANULARITY;
+}
+
+static inline size_t classSize(size_t cls) {
+    return (cls + 1) * SlabArena::GRANULARITY;
+}
+
+static inline Slab *slabOf(void *p) {
+    return reinterpret_cast<Slab*>(reinterpret_cast<uintptr_t>(p)
+                                   & ~(SlabArena::SLAB_SIZE - 1));
+}
+
+SlabArena::SlabArena(EPStats &st) : stats(st), dead(false), pending(0) {
+    for (size_t i = 0; i < NUM_STRIPES; ++i) {
+        Stripe &stripe = stripes[i];
+        for (size_t j = 0; j < NUM_CLASSES; ++j) {
+            stripe.partial[j] = NULL;
+            stripe.full[j] = NULL;
+        }
+        stripe.numSlabs = stripe.slabBytes = stripe.usedBytes = 0;
+        stripe.requestedBytes = stripe.liveChunks = 0;
+    }
+}
+
+void *SlabArena::allocate(size_t n) {
+    size_t cls = sizeClass(n);
+    Stripe &st = stripes[getThreadSlot() % NUM_STRIPES];
+    SpinLockHolder lh(&st.lock);
+    assert(!dead);
+
+    Slab *s = st.partial[cls];
+    if (s == NULL) {
+        s = newSlab(st, cls);
+    }
+
+    void *rv;
+    if (s->freeList) {
+        rv = s->freeList;
+        s->freeList = *static_cast<void**>(rv);
+    } else {
+        rv = s->unused;
+        s->unused += classSize(cls);
+    }
+    ++s->used;
+    if (s->freeList == NULL && s->unused + classSize(cls) > s->end) {
+        unlinkSlab(s, &st.partial[cls]);
+        linkSlab(s, &st.full[cls]);
+    }
+
+    ++st.liveChunks;
+    charge(st, 0, classSize(cls), n);
+    return rv;
+}
+
+void SlabArena::release(void *p, size_t n) {
+    Slab *s = slabOf(p);
+    SlabArena *a = s->arena;
+    Stripe &st = a->stripes[s->stripe];
+    size_t cls = s->cls;
+    assert(sizeClass(n) == cls);
+
+    SpinLockHolder lh(&st.lock);
+    if (s->freeList == NULL && s->unused + classSize(cls) > s->end) {
+        a->unlinkSlab(s, &st.full[cls]);
+        a->linkSlab(s, &st.partial[cls]);
+    }
+    *static_cast<void**>(p) = s->freeList;
+    s->freeList = p;
+    --s->used;
+    a->charge(st, 0, -static_cast<ssize_t>(classSize(cls)),
+              -static_cast<ssize_t>(n));
+
+    // Keep one empty slab per class around so a single item coming
+    // and going doesn't hit the system allocator every time.
+    if (s->used == 0 && (st.partial[cls] != s || s->next != NULL)) {
+        a->unlinkSlab(s, &st.partial[cls]);
+        a->freeSlab(st, s);
+    }
+
+    assert(st.liveChunks > 0);
+    --st.liveChunks;
+    if (a->dead) {
+        lh.unlock();
+        if (a->pending.decr(1) == 0) {
+            a->freeAll();
+        }
+    }
+}
+
+size_t SlabArena::destroy(size_t abandoned) {
+    lockAll();
+    assert(!dead);
+    size_t live = 0;
+    size_t rv = 0;
+    for (size_t i = 0; i < NUM_STRIPES; ++i) {
+        live += stripes[i].liveChunks;
+        rv += stripes[i].slabBytes - stripes[i].requestedBytes;
+    }
+    assert(abandoned <= live);
+    dead = true;
+    pending.set(live - abandoned);
+    unlockAll();
+    // Otherwise the last release frees it all.
+    if (live == abandoned) {
+        freeAll();
+    }
+    return rv;
+}
+
+size_t SlabArena::getOverhead() {
+    size_t rv = 0;
+    for (size_t i = 0; i < NUM_STRIPES; ++i) {
+        SpinLockHolder lh(&stripes[i].lock);
+        rv += stripes[i].slabBytes - stripes[i].requestedBytes;
+    }
+    return rv;
+}
+
+size_t SlabArena::getNumSlabs() {
+    size_t rv = 0;
+    for (size_t i = 0; i < NUM_STRIPES; ++i) {
+        SpinLockHolder lh(&stripes[i].lock);
+        rv += stripes[i].numSlabs;
+    }
+    return rv;
+}
+
+Slab *SlabArena::newSlab(Stripe &st, size_t cls) {
+    void *p = NULL;
+    if (posix_memalign(&p, SLAB_SIZE, SLAB_SIZE) != 0) {
+        throw std::bad_alloc();
+    }
+    Slab *s = static_cast<Slab*>(p);
+    s->arena = this;
+    s->prev = s->next = NULL;
+    s->freeList = NULL;
+    s->unused = static_cast<char*>(p) + slabHeaderSize;
+    s->end = static_cast<char*>(p) + SLAB_SIZE;
+    s->cls = static_cast<uint32_t>(cls);
+    s->stripe = static_cast<uint32_t>(&st - stripes);
+    s->used = 0;
+    linkSlab(s, &st.partial[cls]);
+    charge(st, 1, 0, 0);
+    return s;
+}
+
+void SlabArena::freeSlab(Stripe &st, Slab *s) {
+    assert(s->used == 0);
+    free(s);
+    charge(st, -1, 0, 0);
+}
+
+void SlabArena::freeAll() {
+    // Nobody else can get here, so no need for the locks.
+    for (size_t i = 0; i < NUM_STRIPES; ++i) {
+        Stripe &st = stripes[i];
+        for (size_t j = 0; j < NUM_CLASSES; ++j) {
+            Slab *lists[2] = { st.partial[j], st.full[j] };
+            for (int l = 0; l < 2; ++l) {
+                Slab *s = lists[l];
+                while (s) {
+                    Slab *next = s->next;
+                    free(s);
+                    s = next;
+                }
+            }
+        }
+        stats.numSlabs.decr(st.numSlabs);
+        stats.slabBytes.decr(st.slabBytes);
+        stats.slabUsedBytes.decr(st.usedBytes);
+        stats.slabRequestedBytes.decr(st.requestedBytes);
+    }
+    delete this;
+}
+
+void SlabArena::lockAll() {
+    // Always in the same order.
+    for (size_t i = 0; i < NUM_STRIPES; ++i) {
+        stripes[i].lock.acquire();
+    }
+}
+
+void SlabArena::unlockAll() {
+    for (size_t i = NUM_STRIPES; i > 0; --i) {
+        stripes[i - 1].lock.release();
+    }
+}
+
+void SlabArena::unlinkSlab(Slab *s, Slab **list) {
+    if (s->prev) {
+        s->prev->next = s->next;
+    } else {
+        assert(*list == s);
+        *list = s->next;
+    }
+    if (s->next) {
+        s->next->prev = s->prev;
+    }
+    s->prev = s->next = NULL;
+}
+
+void SlabArena::linkSlab(Slab *s, Slab **list) {
+    s->prev = NULL;
+    s->next = *list;
+    if (*list) {
+        (*list)->prev = s;
+    }
+    *list = s;
+}
+
+void SlabArena::charge(Stripe &st, ssize_t slabs, ssize_t used,
+                       ssize_t requested) {
+    // Negative deltas wrap around, which the unsigned stats are fine with.
+    st.numSlabs += slabs;
+    st.slabBytes += slabs * SLAB_SIZE;
+    st.usedBytes += used;
+    st.requestedBytes += requested;
+
+    stats.numSlabs.incr(slabs);
+    stats.slabBytes.incr(slabs * SLAB_SIZE);
+    stats.slabUsedBytes.incr(used);
+    stats.slabRequestedBytes.incr(requested);
+    // Once the owner is gone it has settled its overhead for good.
+    if (!dead) {
+        stats.memOverhead.incr(slabs * SLAB_SIZE - requested);
+    }
+}
@@ -0,0 +1,133 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#ifndef SLAB_ALLOCATOR_H
+#define SLAB_ALLOCATOR_H 1
+
+#include "common.hh"
+#include "atomic.hh"
+#include "stats.hh"
+
+class Slab;
+
+/**
+ * A size class slab allocator for small, short lived objects.
+ *
+ * Memory is taken from the system SLAB_SIZE bytes at a time, each
+ * slab aligned to its own size and carved into equal chunks of one
+ * size class.  A chunk finds its slab, and so its arena, by masking
+ * its address, so freeing a chunk only needs the pointer.
+ *
+ * An arena is split into a few stripes, each with its own lock and
+ * slabs, and a thread allocates from the stripe picked by its thread
+ * slot, so threads storing into the same table don't queue up behind
+ * one lock.  A chunk goes back to the stripe its slab came from.
+ *
+ * An arena belongs to one owner (a hash table) and everything it
+ * handed out can be dropped at once with destroy(), which frees the
+ * slabs rather than the chunks.  Chunks the owner has already given
+ * up on but that are still waiting to be released (e.g. retired
+ * through the Epoch) keep the arena alive until the last of them is
+ * released.
+ *
+ * The memory held by slabs but not requested by anyone (partial
+ * slabs and the rounding up to a size class) is charged to the
+ * memory overhead stat for as long as the owner is around.
+ */
+class SlabArena {
+public:
+
+    //! Size (and alignment) of a slab.
+    static const size_t SLAB_SIZE = 8192;
+    //! Chunk sizes are multiples of this.
+    static const size_t GRANULARITY = 16;
+    //! The largest chunk an arena hands out.
+    static const size_t MAX_CHUNK = 512;
+
+    SlabArena(EPStats &st);
+
+    /**
+     * Allocate n bytes.
+     *
+     * @param n the number of bytes wanted, at most MAX_CHUNK
+     * @return the memory (aligned to GRANULARITY)
+     * @throws std::bad_alloc if no slab could be allocated
+     */
+    void *allocate(size_t n);
+
+    /**
+     * Give memory back to the arena it was allocated from.
+     *
+     * @param p memory returned by allocate()
+     * @param n the size that was passed to allocate()
+     */
+    static void release(void *p, size_t n);
+
+    /**
+     * Drop everything this arena handed out.
+     *
+     * The owner promises it won't release() the given number of
+     * chunks it still holds.  The slabs are freed once the chunks
+     * released by others are back, and the arena deletes itself.
+     *
+     * @param abandoned the number of chunks the owner won't release
+     * @return the overhead that was charged for this arena
+     */
+    size_t destroy(size_t abandoned);
+
+    /**
+     * Get the memory held by slabs beyond what was asked for.
+     */
+    size_t getOverhead();
+
+    /**
+     * Get the number of slabs this arena holds.
+     */
+    size_t getNumSlabs();
+
+    /**
+     * Get the chunk size that a request of n bytes is rounded up to.
+     */
+    static size_t chunkSize(size_t n) {
+        return (n + GRANULARITY - 1) & ~(GRANULARITY - 1);
+    }
+
+private:
+
+    static const size_t NUM_CLASSES = MAX_CHUNK / GRANULARITY;
+    static const size_t NUM_STRIPES = 4;
+
+    struct Stripe {
+        SpinLock lock;
+        // Slabs with free chunks, and slabs without, by size class.
+        Slab    *partial[NUM_CLASSES];
+        Slab    *full[NUM_CLASSES];
+        size_t   numSlabs;
+        size_t   slabBytes;
+        size_t   usedBytes;
+        size_t   requestedBytes;
+        size_t   liveChunks;
+        // Keeps the next stripe off this one's last cache line.
+        char     pad[CACHE_LINE_SIZE];
+    };
+
+    ~SlabArena() {}
+
+    Slab *newSlab(Stripe &st, size_t cls);
+    void freeSlab(Stripe &st, Slab *s);
+    void freeAll();
+    void unlinkSlab(Slab *s, Slab **list);
+    void linkSlab(Slab *s, Slab **list);
+    void charge(Stripe &st, ssize_t slabs, ssize_t used, ssize_t requested);
+    void lockAll();
+    void unlockAll();
+
+    EPStats &stats;
+    Stripe   stripes[NUM_STRIPES];
+    // Set (under every stripe lock) when the owner is gone, after
+    // which releases count down the chunks still out.
+    bool           dead;
+    Atomic<size_t> pending;
+
+    DISALLOW_COPY_AND_ASSIGN(SlabArena);
+};
+
+#endif /* SLAB_ALLOCATOR_H */
@@ -9,7 +9,7 @@
 
 StrategicSqlite3::StrategicSqlite3(EventuallyPersistentEngine &theEngine, SqliteStrategy *s) :
     engine(theEngine), stats(engine.getEpStats()), strategy(s),
-    intransaction(false) {
+    intransaction(false), writerId(0), numWriters(1) {
     open();
 }
 
@@ -19,12 +19,12 @@ int64_t StrategicSqlite3::lastRowId() {
     return static_cast<int64_t>(sqlite3_last_insert_rowid(db));
 }
 
-void StrategicSqlite3::insert(const Item &itm, Callback<std::pair<bool, int64_t> > &cb) {
+std::pair<bool, int64_t> StrategicSqlite3::insert(const Item &itm) {
     assert(itm.getId() <= 0);
 
     PreparedStatement *ins_stmt = strategy->forKey(itm.getKey())->ins();
-    ins_stmt->bind(1, itm.getKey().c_str());
-    ins_stmt->bind(2, const_cast<Item&>(itm).getData(), itm.getNBytes());
+    ins_stmt->bind(1, itm.getKey().data(), itm.getKey().length());
+    ins_stmt->bind(2, itm.getData(), itm.getNBytes());
     ins_stmt->bind(3, itm.getFlags());
     ins_stmt->bind(4, itm.getExptime());
     ins_stmt->bind64(5, itm.getCas());
@@ -39,19 +39,18 @@ void StrategicSqlite3::insert(const Item &itm, Callback<std::pair<bool, int64_t>
     }
 
     int64_t newId = lastRowId();
-
-    std::pair<bool, int64_t> p(rv, newId);
-    cb.callback(p);
     ins_stmt->reset();
+
+    return std::pair<bool, int64_t>(rv, newId);
 }
 
-void StrategicSqlite3::update(const Item &itm, Callback<std::pair<bool, int64_t> > &cb) {
+std::pair<bool, int64_t> StrategicSqlite3::update(const Item &itm) {
     assert(itm.getId() > 0);
 
     PreparedStatement *upd_stmt = strategy->forKey(itm.getKey())->upd();
 
-    upd_stmt->bind(1, itm.getKey().c_str());
-    upd_stmt->bind(2, const_cast<Item&>(itm).getData(), itm.getNBytes());
+    upd_stmt->bind(1, itm.getKey().data(), itm.getKey().length());
+    upd_stmt->bind(2, itm.getData(), itm.getNBytes());
     upd_stmt->bind(3, itm.getFlags());
     upd_stmt->bind(4, itm.getExptime());
     upd_stmt->bind64(5, itm.getCas());
@@ -64,9 +63,9 @@ void StrategicSqlite3::update(const Item &itm, Callback<std::pair<bool, int64_t>
     ++stats.io_num_write;
     stats.io_write_bytes += itm.getKey().length() + itm.getNBytes();
 
-    std::pair<bool, int64_t> p(rv, 0);
-    cb.callback(p);
     upd_stmt->reset();
+
+    return std::pair<bool, int64_t>(rv, 0);
 }
 
 std::map<uint16_t, std::string> StrategicSqlite3::listPersistedVbuckets() {
@@ -84,12 +83,37 @@ std::map<uint16_t, std::string> StrategicSqlite3::listPersistedVbuckets() {
     return rv;
 }
 
+std::map<uint16_t, size_t> StrategicSqlite3::countPersistedItems() {
+    std::map<uint16_t, size_t> rv;
+
+    const std::vector<Statements*> statements = strategy->allStatements();
+    std::vector<Statements*>::const_iterator it;
+    for (it = statements.begin(); it != statements.end(); ++it) {
+        PreparedStatement *st = (*it)->count_vb();
+        while (st->fetch()) {
+            ++stats.io_num_read;
+            rv[static_cast<uint16_t>(st->column_int(0))] += st->column_int64(1);
+        }
+        st->reset();
+    }
+
+    return rv;
+}
+
 void StrategicSqlite3::set(const Item &itm, Callback<std::pair<bool, int64_t> > &cb) {
-    if (itm.getId() <= 0) {
-        insert(itm, cb);
-    } else {
-        update(itm, cb);
+    std::pair<bool, int64_t> p(itm.getId() <= 0 ? insert(itm) : update(itm));
+    cb.callback(p);
+}
+
+void StrategicSqlite3::setMany(const std::vector<Item*> &items,
+                               Callback<std::vector<std::pair<bool, int64_t> > > &cb) {
+    std::vector<std::pair<bool, int64_t> > rv;
+    rv.reserve(items.size());
+    std::vector<Item*>::const_iterator it;
+    for (it = items.begin(); it != items.end(); ++it) {
+        rv.push_back((*it)->getId() <= 0 ? insert(**it) : update(**it));
     }
+    cb.callback(rv);
 }
 
 void StrategicSqlite3::get(const std::string &key,
@@ -117,7 +141,17 @@ void StrategicSqlite3::get(const std::string &key,
 }
 
 void StrategicSqlite3::reset() {
-    if (db) {
+    if (db && numWriters > 1) {
+        // The others are still writing, so the tables stay.
+        const std::vector<Statements*> statements = strategy->allStatements();
+        for (size_t i = 0; i < statements.size(); ++i) {
+            if (ownsShard(i)) {
+                PreparedStatement *st = statements[i]->del_all();
+                st->execute();
+                st->reset();
+            }
+        }
+    } else if (db) {
         rollback();
         close();
         open();
@@ -128,8 +162,7 @@ void StrategicSqlite3::reset() {
     }
 }
 
-void StrategicSqlite3::del(const std::string &key, uint16_t vbucket,
-                           Callback<bool> &cb) {
+bool StrategicSqlite3::remove(const std::string &key, uint16_t vbucket) {
     PreparedStatement *del_stmt = strategy->forKey(key)->del();
     del_stmt->bind(1, key.c_str());
     del_stmt->bind(2, vbucket);
@@ -137,20 +170,69 @@ void StrategicSqlite3::del(const std::string &key, uint16_t vbucket,
     if (rv) {
         stats.totalPersisted++;
     }
-    cb.callback(rv);
     del_stmt->reset();
+    return rv;
+}
+
+void StrategicSqlite3::del(const std::string &key, uint16_t vbucket,
+                           Callback<bool> &cb) {
+    bool rv = remove(key, vbucket);
+    cb.callback(rv);
+}
+
+void StrategicSqlite3::delMany(const std::vector<std::pair<uint16_t, std::string> > &keys,
+                               Callback<std::vector<bool> > &cb) {
+    std::vector<bool> rv(keys.size(), false);
+
+    // Indexes of the keys going to each table and vbucket.
+    std::map<std::pair<Statements*, uint16_t>, std::vector<size_t> > groups;
+    for (size_t i = 0; i < keys.size(); ++i) {
+        groups[std::make_pair(strategy->forKey(keys[i].second),
+                              keys[i].first)].push_back(i);
+    }
+
+    std::map<std::pair<Statements*, uint16_t>, std::vector<size_t> >::iterator it;
+    for (it = groups.begin(); it != groups.end(); ++it) {
+        const std::vector<size_t> &idx = it->second;
+        size_t done = 0;
+        for (; idx.size() - done >= Statements::DEL_BATCH;
+             done += Statements::DEL_BATCH) {
+            PreparedStatement *st = it->first.first->del_many();
+            st->bind(1, it->first.second);
+            for (int j = 0; j < Statements::DEL_BATCH; ++j) {
+                st->bind(j + 2, keys[idx[done + j]].second.c_str());
+            }
+            bool ok = st->execute() >= 0;
+            st->reset();
+            if (ok) {
+                stats.totalPersisted.incr(Statements::DEL_BATCH);
+            }
+            for (int j = 0; j < Statements::DEL_BATCH; ++j) {
+                rv[idx[done + j]] = ok;
+            }
+        }
+        for (; done < idx.size(); ++done) {
+            rv[idx[done]] = remove(keys[idx[done]].second, it->first.second);
+        }
+    }
+    cb.callback(rv);
 }
 
 bool StrategicSqlite3::delVBucket(uint16_t vbucket) {
     bool rv = true;
     const std::vector<Statements*> statements = strategy->allStatements();
-    std::vector<Statements*>::const_iterator it;
-    for (it = statements.begin(); it != statements.end(); ++it) {
-        PreparedStatement *del_stmt = (*it)->del_vb();
+    for (size_t i = 0; i < statements.size(); ++i) {
+        if (!ownsShard(i)) {
+            continue;
+        }
+        PreparedStatement *del_stmt = statements[i]->del_vb();
         del_stmt->bind(1, vbucket);
         rv &= del_stmt->execute() >= 0;
         del_stmt->reset();
     }
+    if (writerId != 0) {
+        return rv;
+    }
     PreparedStatement *dst = strategy->getDelVBucketStateST();
     dst->bind(1, vbucket);
     ++stats.io_num_write;
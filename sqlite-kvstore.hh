@@ -35,9 +35,39 @@ public:
 
     /**
      * Reset database to a clean state.
+     *
+     * A connection that's one of several writers only empties the
+     * shards it owns.
      */
     void reset();
 
+    /**
+     * Make this connection one of several writing to the database.
+     *
+     * Writer w of n owns the shards s where s % n == w; it's only
+     * given items in those shards to store, and deleting a vbucket
+     * only touches those.  Writer 0 also owns the vbucket states.
+     */
+    void setWriter(size_t w, size_t n) {
+        assert(w < n);
+        writerId = w;
+        numWriters = n;
+    }
+
+    /**
+     * Get the shard the given key is stored in.
+     */
+    size_t shardOf(const std::string &key) {
+        return strategy->shardOf(key);
+    }
+
+    /**
+     * True if the given key is in a shard this connection writes.
+     */
+    bool ownsKey(const char *key, size_t nkey) {
+        return numWriters == 1 || ownsShard(strategy->shardOf(key, nkey));
+    }
+
     /**
      * Begin a transaction (if not already in one).
      */
@@ -88,10 +118,32 @@ public:
     void del(const std::string &key, uint16_t vbucket,
              Callback<bool> &cb);
 
+    /**
+     * Store several items, calling back once with how each went
+     * (in the same order, as with set()).
+     */
+    void setMany(const std::vector<Item*> &items,
+                 Callback<std::vector<std::pair<bool, int64_t> > > &cb);
+
+    /**
+     * Delete several keys, given with their vbuckets, calling back
+     * once with how each went (in the same order, as with del()).
+     *
+     * Keys in the same table and vbucket are deleted
+     * Statements::DEL_BATCH at a time.
+     */
+    void delMany(const std::vector<std::pair<uint16_t, std::string> > &keys,
+                 Callback<std::vector<bool> > &cb);
+
     bool delVBucket(uint16_t vbucket);
     bool setVBState(uint16_t vbucket, const std::string &to);
     std::map<uint16_t, std::string> listPersistedVbuckets(void);
 
+    /**
+     * Count the persisted items in each vbucket.
+     */
+    std::map<uint16_t, size_t> countPersistedItems(void);
+
     /**
      * Overrides dump
      */
@@ -108,8 +160,13 @@ private:
         return st.execute();
     }
 
-    void insert(const Item &itm, Callback<std::pair<bool, int64_t> > &cb);
-    void update(const Item &itm, Callback<std::pair<bool, int64_t> > &cb);
+    bool ownsShard(size_t shard) {
+        return shard % numWriters == writerId;
+    }
+
+    std::pair<bool, int64_t> insert(const Item &itm);
+    std::pair<bool, int64_t> update(const Item &itm);
+    bool remove(const std::string &key, uint16_t vbucket);
     int64_t lastRowId();
 
     EventuallyPersistentEngine &engine;
@@ -135,6 +192,8 @@ private:
     SqliteStrategy *strategy;
 
     bool intransaction;
+    size_t writerId;
+    size_t numWriters;
 };
 
 #endif /* SQLITE_BASE_H */
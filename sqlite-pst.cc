@@ -141,4 +141,19 @@ void Statements::initStatements() {
     snprintf(buf, sizeof(buf),
              "delete from %s where vbucket = ?", tableName.c_str());
     del_vb_stmt = new PreparedStatement(db, buf);
+
+    snprintf(buf, sizeof(buf),
+             "select vbucket, count(*) from %s group by vbucket",
+             tableName.c_str());
+    count_vb_stmt = new PreparedStatement(db, buf);
+
+    snprintf(buf, sizeof(buf), "delete from %s", tableName.c_str());
+    del_all_stmt = new PreparedStatement(db, buf);
+
+    std::string query("delete from " + tableName + " where vbucket = ? and k in (?");
+    for (int i = 1; i < DEL_BATCH; ++i) {
+        query.append(", ?");
+    }
+    query.append(")");
+    del_many_stmt = new PreparedStatement(db, query.c_str());
 }
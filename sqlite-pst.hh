@@ -36,6 +36,9 @@ public:
      * Bind a null-terminated string parameter to a binding in
      * this statement.
      *
+     * Strings aren't copied, so they must stay put until the
+     * statement is reset.
+     *
      * @param pos the binding position (starting at 1)
      * @param s the value to bind
      */
@@ -150,6 +153,9 @@ private:
 
 class Statements {
 public:
+    //! Number of keys deleted at once by del_many().
+    static const int DEL_BATCH = 16;
+
     Statements(sqlite3 *dbh, std::string tab) {
         db = dbh;
         tableName = tab;
@@ -163,7 +169,11 @@ public:
         delete del_stmt;
         delete del_vb_stmt;
         delete all_stmt;
+        delete count_vb_stmt;
+        delete del_all_stmt;
+        delete del_many_stmt;
         ins_stmt = upd_stmt = sel_stmt = del_stmt = del_vb_stmt = all_stmt = NULL;
+        count_vb_stmt = del_all_stmt = del_many_stmt = NULL;
     }
 
     PreparedStatement *ins() {
@@ -189,6 +199,22 @@ public:
     PreparedStatement *all() {
         return all_stmt;
     }
+
+    PreparedStatement *count_vb() {
+        return count_vb_stmt;
+    }
+
+    PreparedStatement *del_all() {
+        return del_all_stmt;
+    }
+
+    /**
+     * Delete DEL_BATCH keys from one vbucket: the vbucket is bound
+     * first, then the keys.
+     */
+    PreparedStatement *del_many() {
+        return del_many_stmt;
+    }
 private:
 
     void initStatements();
@@ -201,6 +227,9 @@ private:
     PreparedStatement *del_stmt;
     PreparedStatement *del_vb_stmt;
     PreparedStatement *all_stmt;
+    PreparedStatement *count_vb_stmt;
+    PreparedStatement *del_all_stmt;
+    PreparedStatement *del_many_stmt;
 
     DISALLOW_COPY_AND_ASSIGN(Statements);
 };
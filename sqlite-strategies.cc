@@ -18,6 +18,12 @@ sqlite3 *SqliteStrategy::open(void) {
             throw std::runtime_error("Error enabling extended RCs");
         }
 
+        // Other connections (one per flusher) may be committing to
+        // the same files; wait for them rather than failing.
+        if(sqlite3_busy_timeout(db, BUSY_TIMEOUT_MS) != SQLITE_OK) {
+            throw std::runtime_error("Error setting the busy timeout");
+        }
+
         initPragmas();
         initTables();
         initStatements();
@@ -13,6 +13,9 @@ class EventuallyPersistentEngine;
 class SqliteStrategy {
 public:
 
+    //! How long to wait for a lock another connection holds (ms).
+    static const int BUSY_TIMEOUT_MS = 10000;
+
     SqliteStrategy(EventuallyPersistentEngine &theEngine, const char * const fn, const char * const finit = NULL) :
         engine(theEngine),
         filename(fn),
@@ -29,17 +32,32 @@ public:
         return statements;
     }
 
-    Statements *forKey(const std::string &key) {
-        assert(statements.size() > 0);
-        int h=5381;
-        int i=0;
-        const char *str = key.c_str();
+    /**
+     * Get the shard holding the given key.
+     *
+     * This decides where a key is stored on disk, so it must never
+     * change: it's the original DJB variant (up to the first NUL),
+     * whatever hash function the in-memory hash tables use.
+     */
+    size_t shardOf(const std::string &key) {
+        return shardOf(key.data(), key.length());
+    }
 
-        for(i=0; str[i] != 0x00; i++) {
-            h = ((h << 5) + h) ^ str[i];
+    size_t shardOf(const char *key, size_t nkey) {
+        assert(statements.size() > 0);
+        // Unsigned so the wraparound is defined; the bits are the same.
+        uint32_t h = 5381;
+        for (size_t i = 0; i < nkey && key[i] != 0x00; i++) {
+            h = ((h << 5) + h) ^ static_cast<uint32_t>(static_cast<int>(key[i]));
         }
+        return std::abs(static_cast<int>(h)) % static_cast<int>(statements.size());
+    }
 
-        return statements.at(std::abs(h) % (int)statements.size());
+    /**
+     * Get the statements for the shard holding the given key.
+     */
+    Statements *forKey(const std::string &key) {
+        return statements.at(shardOf(key));
     }
 
     PreparedStatement *getSetVBucketStateST() {
@@ -14,10 +14,17 @@
 
 /**
  * Global engine stats container.
+ *
+ * Counters every front end thread updates on every mutation are
+ * ShardedCounters.
  */
 class EPStats {
 public:
 
+    //! Number of commit time histogram buckets, enough to tell
+    //! commits apart up to about 67 seconds (past any commit budget).
+    static const int COMMIT_HISTO_BUCKETS = 28;
+
     EPStats() : maxDataSize(DEFAULT_MAX_DATA_SIZE) {}
 
     //! How long it took us to load the data from disk.
@@ -56,13 +63,19 @@ public:
     Atomic<rel_time_t> flushDurationHighWat;
     //! Amount of time spent in the commit phase.
     Atomic<rel_time_t> commit_time;
+    /**
+     * Commits by how long they took.  Bucket 0 is under a
+     * microsecond, bucket i after it from 2^(i-1) up to 2^i usec, and
+     * the last one has no end.
+     */
+    Atomic<size_t> commitHisto[COMMIT_HISTO_BUCKETS];
     /**
      * Total number of items.
      *
      * This would be total_items if we recycled items, but we don't
      * right now.
      */
-    Atomic<size_t> curr_items;
+    ShardedCounter<size_t> curr_items;
     //! Beyond this point are config items
     //! Minimum data age before a record can be persisted
     Atomic<int> min_data_age;
@@ -70,21 +83,53 @@ public:
     Atomic<int> queue_age_cap;
     //! Number of times background fetches occurred.
     Atomic<size_t> bg_fetched;
+    //! Number of background fetches that loaded several items at once.
+    Atomic<size_t> bgFetchBatches;
     //! Number of times we needed to kick in the pager
     Atomic<size_t> pagerRuns;
+    //! Number of times the expiry pager went through all items.
+    Atomic<size_t> expiryPagerRuns;
+    //! Number of expired items the expiry pager deleted.
+    Atomic<size_t> expired;
+    //! Number of expired items deleted in the last expiry pager run.
+    Atomic<size_t> expiredLastRun;
     //! Number of times a value is ejected
     Atomic<size_t> numValueEjects;
     //! Number of times a value could not be ejected
     Atomic<size_t> numFailedEjects;
+    //! Number of hash table reads that had to take the stripe lock
+    Atomic<size_t> lockedReads;
 
     //! Max allowable memory size.
     Atomic<size_t> maxDataSize;
     //! Total size of stored objects.
-    Atomic<size_t> currentSize;
+    ShardedCounter<size_t> currentSize;
     //! Total size used by resident objects.
-    Atomic<size_t> totalCacheSize;
+    ShardedCounter<size_t> totalCacheSize;
     //! Amount of memory used to track items and what-not.
-    Atomic<size_t> memOverhead;
+    ShardedCounter<size_t> memOverhead;
+    //! Number of slabs holding StoredValues.
+    Atomic<size_t> numSlabs;
+    //! Memory held by those slabs.
+    Atomic<size_t> slabBytes;
+    //! Memory in slab chunks handed out (after size class rounding).
+    Atomic<size_t> slabUsedBytes;
+    //! Memory asked of the slabs.
+    Atomic<size_t> slabRequestedBytes;
+    //! Number of values we tried to compress.
+    Atomic<uint64_t> numCompressions;
+    //! Number of those that came out small enough to keep.
+    Atomic<uint64_t> numCompressed;
+    //! Bytes going into the kept compressions.
+    Atomic<uint64_t> compressedInBytes;
+    //! Bytes coming out of the kept compressions.
+    Atomic<uint64_t> compressedOutBytes;
+    //! Time spent compressing (usec).
+    Atomic<hrtime_t> compressTime;
+    //! Number of values decompressed.
+    Atomic<uint64_t> numDecompressions;
+    //! Time spent decompressing (usec).
+    Atomic<hrtime_t> decompressTime;
     //! Number of nonResident items
     Atomic<size_t> numNonResident;
 
@@ -96,14 +141,23 @@ public:
     //! Number of ENOMEM errors produced.
     Atomic<size_t> oom_errors;
 
+    //! Memory a vbucket's items may take before they're paged out
+    //! ahead of everyone else's (0 for no quota).
+    Atomic<size_t> vbMemSoftQuota;
+    //! Memory a vbucket's items may take before sets to it are
+    //! turned away (0 for no quota).
+    Atomic<size_t> vbMemHardQuota;
+    //! Number of sets turned away for going over the hard quota.
+    Atomic<size_t> vbQuotaRejects;
+
     //! Number of read related io operations
-    Atomic<size_t> io_num_read;
+    ShardedCounter<size_t> io_num_read;
     //! Number of write related io operations
-    Atomic<size_t> io_num_write;
+    ShardedCounter<size_t> io_num_write;
     //! Number of bytes read
-    Atomic<uint64_t> io_read_bytes;
+    ShardedCounter<uint64_t> io_read_bytes;
     //! Number of bytes written
-    Atomic<uint64_t> io_write_bytes;
+    ShardedCounter<uint64_t> io_write_bytes;
 
     //! Number of ops blocked on all vbuckets in pending state
     Atomic<uint64_t> pendingOps;
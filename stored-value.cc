@@ -1,15 +1,398 @@
 /* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
 #include "config.h"
 #include <cassert>
+#include <new>
+#include <vector>
+#include <sched.h>
+#include <sys/mman.h>
 #include "stored-value.hh"
 
 #ifndef DEFAULT_HT_SIZE
-#define DEFAULT_HT_SIZE 12582917
+#define DEFAULT_HT_SIZE 3079
 #endif
 
+#ifndef DEFAULT_INLINE_VALUE_SIZE
+#define DEFAULT_INLINE_VALUE_SIZE 32
+#endif
+
+// Grow when the average bucket holds more than this many times the
+// items a freshly resized table aims for.
+static const size_t maxLoadFactor = 2;
+// Shrink when it holds less than this fraction of them.
+static const size_t minLoadFactor = 4;
+
+namespace {
+
+    /**
+     * A thread's view of the epochs.
+     */
+    struct __attribute__((aligned(CACHE_LINE_SIZE))) EpochSlot {
+        EpochSlot() : active(0), inUse(0), sinceAdvance(0), hasLimbo(0) {
+            for (int i = 0; i < 3; ++i) {
+                limboEpoch[i] = 0;
+            }
+        }
+
+        //! The epoch this thread is reading in, or 0 if it isn't.
+        volatile size_t active;
+        // Keep other threads' slots off of this cache line.
+        char pad[CACHE_LINE_SIZE - sizeof(size_t)];
+        volatile int inUse;
+        size_t sinceAdvance;
+        //! Guards the limbo lists, which whoever advances the epoch
+        //! may free if this thread has gone quiet.
+        SpinLock limboLock;
+        //! Set while any of the limbo lists might not be empty.
+        volatile int hasLimbo;
+        //! What this thread retired in each of the last three epochs.
+        size_t limboEpoch[3];
+        std::vector<std::pair<void*, Epoch::reclaimer_t> > limbo[3];
+        std::vector<value_t> limboValues[3];
+    };
+
+    /**
+     * Retired things handed over by threads without a slot of their own.
+     */
+    struct Orphans {
+        Orphans() : epoch(0) {}
+        size_t epoch;
+        std::vector<std::pair<void*, Epoch::reclaimer_t> > things;
+        std::vector<value_t> values;
+    };
+
+    void releaseEpochSlot(void *arg);
+
+    Atomic<size_t> globalEpoch(1);
+    EpochSlot epochSlots[MAX_THREADS];
+    Atomic<size_t> numEpochSlots;
+    ThreadLocalPtr<EpochSlot> threadEpochSlot(releaseEpochSlot);
+    // Marks a thread that couldn't get a slot.
+    EpochSlot noEpochSlot;
+    Mutex orphanLock;
+    std::vector<Orphans> orphans;
+    Atomic<size_t> numOrphans;
+
+    // Try to advance the epoch after this many retirements.
+    const size_t advanceInterval = 64;
+
+    void freeLimbo(std::vector<std::pair<void*, Epoch::reclaimer_t> > &things,
+                   std::vector<value_t> &values) {
+        std::vector<std::pair<void*, Epoch::reclaimer_t> >::iterator it;
+        for (it = things.begin(); it != things.end(); ++it) {
+            it->second(it->first);
+        }
+        things.clear();
+        values.clear();
+    }
+
+    EpochSlot *epochSlot() {
+        EpochSlot *s = threadEpochSlot.get();
+        if (s == NULL) {
+            s = &noEpochSlot;
+            for (size_t i = 0; i < MAX_THREADS; ++i) {
+                if (__sync_bool_compare_and_swap(&epochSlots[i].inUse, 0, 1)) {
+                    s = &epochSlots[i];
+                    numEpochSlots.setIfBigger(i + 1);
+                    break;
+                }
+            }
+            threadEpochSlot.set(s);
+        }
+        return s == &noEpochSlot ? NULL : s;
+    }
+
+    /**
+     * Hand retired things to the orphan list, where whoever advances
+     * the epoch will free them.
+     */
+    void adopt(size_t epoch,
+               std::vector<std::pair<void*, Epoch::reclaimer_t> > &things,
+               std::vector<value_t> &values) {
+        if (things.empty() && values.empty()) {
+            return;
+        }
+        LockHolder lh(orphanLock);
+        orphans.push_back(Orphans());
+        Orphans &o = orphans.back();
+        o.epoch = epoch;
+        o.things.swap(things);
+        o.values.swap(values);
+        ++numOrphans;
+    }
+
+    void freeOrphans(size_t epoch) {
+        if (numOrphans.get() == 0) {
+            return;
+        }
+        LockHolder lh(orphanLock);
+        std::vector<Orphans>::iterator it = orphans.begin();
+        while (it != orphans.end()) {
+            if (it->epoch + 2 <= epoch) {
+                freeLimbo(it->things, it->values);
+                it = orphans.erase(it);
+                --numOrphans;
+            } else {
+                ++it;
+            }
+        }
+    }
+
+    /**
+     * Free what other threads retired long enough ago, so a thread
+     * that stops retiring doesn't sit on its last few lists forever.
+     * Threads busy with their lists are left alone.
+     */
+    void freeIdleLimbo(size_t epoch) {
+        size_t n = numEpochSlots.get();
+        for (size_t i = 0; i < n; ++i) {
+            EpochSlot &s = epochSlots[i];
+            if (!s.hasLimbo || !s.limboLock.tryAcquire()) {
+                continue;
+            }
+            int left = 0;
+            for (int j = 0; j < 3; ++j) {
+                if (s.limboEpoch[j] + 2 <= epoch) {
+                    freeLimbo(s.limbo[j], s.limboValues[j]);
+                } else if (!s.limbo[j].empty() || !s.limboValues[j].empty()) {
+                    left = 1;
+                }
+            }
+            s.hasLimbo = left;
+            s.limboLock.release();
+        }
+    }
+
+    void releaseEpochSlot(void *arg) {
+        EpochSlot *s = static_cast<EpochSlot*>(arg);
+        if (s == &noEpochSlot) {
+            return;
+        }
+        assert(s->active == 0);
+        SpinLockHolder lh(&s->limboLock);
+        for (int i = 0; i < 3; ++i) {
+            adopt(s->limboEpoch[i], s->limbo[i], s->limboValues[i]);
+            s->limboEpoch[i] = 0;
+        }
+        s->hasLimbo = 0;
+        lh.unlock();
+        s->sinceAdvance = 0;
+        __sync_lock_release(&s->inUse);
+    }
+}
+
+bool Epoch::enter() {
+    EpochSlot *s = epochSlot();
+    if (s == NULL) {
+        return false;
+    }
+    assert(s->active == 0);
+    size_t e;
+    do {
+        e = globalEpoch.get();
+        s->active = e;
+        // Announce before reading anything, and make sure the epoch
+        // didn't move while announcing.
+        __sync_synchronize();
+    } while (globalEpoch.get() != e);
+    return true;
+}
+
+void Epoch::leave() {
+    EpochSlot *s = threadEpochSlot.get();
+    assert(s && s != &noEpochSlot && s->active != 0);
+    __sync_lock_release(&s->active);
+}
+
+/**
+ * Get this thread's slot, with its limbo lock held, and the list for
+ * the current epoch.
+ */
+static EpochSlot *retireSlot(size_t *epoch, int *i) {
+    // Whatever is being retired must be unlinked before the epoch
+    // it's retired in is read.
+    __sync_synchronize();
+    *epoch = globalEpoch.get();
+    *i = static_cast<int>(*epoch % 3);
+    EpochSlot *s = epochSlot();
+    if (s == NULL) {
+        return NULL;
+    }
+    s->limboLock.acquire();
+    if (s->limboEpoch[*i] != *epoch) {
+        // That list is from three epochs ago at least.
+        freeLimbo(s->limbo[*i], s->limboValues[*i]);
+        s->limboEpoch[*i] = *epoch;
+    }
+    return s;
+}
+
+static void retired(EpochSlot *s) {
+    s->hasLimbo = 1;
+    s->limboLock.release();
+    if (++s->sinceAdvance >= advanceInterval) {
+        s->sinceAdvance = 0;
+        Epoch::advance();
+    }
+}
+
+void Epoch::retire(void *p, reclaimer_t fn) {
+    size_t e(0);
+    int i(0);
+    EpochSlot *s = retireSlot(&e, &i);
+    if (s == NULL) {
+        std::vector<std::pair<void*, reclaimer_t> > things;
+        std::vector<value_t> values;
+        things.push_back(std::make_pair(p, fn));
+        adopt(e, things, values);
+        return;
+    }
+    s->limbo[i].push_back(std::make_pair(p, fn));
+    retired(s);
+}
+
+void Epoch::retire(const value_t &v) {
+    if (!v) {
+        return;
+    }
+    size_t e(0);
+    int i(0);
+    EpochSlot *s = retireSlot(&e, &i);
+    if (s == NULL) {
+        std::vector<std::pair<void*, reclaimer_t> > things;
+        std::vector<value_t> values;
+        values.push_back(v);
+        adopt(e, things, values);
+        return;
+    }
+    s->limboValues[i].push_back(v);
+    retired(s);
+}
+
+bool Epoch::advance() {
+    size_t e = globalEpoch.get();
+    size_t n = numEpochSlots.get();
+    for (size_t i = 0; i < n; ++i) {
+        size_t a = epochSlots[i].active;
+        if (a != 0 && a != e) {
+            return false;
+        }
+    }
+    if (!globalEpoch.cas(e, e + 1)) {
+        return false;
+    }
+    freeOrphans(e + 1);
+    freeIdleLimbo(e + 1);
+    return true;
+}
+
+void Epoch::synchronize() {
+    size_t target = globalEpoch.get() + 2;
+    while (globalEpoch.get() < target) {
+        if (!advance()) {
+            sched_yield();
+        }
+    }
+    EpochSlot *s = epochSlot();
+    if (s != NULL) {
+        SpinLockHolder lh(&s->limboLock);
+        for (int i = 0; i < 3; ++i) {
+            freeLimbo(s->limbo[i], s->limboValues[i]);
+        }
+        s->hasLimbo = 0;
+    }
+    freeOrphans(globalEpoch.get());
+}
+
+size_t Epoch::current() {
+    return globalEpoch.get();
+}
+
+/**
+ * Get the number of items per bucket a freshly resized table aims for.
+ */
+static inline size_t idealLoad(enum hash_table_layout l) {
+    return l == fingerprinted ? FingerprintBucket::SLOTS / 2 : 1;
+}
+
+void FingerprintBucket::insert(StoredValue *v, uint8_t fp) {
+    unsigned int empty = match(0);
+    if (empty != 0) {
+        int i = __builtin_ctz(empty);
+        v->next = NULL;
+        slots[i] = v;
+        fingerprints[i] = fp;
+    } else {
+        v->next = overflow;
+        overflow = v;
+    }
+}
+
+void FingerprintBucket::remove(StoredValue *v) {
+    for (int i = 0; i < SLOTS; ++i) {
+        if (fingerprints[i] != 0 && slots[i] == v) {
+            fingerprints[i] = 0;
+            slots[i] = NULL;
+            return;
+        }
+    }
+    StoredValue **p = &overflow;
+    while (*p != v) {
+        assert(*p);
+        p = &(*p)->next;
+    }
+    *p = v->next;
+}
+
+StoredValue *FingerprintBucket::pop() {
+    if (overflow) {
+        StoredValue *v = overflow;
+        overflow = v->next;
+        return v;
+    }
+    unsigned int used = ~match(0) & ((1 << SLOTS) - 1);
+    if (used == 0) {
+        return NULL;
+    }
+    int i = __builtin_ctz(used);
+    StoredValue *v = slots[i];
+    fingerprints[i] = 0;
+    slots[i] = NULL;
+    return v;
+}
+
+size_t FingerprintBucket::depth() const {
+    size_t rv = SLOTS - __builtin_popcount(match(0));
+    for (StoredValue *v = overflow; v; v = v->next) {
+        ++rv;
+    }
+    return rv;
+}
+
+void FingerprintBucket::visit(HashTableVisitor &visitor) const {
+    for (unsigned int m = ~match(0) & ((1 << SLOTS) - 1); m != 0; m &= m - 1) {
+        visitor.visit(slots[__builtin_ctz(m)]);
+    }
+    for (StoredValue *v = overflow; v; v = v->next) {
+        visitor.visit(v);
+    }
+}
+
+// How many times to try reading without the stripe lock.
+static const int optimisticReadTries = 4;
+
+// Bucket arrays at least this big may be backed by huge pages.
+static const size_t hugePageSize = 2 * 1024 * 1024;
+
 size_t HashTable::defaultNumBuckets = DEFAULT_HT_SIZE;
 size_t HashTable::defaultNumLocks = 193;
+size_t HashTable::defaultInlineValueSize = DEFAULT_INLINE_VALUE_SIZE;
 enum stored_value_type HashTable::defaultStoredValueType = featured;
+enum hash_table_layout HashTable::defaultLayout = chained;
+enum hash_function_type HashTable::defaultHashFunction = KeyHash::fastest();
+bool HashTable::hugePages = false;
+bool HashTable::keepExpired = false;
+
+LockStats StripeMutex::lockStats("hash_stripe");
 
 static inline size_t getDefault(size_t x, size_t d) {
     return x == 0 ? d : x;
@@ -55,6 +438,14 @@ void HashTable::setDefaultNumLocks(size_t to) {
     }
 }
 
+void HashTable::setDefaultInlineValueSize(size_t to) {
+    defaultInlineValueSize = to < MAX_INLINE_VALUE_SIZE ? to : MAX_INLINE_VALUE_SIZE;
+}
+
+size_t HashTable::getDefaultInlineValueSize() {
+    return defaultInlineValueSize;
+}
+
 size_t HashTable::clear(bool deactivate) {
     size_t rv = 0;
 
@@ -62,68 +453,355 @@ size_t HashTable::clear(bool deactivate) {
         // If not deactivating, assert we're already active.
         assert(active());
     }
-    MultiLockHolder(mutexes, n_locks);
+    if (mutexes == NULL) {
+        // Nothing was ever stored.
+        if (deactivate) {
+            active(false);
+        }
+        return rv;
+    }
+    MultiLockHolder mlh(mutexes, n_locks);
     if (deactivate) {
         active(false);
     }
-    for (int i = 0; i < (int)size; i++) {
-        while (values[i]) {
-            ++rv;
-            StoredValue *v = values[i];
-            values[i] = v->next;
-            delete v;
+    for (int l = 0; l < static_cast<int>(n_locks); l++) {
+        size_t sz(0);
+        void *table = stripeValues(l, &sz);
+        for (int i = stripeStart(l, sz); i < stripeStart(l + 1, sz); ++i) {
+            StoredValue *v;
+            while ((v = popAt(table, i)) != NULL) {
+                ++rv;
+                v->reduceCurrentSize(stats, v->size());
+                memSize.decr(v->size());
+                if (deactivate) {
+                    // Nobody can be reading a table that's going
+                    // away, and its slabs are freed all at once.
+                    v->~StoredValue();
+                } else {
+                    Epoch::retire(v, deleteStoredValue);
+                }
+            }
         }
     }
+    numItems.set(0);
+
+    return rv;
+}
+
+StoredValue *HashTable::popAt(void *table, size_t i) {
+    if (layout == fingerprinted) {
+        return static_cast<FingerprintBucket*>(table)[i].pop();
+    }
+    StoredValue **chains = static_cast<StoredValue**>(table);
+    StoredValue *v = chains[i];
+    if (v) {
+        chains[i] = v->next;
+    }
+    return v;
+}
+
+size_t HashTable::depthAt(void *table, size_t i) {
+    if (layout == fingerprinted) {
+        return static_cast<FingerprintBucket*>(table)[i].depth();
+    }
+    size_t rv = 0;
+    for (StoredValue *v = static_cast<StoredValue**>(table)[i]; v; v = v->next) {
+        ++rv;
+    }
+    return rv;
+}
 
+void *HashTable::allocateBuckets(size_t n) {
+    size_t bytes = n * bucketSize();
+    // Stripes start on cache lines as long as the buckets per stripe
+    // fill whole lines, and a fingerprinted bucket is one line.
+    size_t alignment = CACHE_LINE_SIZE;
+    bool huge = false;
+#ifdef MADV_HUGEPAGE
+    huge = getHugePages() && bytes >= hugePageSize;
+    if (huge) {
+        alignment = hugePageSize;
+    }
+#endif
+    void *rv = NULL;
+    if (posix_memalign(&rv, alignment, bytes) != 0) {
+        return NULL;
+    }
+#ifdef MADV_HUGEPAGE
+    if (huge) {
+        // Only a hint, and it has to be given before the pages are
+        // touched.
+        (void)madvise(rv, bytes - bytes % hugePageSize, MADV_HUGEPAGE);
+    }
+#endif
+    std::memset(rv, 0, bytes);
     return rv;
 }
 
+void HashTable::allocateValues() {
+    LockHolder lh(allocLock);
+    if (values == NULL) {
+        void *newValues = allocateBuckets(size);
+        if (newValues == NULL) {
+            throw std::bad_alloc();
+        }
+        // Readers that don't lock must never see it half initialized.
+        __sync_synchronize();
+        values = newValues;
+        stats.memOverhead.incr(size * bucketSize());
+    }
+}
+
+void HashTable::allocateMutexes() {
+    LockHolder lh(allocLock);
+    if (mutexes == NULL) {
+        void *mem = NULL;
+        if (posix_memalign(&mem, CACHE_LINE_SIZE,
+                           n_locks * sizeof(StripeMutex)) != 0) {
+            throw std::bad_alloc();
+        }
+        StripeMutex *newMutexes = static_cast<StripeMutex*>(mem);
+        for (size_t i = 0; i < n_locks; ++i) {
+            new (&newMutexes[i]) StripeMutex();
+        }
+        // Items can only be stored under a lock, so the slabs come
+        // along with the locks.
+        arena = new SlabArena(stats);
+        valFact.setArena(arena);
+        __sync_synchronize();
+        mutexes = newMutexes;
+        stats.memOverhead.incr(n_locks * sizeof(StripeMutex) + sizeof(SlabArena));
+    }
+}
+
+void HashTable::reserve(size_t items) {
+    LockHolder lh(allocLock);
+    if (values == NULL) {
+        size = reservedSize = sizeClass(items / idealLoad(layout));
+    }
+}
+
+bool HashTable::resize() {
+    size_t items = numItems.get();
+    size_t ideal = idealLoad(layout);
+    size_t floor = floorSize();
+    if (items > size * ideal * maxLoadFactor
+        || (size > floor && items * minLoadFactor < size * ideal)) {
+        return resize(std::max(sizeClass(items / ideal), floor));
+    }
+    return false;
+}
+
+bool HashTable::resize(size_t to) {
+    LockHolder rlh(resizeLock);
+    size_t newSize = stripeMultiple(std::max(to, static_cast<size_t>(1)));
+    // Sizes must stay representable as positive bucket numbers.
+    if (!active() || isResizing() || newSize == size
+        || newSize > static_cast<size_t>(INT_MAX)) {
+        return false;
+    }
+
+    LockHolder alh(allocLock);
+    if (values == NULL) {
+        // Nothing to move; just allocate at the new size later.
+        size = newSize;
+        return false;
+    }
+    alh.unlock();
+
+    void *newValues = allocateBuckets(newSize);
+    if (newValues == NULL) {
+        return false;
+    }
+
+    MultiLockHolder mlh(mutexes, n_locks);
+    oldValues = values;
+    oldSize = size;
+    values = newValues;
+    size = newSize;
+    migrated.set(0);
+    stats.memOverhead.incr(newSize * bucketSize());
+    ++numResizes;
+    return true;
+}
+
+bool HashTable::migrate(size_t stripes) {
+    LockHolder rlh(resizeLock);
+    if (!isResizing()) {
+        return false;
+    }
+
+    for (size_t n = 0; n < stripes && migrated.get() < n_locks; ++n) {
+        int l = static_cast<int>(migrated.get());
+        LockHolder lh(getMutexForLock(l));
+        for (int i = stripeStart(l, oldSize); i < stripeStart(l + 1, oldSize); ++i) {
+            StoredValue *v;
+            while ((v = popAt(oldValues, i)) != NULL) {
+                int b = bucket(v->getKeyBytes(), v->getKeyLen());
+                assert(mutexForBucket(b) == l);
+                linkAt(values, slotFor(b, size), v, b);
+            }
+        }
+        ++migrated;
+    }
+
+    if (migrated.get() < n_locks) {
+        return true;
+    }
+
+    MultiLockHolder mlh(mutexes, n_locks);
+    // Readers that don't lock may still be looking at the old array.
+    Epoch::retire(oldValues, free);
+    oldValues = NULL;
+    stats.memOverhead.decr(oldSize * bucketSize());
+    oldSize = 0;
+    return false;
+}
+
+void HashTable::read(const std::string &key, HashTableReader &reader) {
+    assert(active());
+    int bucket_num = bucket(key);
+    if (optimisticRead(key, bucket_num, reader)) {
+        return;
+    }
+    ++stats.lockedReads;
+    LockHolder lh(getMutex(bucket_num));
+    reader.copy(unlocked_find(key, bucket_num));
+}
+
+bool HashTable::optimisticRead(const std::string &key, int bucket_num,
+                               HashTableReader &reader) {
+    EpochHolder eh;
+    if (!eh.isEntered()) {
+        return false;
+    }
+
+    StripeMutex *m = mutexes;
+    if (m == NULL) {
+        // Nothing was ever stored.
+        reader.copy(NULL);
+        return true;
+    }
+    SeqMutex &mutex = m[mutexForBucket(bucket_num)];
+
+    for (int tries = 0; tries < optimisticReadTries; ++tries) {
+        size_t seq = mutex.sequence();
+        if (seq & 1) {
+            continue;
+        }
+        readBarrier();
+
+        // Make sure the bucket array and its size go together before
+        // indexing into it.
+        size_t i(0);
+        void *table = locate(bucket_num, &i);
+        readBarrier();
+        if (mutex.sequence() != seq) {
+            continue;
+        }
+
+        StoredValue *v = table ? findAt(table, i, key, bucket_num) : NULL;
+        if (v && v->isExpired(ep_current_time())) {
+            // Deleting it takes the lock.
+            return false;
+        }
+        reader.copy(v);
+        readBarrier();
+        if (mutex.sequence() == seq) {
+            return true;
+        }
+    }
+    return false;
+}
+
 void HashTable::visit(HashTableVisitor &visitor) {
-    if (!active()) {
+    visitStripes(visitor, 0, static_cast<int>(n_locks));
+}
+
+void HashTable::visitStripes(HashTableVisitor &visitor, int first, int last) {
+    if (!active() || values == NULL) {
         return;
     }
+    assert(0 <= first && first <= last && last <= static_cast<int>(n_locks));
     VisitorTracker vt(&visitors);
-    bool aborted = !visitor.shouldContinue();
+    Position pos(first, first, 0);
+    while (active() && pos.lock < last && visitor.shouldContinue()) {
+        pos = visitRange(visitor, pos, VISIT_CHUNK_SIZE, last);
+    }
+}
+
+HashTable::Position HashTable::pauseResumeVisit(HashTableVisitor &visitor,
+                                                const Position &start,
+                                                size_t maxBuckets) {
+    if (!active() || values == NULL) {
+        return endPosition();
+    }
+    VisitorTracker vt(&visitors);
+    Position rv(visitRange(visitor, start, maxBuckets, static_cast<int>(n_locks)));
+    if (rv.lock >= static_cast<int>(n_locks) || !active()) {
+        return endPosition();
+    }
+    return rv;
+}
+
+HashTable::Position HashTable::visitRange(HashTableVisitor &visitor,
+                                          const Position &start,
+                                          size_t maxBuckets, int last) {
+    int l = start.lock;
+    int i = start.bucket;
+    size_t seen = start.tableSize;
     size_t visited = 0;
-    for (int l = 0; active() && !aborted && l < static_cast<int>(n_locks); l++) {
-        LockHolder lh(getMutex(l));
-        for (int i = l; i < static_cast<int>(size); i+= n_locks) {
-            assert(l == mutexForBucket(i));
-            StoredValue *v = values[i];
-            while (v) {
-                visitor.visit(v);
-                v = v->next;
+    while (active() && l < last && visited < maxBuckets) {
+        LockHolder lh(getMutexForLock(l));
+        size_t sz(0);
+        void *table = stripeValues(l, &sz);
+        if (sz != seen) {
+            // Starting this stripe, or it moved since we paused.
+            i = stripeStart(l, sz);
+            seen = sz;
+        }
+        int end = stripeStart(l + 1, sz);
+        for (; i < end && visited < maxBuckets; ++i, ++visited) {
+            if (layout == fingerprinted) {
+                static_cast<FingerprintBucket*>(table)[i].visit(visitor);
+            } else {
+                StoredValue *v = static_cast<StoredValue**>(table)[i];
+                while (v) {
+                    visitor.visit(v);
+                    v = v->next;
+                }
             }
-            ++visited;
         }
         lh.unlock();
-        aborted = !visitor.shouldContinue();
+        if (i >= end) {
+            ++l;
+            seen = 0;
+        }
     }
-    assert(aborted || visited == size);
+    return Position(l, i, seen);
 }
 
 void HashTable::visitDepth(HashTableDepthVisitor &visitor) {
     if (!active()) {
         return;
     }
-    size_t visited = 0;
     VisitorTracker vt(&visitors);
 
-    for (int l = 0; l < static_cast<int>(n_locks); l++) {
-        LockHolder lh(getMutex(l));
-        for (int i = l; i < static_cast<int>(size); i+= n_locks) {
-            size_t depth = 0;
-            StoredValue *p = values[i];
-            while (p) {
-                depth++;
-                p = p->next;
-            }
-            visitor.visit(i, depth);
-            ++visited;
+    if (values == NULL) {
+        for (int i = 0; i < static_cast<int>(size); i++) {
+            visitor.visit(i, 0);
         }
+        return;
     }
 
-    assert(visited == size);
+    for (int l = 0; l < static_cast<int>(n_locks); l++) {
+        LockHolder lh(getMutexForLock(l));
+        size_t sz(0);
+        void *table = stripeValues(l, &sz);
+        for (int i = stripeStart(l, sz); i < stripeStart(l + 1, sz); ++i) {
+            visitor.visit(i, depthAt(table, i));
+        }
+    }
 }
 
 bool HashTable::setDefaultStorageValueType(const char *t) {
@@ -156,6 +834,69 @@ const char* HashTable::getDefaultStorageValueTypeStr() {
     return rv;
 }
 
+void HashTable::setHugePages(bool to) {
+    hugePages = to;
+}
+
+void HashTable::setKeepExpired(bool to) {
+    keepExpired = to;
+}
+
+bool HashTable::getHugePages() {
+    return hugePages;
+}
+
+bool HashTable::setDefaultLayout(const char *t) {
+    bool rv = false;
+    if (t && strcmp(t, "chained") == 0) {
+        setDefaultLayout(chained);
+        rv = true;
+    } else if (t && strcmp(t, "fingerprinted") == 0) {
+        setDefaultLayout(fingerprinted);
+        rv = true;
+    }
+    return rv;
+}
+
+void HashTable::setDefaultLayout(enum hash_table_layout l) {
+    defaultLayout = l;
+}
+
+enum hash_table_layout HashTable::getDefaultLayout() {
+    return defaultLayout;
+}
+
+const char* HashTable::getDefaultLayoutStr() {
+    const char *rv = "unknown";
+    switch(getDefaultLayout()) {
+    case chained: rv = "chained"; break;
+    case fingerprinted: rv = "fingerprinted"; break;
+    default: abort();
+    }
+    return rv;
+}
+
+bool HashTable::setDefaultHashFunction(const char *t) {
+    enum hash_function_type h;
+    bool rv = KeyHash::parse(t, &h);
+    if (rv) {
+        setDefaultHashFunction(h);
+    }
+    return rv;
+}
+
+void HashTable::setDefaultHashFunction(enum hash_function_type h) {
+    defaultHashFunction = h;
+}
+
+enum hash_function_type HashTable::getDefaultHashFunction() {
+    return defaultHashFunction;
+}
+
+const char* HashTable::getDefaultHashFunctionStr() {
+    return KeyHash::name(getDefaultHashFunction());
+}
+
 /**
  * Get the maximum amount of memory available for storing data.
  *
@@ -185,6 +926,16 @@ size_t StoredValue::getTotalCacheSize(EPStats &st) {
     return st.totalCacheSize.get();
 }
 
+size_t StoredValue::compressionThreshold = 0;
+
+void StoredValue::setCompressionThreshold(size_t to) {
+    compressionThreshold = to;
+}
+
+size_t StoredValue::getCompressionThreshold() {
+    return compressionThreshold;
+}
+
 void StoredValue::increaseCurrentSize(EPStats &st, size_t by, bool residentOnly) {
     if (!residentOnly) {
         st.totalCacheSize.incr(by);
@@ -193,13 +944,9 @@ void StoredValue::increaseCurrentSize(EPStats &st, size_t by, bool residentOnly)
 }
 
 void StoredValue::reduceCurrentSize(EPStats &st, size_t by, bool residentOnly) {
-    size_t val;
-
-    do {
-        val = st.currentSize.get();
-        assert(val >= by);
-    } while (!st.currentSize.cas(val, val - by));;
-
+    // No underflow check; reading the exact total means a read of
+    // every shard, which this path can't afford.
+    st.currentSize.decr(by);
     if (!residentOnly) {
         st.totalCacheSize.decr(by);
     }
@@ -209,6 +956,16 @@ void StoredValue::reduceCurrentSize(EPStats &st, size_t by, bool residentOnly) {
  * Is there enough space for this thing?
  */
 bool StoredValue::hasAvailableSpace(EPStats &st, const Item &item) {
-    return getCurrentSize(st) + sizeof(StoredValue) + item.getNKey() + item.getNBytes()
-        <= getMaxDataSize(st);
+    size_t needed = sizeof(StoredValue) + item.getNKey() + item.getNBytes();
+    size_t max = getMaxDataSize(st);
+    // Adding up every shard on each store would bring back the cache
+    // line traffic sharding is there to avoid, so that's only done
+    // when the approximate totals are too close to call.
+    size_t approx = st.currentSize.getApprox() + st.memOverhead.getApprox();
+    size_t slack = (approx >> ShardedCounter<size_t>::DRIFT_SHIFT)
+        * ShardedCounter<size_t>::SHARDS;
+    if (approx + slack + needed <= max) {
+        return true;
+    }
+    return getCurrentSize(st) + needed <= max;
 }
@@ -3,12 +3,19 @@
 #define STORED_VALUE_H 1
 
 #include <climits>
+#include <cstddef>
 #include <cstring>
 #include <algorithm>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "common.hh"
+#include "compression.hh"
+#include "hash-functions.hh"
 #include "item.hh"
 #include "locks.hh"
+#include "slab-allocator.hh"
 #include "stats.hh"
 
 extern "C" {
@@ -18,6 +25,7 @@ extern "C" {
 // Forward declaration for StoredValue
 class HashTable;
 class StoredValueFactory;
+class FingerprintBucket;
 
 // One of the following structs overlays at the end of StoredItem.
 // This is figured out dynamically and stored in one bit in
@@ -28,6 +36,9 @@ class StoredValueFactory;
  */
 struct small_data {
     uint8_t keylen;             //!< Length of the key.
+    uint8_t inlinecap;          //!< Room for a value after the key.
+    uint8_t inlinelen;          //!< Length of the value after the key.
+    uint8_t nru;                //!< Rounds of paging since last used.
     char    keybytes[1];        //!< The key itself.
 };
 
@@ -38,12 +49,24 @@ struct feature_data {
     uint64_t   cas;             //!< CAS identifier.
     rel_time_t exptime;         //!< Expiration time of this item.
     rel_time_t lock_expiry;     //!< getl lock expiration
-    bool       locked : 1;      //!< True if this item is locked
-    bool       resident : 1;    //!< True if this object's value is in memory.
+    uint32_t   vallen : 29;     //!< Length of the value when not resident
+                                //!< (under 512MB; bigger ones stay resident).
+    uint32_t   locked : 1;      //!< True if this item is locked
+    uint32_t   resident : 1;    //!< True if this object's value is in memory.
+    uint32_t   compressed : 1;  //!< True if the value is kept compressed.
     uint8_t    keylen;          //!< Length of the key
+    uint8_t    inlinecap;       //!< Room for a value after the key.
+    uint8_t    inlinelen;       //!< Length of the value after the key.
+    uint8_t    nru;             //!< Rounds of paging since last used.
     char       keybytes[1];     //!< The key itself.
 };
 
+// The length and the three flags share one 32 bit word; a failure
+// here means a bit was added and the word spilled over.
+typedef char feature_flags_fit_a_word[
+    offsetof(feature_data, keylen) - offsetof(feature_data, lock_expiry)
+    == sizeof(rel_time_t) + sizeof(uint32_t) ? 1 : -1];
+
 /**
  * Union of StoredValue data.
  */
@@ -53,11 +76,99 @@ union stored_value_bodies {
 };
 
 /**
- * Contents stored when swapped out.
+ * Epoch based reclamation for hash table readers that don't lock.
+ *
+ * A reader enters an epoch before it looks at a hash table without
+ * holding the stripe lock and leaves it when it's done.  Anything such
+ * a reader could reach (items, values and bucket arrays) is retired
+ * instead of freed once it's been unlinked, and is only freed after
+ * every reader that was around when it was retired has left.
+ *
+ * Each thread keeps its own lists of retired things, so retiring
+ * doesn't take a lock.  The epoch advances when every reader has
+ * caught up with it; anything retired two epochs ago is then safe.
  */
-union blobval {
-    uint32_t len;               //!< The length as an integer.
-    char     chlen[4];          //!< The length as a four byte integer
+class Epoch {
+public:
+
+    //! Frees a retired object.
+    typedef void (*reclaimer_t)(void *);
+
+    /**
+     * Enter the current epoch before reading without a lock.
+     *
+     * @return false if this thread can't take part (there are more
+     *         than MAX_THREADS of them); it must lock instead
+     */
+    static bool enter();
+
+    /**
+     * Leave the epoch entered with enter().
+     */
+    static void leave();
+
+    /**
+     * Free something once no reader can see it any more.
+     *
+     * It must already be unreachable for new readers.
+     */
+    static void retire(void *p, reclaimer_t fn);
+
+    /**
+     * Drop a reference to a value once no reader can see it any more.
+     */
+    static void retire(const value_t &v);
+
+    /**
+     * Try to move on to the next epoch.
+     *
+     * Moving on also frees what other threads retired two epochs
+     * ago, so threads that stop retiring don't hold on to it.
+     *
+     * @return true if the epoch advanced
+     */
+    static bool advance();
+
+    /**
+     * Wait until everything retired so far by this thread (and by
+     * threads that have exited) has been freed.
+     */
+    static void synchronize();
+
+    /**
+     * Get the current epoch.
+     */
+    static size_t current();
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(Epoch);
+};
+
+/**
+ * Holds an epoch for as long as it's in scope.
+ */
+class EpochHolder {
+public:
+    EpochHolder() : entered(Epoch::enter()) {}
+
+    ~EpochHolder() {
+        if (entered) {
+            Epoch::leave();
+        }
+    }
+
+    /**
+     * True if the epoch was entered (i.e. reading without a lock is
+     * allowed).
+     */
+    bool isEntered() const {
+        return entered;
+    }
+
+private:
+    bool entered;
+
+    DISALLOW_COPY_AND_ASSIGN(EpochHolder);
 };
 
 /**
@@ -66,9 +177,18 @@ union blobval {
 class StoredValue {
 public:
 
-    void operator delete(void* p) {
-        ::operator delete(p);
-     }
+    //! Values this long don't fit in vallen, so they aren't ejected.
+    static const size_t MAX_EJECTED_LENGTH = 1 << 29;
+
+    /**
+     * Destroy a StoredValue made by a StoredValueFactory and give its
+     * memory back to the slab it came from.
+     */
+    static void destroy(StoredValue *v) {
+        size_t n = v->nodeSize();
+        v->~StoredValue();
+        SlabArena::release(v, n);
+    }
 
     /**
      * Mark this item as needing to be persisted.
@@ -118,6 +238,44 @@ public:
         return !isDirty();
     }
 
+    /**
+     * Note that this item was just read.
+     *
+     * The recency byte isn't part of any bitfield, so this is safe to
+     * call without the bucket lock (e.g. from a HashTableReader); a
+     * lost race only costs a little accuracy.
+     */
+    void referenced() {
+        uint8_t *nru = _isSmall ? &extra.small.nru : &extra.feature.nru;
+        // Don't dirty the cache line if it's already hot.
+        if (*nru != 0) {
+            *nru = 0;
+        }
+    }
+
+    /**
+     * Get the number of paging rounds this item has gone through
+     * since it was last read (at most MAX_NRU_VALUE).
+     */
+    uint8_t getNRUValue() const {
+        return _isSmall ? extra.small.nru : extra.feature.nru;
+    }
+
+    /**
+     * Count another paging round that found this item unused.
+     */
+    void incrNRUValue() {
+        uint8_t *nru = _isSmall ? &extra.small.nru : &extra.feature.nru;
+        if (*nru < MAX_NRU_VALUE) {
+            ++*nru;
+        }
+    }
+
+    //! Items this many paging rounds away from their last read are cold.
+    static const uint8_t MAX_NRU_VALUE = 3;
+    //! Where new items start: not yet cold, but not proven hot either.
+    static const uint8_t INITIAL_NRU_VALUE = 2;
+
     /**
      * Get the pointer to the beginning of the key.
      */
@@ -160,11 +318,50 @@ public:
 
     /**
      * Get this item's value.
+     *
+     * A value kept inline is copied out into a new Blob, and one kept
+     * compressed is decompressed into a new Blob.  There is no value
+     * while the item isn't resident.
+     *
+     * @param stats where to count a decompression
+     */
+    value_t getValue(EPStats &stats) const {
+        if (isInline()) {
+            return value_t(Blob::New(getInlineBytes(), getInlineLen()));
+        } else if (isCompressed()) {
+            return ValueCompressor::decompress(value, stats);
+        }
+        return value;
+    }
+
+    /**
+     * Get this item's value the way it's stored.
+     *
+     * This is what readers that don't hold the item's lock copy out;
+     * see isCompressed().
      */
-    value_t getValue() const {
+    value_t getStoredValue() const {
+        if (isInline()) {
+            return value_t(Blob::New(getInlineBytes(), getInlineLen()));
+        }
         return value;
     }
 
+    /**
+     * True if this item's value is kept compressed.
+     */
+    bool isCompressed() const {
+        return !_isSmall && extra.feature.compressed;
+    }
+
+    /**
+     * True if this item's value lives in the StoredValue itself
+     * rather than in a shared Blob.
+     */
+    bool isInline() const {
+        return !value && isResident();
+    }
+
     /**
      * Get the expiration time of this item.
      *
@@ -178,6 +375,14 @@ public:
         }
     }
 
+    /**
+     * True if this item has expired as of the given time.
+     */
+    bool isExpired(rel_time_t asOf) const {
+        rel_time_t exp = getExptime();
+        return exp != 0 && exp < asOf;
+    }
+
     /**
      * Get the client-defined flags of this item.
      *
@@ -195,11 +400,11 @@ public:
      * @param newExp the new expiration
      * @param theCas thenew CAS identifier
      */
-    void setValue(value_t v,
+    void setValue(const value_t &v,
                   uint32_t newFlags, rel_time_t newExp, uint64_t theCas,
                   EPStats &stats) {
         reduceCurrentSize(stats, size());
-        value = v;
+        storeValue(v, stats);
         setResident();
         flags = newFlags;
         if (!_isSmall) {
@@ -210,45 +415,56 @@ public:
         increaseCurrentSize(stats, size());
     }
 
-    size_t valLength() {
-        if (isResident()) {
+    /**
+     * Get the length of this item's value, whether or not it's
+     * resident.
+     */
+    size_t valLength() const {
+        if (isInline()) {
+            return getInlineLen();
+        } else if (isCompressed()) {
+            return ValueCompressor::rawLength(value);
+        } else if (isResident()) {
             return value->length();
         } else {
-            blobval uval;
-            assert(value->length() == sizeof(uval));
-            std::memcpy(uval.chlen, value->getData(), sizeof(uval));
-            return static_cast<size_t>(uval.len);
+            return extra.feature.vallen;
         }
     }
 
+    /**
+     * Drop this item's value from memory, keeping only its length.
+     *
+     * Only clean, featured items can be ejected, and only if their
+     * length fits in vallen.
+     *
+     * @return true if the value was ejected
+     */
     bool ejectValue(EPStats &stats) {
-        if (isResident() && isClean() && !_isSmall) {
+        if (isResident() && isClean() && !_isSmall
+            && valLength() < MAX_EJECTED_LENGTH) {
             size_t oldsize = size();
-            blobval uval;
-            uval.len = valLength();
-            shared_ptr<Blob> sp(Blob::New(uval.chlen, sizeof(uval)));
+            size_t len = valLength();
+            extra.feature.vallen = static_cast<uint32_t>(len);
             extra.feature.resident = false;
-            value = sp;
+            extra.feature.compressed = false;
+            Epoch::retire(value);
+            value.reset();
             size_t newsize = size();
 
-            // ejecting the value may increase the object size....
-            if (oldsize < newsize) {
-                increaseCurrentSize(stats, newsize - oldsize, true);
-            } else if (newsize < oldsize) {
-                reduceCurrentSize(stats, oldsize - newsize, true);
-            }
+            assert(newsize <= oldsize);
+            reduceCurrentSize(stats, oldsize - newsize, true);
             return true;
         }
         return false;
     }
 
-    bool restoreValue(value_t v, EPStats &stats) {
+    bool restoreValue(const value_t &v, EPStats &stats) {
         if (!isResident()) {
             size_t oldsize = size();
             assert(v);
             assert(v->length() == valLength());
             extra.feature.resident = true;
-            value = v;
+            storeValue(v, stats);
 
             size_t newsize = size();
             if (oldsize < newsize) {
@@ -353,7 +569,7 @@ public:
      * @return the amount of memory used by this item.
      */
     size_t size() {
-        return sizeOf(_isSmall) + getKeyLen() + value->length();
+        return nodeSize() + (value ? value->length() : 0);
     }
 
     /**
@@ -374,10 +590,21 @@ public:
         }
     }
 
+    /**
+     * Return true if this item is locked as of the given timestamp,
+     * without clearing an expired lock.
+     *
+     * This is what readers that don't hold the item's lock use.
+     */
+    bool peekLocked(rel_time_t curtime) const {
+        return !_isSmall && extra.feature.locked
+            && curtime <= extra.feature.lock_expiry;
+    }
+
     /**
      * True if this value is resident in memory currently.
      */
-    bool isResident() {
+    bool isResident() const {
         if (_isSmall) {
             return true;
         } else {
@@ -397,9 +624,10 @@ public:
      * @return the size in bytes required (minus key) for a StoredValue.
      */
     static size_t sizeOf(bool small) {
-        // Subtract one because the length of the string is computed on demand.
-        size_t base = sizeof(StoredValue) - sizeof(union stored_value_bodies) - 1;
-        return base + (small ? sizeof(struct small_data) : sizeof(struct feature_data));
+        // The key starts at keybytes; its length is computed on demand.
+        size_t base = sizeof(StoredValue) - sizeof(union stored_value_bodies);
+        return base + (small ? offsetof(struct small_data, keybytes)
+                       : offsetof(struct feature_data, keybytes));
     }
 
     /**
@@ -425,24 +653,45 @@ public:
      */
     static size_t getTotalCacheSize(EPStats&);
 
+    /**
+     * Set the size from which values are kept compressed (0 to never
+     * compress).
+     */
+    static void setCompressionThreshold(size_t to);
+
+    /**
+     * Get the size from which values are kept compressed.
+     */
+    static size_t getCompressionThreshold();
+
 private:
 
     StoredValue(const Item &itm, StoredValue *n, EPStats &stats,
-                bool setDirty = true, bool small = false) :
-        value(itm.getValue()), next(n), id(itm.getId()),
+                bool setDirty = true, bool small = false,
+                uint8_t inlineCap = 0) :
+        next(n), id(itm.getId()),
         dirtiness(0), _isSmall(small), flags(itm.getFlags())
     {
 
         if (_isSmall) {
             extra.small.keylen = itm.getKey().length();
+            extra.small.inlinecap = inlineCap;
+            extra.small.inlinelen = 0;
+            extra.small.nru = INITIAL_NRU_VALUE;
         } else {
             extra.feature.cas = itm.getCas();
             extra.feature.exptime = itm.getExptime();
+            extra.feature.vallen = 0;
             extra.feature.locked = false;
             extra.feature.resident = true;
+            extra.feature.compressed = false;
             extra.feature.lock_expiry = 0;
             extra.feature.keylen = itm.getKey().length();
+            extra.feature.inlinecap = inlineCap;
+            extra.feature.inlinelen = 0;
+            extra.feature.nru = INITIAL_NRU_VALUE;
         }
+        storeValue(itm.getValue(), stats);
 
         if (setDirty) {
             markDirty();
@@ -459,10 +708,69 @@ private:
         }
     }
 
+    // The number of bytes allocated for this StoredValue.
+    size_t nodeSize() const {
+        return sizeOf(_isSmall) + getKeyLen() + getInlineCap();
+    }
+
+    uint8_t getInlineCap() const {
+        return _isSmall ? extra.small.inlinecap : extra.feature.inlinecap;
+    }
+
+    uint8_t getInlineLen() const {
+        return _isSmall ? extra.small.inlinelen : extra.feature.inlinelen;
+    }
+
+    // The inline value follows the key.
+    const char *getInlineBytes() const {
+        return getKeyBytes() + getKeyLen();
+    }
+
+    /*
+     * Keep the value inline if it fits, otherwise share the Blob, or
+     * a compressed copy of it if the value is big enough and
+     * compresses well.
+     *
+     * Inline bytes are overwritten in place; unlocked readers copy
+     * them out and throw the copy away if the stripe's sequence
+     * moved on in the meantime.
+     */
+    void storeValue(const value_t &v, EPStats &stats) {
+        if (v->length() <= getInlineCap()) {
+            char *dst = const_cast<char*>(getInlineBytes());
+            std::memcpy(dst, v->getData(), v->length());
+            if (_isSmall) {
+                extra.small.inlinelen = static_cast<uint8_t>(v->length());
+            } else {
+                extra.feature.inlinelen = static_cast<uint8_t>(v->length());
+                extra.feature.compressed = false;
+            }
+            Epoch::retire(value);
+            value.reset();
+        } else {
+            value_t c;
+            if (!_isSmall && compressionThreshold > 0
+                && v->length() >= compressionThreshold) {
+                c = ValueCompressor::compress(v, stats);
+            }
+            Epoch::retire(value);
+            if (!_isSmall) {
+                extra.feature.compressed = static_cast<bool>(c);
+            }
+            value = c ? c : v;
+        }
+    }
+
+    // StoredValues live in slabs; use destroy() instead.
+    void operator delete(void *);
+
+    static size_t compressionThreshold;
+
     friend class HashTable;
     friend class StoredValueFactory;
+    friend class FingerprintBucket;
 
-    value_t      value;          // 16 bytes
+    value_t      value;          // 8 bytes
     StoredValue *next;           // 8 bytes
     int64_t      id;             // 8 bytes
     uint32_t     dirtiness : 30; // 30 bits -+
@@ -519,6 +827,26 @@ public:
     virtual bool shouldContinue() { return true; }
 };
 
+/**
+ * Copies what it needs out of an item found by HashTable::read().
+ *
+ * Without the stripe lock, copy() may see an item in the middle of
+ * an update and may be called more than once for one read.  It must
+ * only copy fields, never act on them; what the last call copied is
+ * the result.
+ */
+class HashTableReader {
+public:
+    virtual ~HashTableReader() {}
+
+    /**
+     * Copy out the item found.
+     *
+     * @param v the item, or NULL if the key isn't in the table
+     */
+    virtual void copy(StoredValue *v) = 0;
+};
+
 /**
  * Hash table visitor that reports the depth of each hashtable bucket.
  */
@@ -581,6 +909,120 @@ private:
     Atomic<size_t> *counter;
 };
 
+/**
+ * A cache line of hash table slots.
+ *
+ * Each slot keeps a one byte fingerprint of its key's hash next to
+ * the pointer, so a lookup compares all the fingerprints at once and
+ * only dereferences the StoredValues that match.  Items that don't
+ * fit in the slots are chained off of the overflow pointer.
+ */
+class FingerprintBucket {
+public:
+
+    //! Number of fingerprinted slots in a bucket.
+    static const int SLOTS = 6;
+
+    /**
+     * Get the fingerprint for the given bucket number.
+     *
+     * The fingerprint is the top byte of the (31 bit) bucket number,
+     * which is independent of the slot a key lands in for any table
+     * smaller than 2^23 buckets.  Zero marks an empty slot and is
+     * never returned.
+     */
+    static uint8_t fingerprint(int bucket_num) {
+        uint8_t rv = static_cast<uint8_t>(bucket_num >> 23);
+        return rv == 0 ? 1 : rv;
+    }
+
+    /**
+     * Get a bitmask of the slots holding the given fingerprint.
+     */
+    unsigned int match(uint8_t fp) const {
+#ifdef __SSE2__
+        __m128i needle = _mm_set1_epi8(static_cast<char>(fp));
+        __m128i fps = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(fingerprints));
+        return static_cast<unsigned int>(_mm_movemask_epi8(_mm_cmpeq_epi8(needle, fps)))
+            & ((1 << SLOTS) - 1);
+#else
+        unsigned int rv = 0;
+        for (int i = 0; i < SLOTS; ++i) {
+            if (fingerprints[i] == fp) {
+                rv |= 1 << i;
+            }
+        }
+        return rv;
+#endif
+    }
+
+    /**
+     * Find the item with the given key and fingerprint.
+     */
+    StoredValue *find(const std::string &key, uint8_t fp) const {
+        for (unsigned int m = match(fp); m != 0; m &= m - 1) {
+            StoredValue *v = slots[__builtin_ctz(m)];
+            // A reader without the lock can see a slot being emptied.
+            if (v && v->hasKey(key)) {
+                return v;
+            }
+        }
+        for (StoredValue *v = overflow; v; v = v->next) {
+            if (v->hasKey(key)) {
+                return v;
+            }
+        }
+        return NULL;
+    }
+
+    /**
+     * Check whether the given item with the given fingerprint is here.
+     */
+    bool contains(const StoredValue *v, uint8_t fp) const {
+        for (unsigned int m = match(fp); m != 0; m &= m - 1) {
+            if (slots[__builtin_ctz(m)] == v) {
+                return true;
+            }
+        }
+        for (StoredValue *o = overflow; o; o = o->next) {
+            if (o == v) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /**
+     * Add an item with the given fingerprint.
+     */
+    void insert(StoredValue *v, uint8_t fp);
+
+    /**
+     * Remove the given item.
+     */
+    void remove(StoredValue *v);
+
+    /**
+     * Remove and return any item (NULL if empty).
+     */
+    StoredValue *pop();
+
+    /**
+     * Get the number of items in this bucket.
+     */
+    size_t depth() const;
+
+    /**
+     * Pass every item in this bucket to the given visitor.
+     */
+    void visit(HashTableVisitor &visitor) const;
+
+private:
+    uint8_t      fingerprints[8];
+    StoredValue *slots[SLOTS];
+    StoredValue *overflow;
+};
+
 /**
  * Types of stored values.
  */
@@ -597,8 +1039,19 @@ public:
 
     /**
      * Create a new StoredValueFactory of the given type.
+     *
+     * @param s the stats to account the StoredValues in
+     * @param t the type of StoredValues to create
+     * @param inl values up to this size are kept inline
      */
-    StoredValueFactory(EPStats &s, enum stored_value_type t = featured) : stats(&s), type(t) {}
+    StoredValueFactory(EPStats &s, enum stored_value_type t = featured,
+                       size_t inl = 0) :
+        stats(&s), arena(NULL), type(t), inlineValueSize(inl) {}
+
+    /**
+     * Allocate StoredValues from the given slabs from now on.
+     */
+    void setArena(SlabArena *a) { arena = a; }
 
     /**
      * Create a new StoredValue with the given item.
@@ -606,15 +1059,17 @@ public:
      * @param itm the item the StoredValue should contain
      * @param n the the top of the hash bucket into which this will be inserted
      * @param setDirty if true, mark this item as dirty after creating it
+     * @param resident false if the value is about to be ejected, so
+     *                 there's no point making room for it inline
      */
     StoredValue *operator ()(const Item &itm, StoredValue *n,
-                             bool setDirty = true) {
+                             bool setDirty = true, bool resident = true) {
         switch(type) {
         case small:
-            return newStoredValue(itm, n, setDirty, 1);
+            return newStoredValue(itm, n, setDirty, 1, resident);
             break;
         case featured:
-            return newStoredValue(itm, n, setDirty, 0);
+            return newStoredValue(itm, n, setDirty, 0, resident);
             break;
         default:
             abort();
@@ -624,15 +1079,25 @@ public:
 private:
 
     StoredValue* newStoredValue(const Item &itm, StoredValue *n, bool setDirty,
-                                bool small) {
+                                bool small, bool resident) {
         size_t base = StoredValue::sizeOf(small);
 
         std::string key = itm.getKey();
         assert(key.length() < 256);
         size_t len = key.length() + base;
 
-        StoredValue *t = new (::operator new(len))
-            StoredValue(itm, n, *stats, setDirty, small);
+        size_t inlineCap = 0;
+        size_t nbytes = itm.getNBytes();
+        if (resident && inlineValueSize > 0 && nbytes <= inlineValueSize) {
+            // Whatever the size class rounds up to is room to grow.
+            inlineCap = std::min(SlabArena::chunkSize(len + nbytes) - len,
+                                 static_cast<size_t>(UINT8_MAX));
+            len += inlineCap;
+        }
+
+        StoredValue *t = new (arena->allocate(len))
+            StoredValue(itm, n, *stats, setDirty, small,
+                        static_cast<uint8_t>(inlineCap));
         if (small) {
             std::memcpy(t->extra.small.keybytes, key.data(), key.length());
         } else {
@@ -643,8 +1108,50 @@ private:
     }
 
     EPStats                *stats;
+    SlabArena              *arena;
     enum stored_value_type  type;
+    size_t                  inlineValueSize;
+
+};
+
+/**
+ * A hash table lock stripe.
+ *
+ * The stripes of all hash tables are profiled together.
+ */
+class StripeMutex : public PaddedSeqMutex {
+public:
+    StripeMutex() : PaddedSeqMutex() {}
+
+    LockStats *getLockStats() { return &lockStats; }
+
+    static LockStats lockStats;
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(StripeMutex);
+};
 
+/**
+ * Where an item is in a hash table: its bucket number and address.
+ *
+ * It stays good across resizes for as long as the item is there; see
+ * HashTable::unlocked_find(const StoredRef&).
+ */
+class StoredRef {
+public:
+    StoredRef() : value(NULL), bucket(0) {}
+    StoredRef(StoredValue *v, int b) : value(v), bucket(b) {}
+
+    StoredValue *value;
+    int          bucket;
+};
+
+/**
+ * Layouts of hash table buckets.
+ */
+enum hash_table_layout {
+    chained,                    //!< Each bucket is a chain of StoredValues.
+    fingerprinted               //!< Each bucket is a FingerprintBucket.
 };
 
 /**
@@ -656,38 +1163,78 @@ public:
     /**
      * Create a HashTable.
      *
+     * The number of buckets is only the initial (and minimum) size;
+     * the table grows and shrinks with its load factor as it's
+     * resized (see resize() and migrate()).  Neither the buckets nor
+     * the locks are allocated until they're first needed, so an
+     * unused table costs little more than sizeof(HashTable).
+     *
+     * The bucket layout and hash function are the defaults at
+     * construction time (see setDefaultLayout() and
+     * setDefaultHashFunction()).
+     *
      * @param s the number of hash table buckets
      * @param l the number of locks in the hash table
      * @param t the type of StoredValues this hash table will contain
      */
     HashTable(EPStats &st, size_t s = 0, size_t l = 0,
               enum stored_value_type t = featured) : stats(st), valFact(st, t) {
-        size = HashTable::getNumBuckets(s);
         n_locks = HashTable::getNumLocks(l);
-        valFact = StoredValueFactory(st, getDefaultStorageValueType());
-        assert(size > 0);
         assert(n_locks > 0);
+        size = minSize = stripeMultiple(HashTable::getNumBuckets(s));
+        reservedSize = 0;
+        valFact = StoredValueFactory(st, getDefaultStorageValueType(),
+                                     getDefaultInlineValueSize());
+        layout = getDefaultLayout();
+        hashFunction = KeyHash::implementation(getDefaultHashFunction());
+        assert(size > 0);
         assert(visitors == 0);
-        values = static_cast<StoredValue**>(calloc(size, sizeof(StoredValue*)));
-        mutexes = new Mutex[n_locks];
+        values = NULL;
+        oldValues = NULL;
+        oldSize = 0;
+        mutexes = NULL;
+        arena = NULL;
         activeState = true;
     }
 
     ~HashTable() {
-        clear(true);
+        size_t dropped = clear(true);
         // Wait for any outstanding visitors to finish.
         while (visitors > 0) {
             usleep(100);
         }
-        delete []mutexes;
+        SlabArena *a = arena;
+        arena = NULL;
+        size_t overhead = memorySize() - sizeof(HashTable);
+        if (a) {
+            // Frees the slabs, or leaves that to the last retired
+            // StoredValue to be reclaimed.
+            overhead += sizeof(SlabArena) + a->destroy(dropped);
+        }
+        stats.memOverhead.decr(overhead);
+        if (mutexes) {
+            for (size_t i = 0; i < n_locks; ++i) {
+                mutexes[i].~StripeMutex();
+            }
+            free(mutexes);
+        }
         free(values);
         values = NULL;
+        free(oldValues);
+        oldValues = NULL;
     }
 
+    /**
+     * Get the amount of memory used by this hash table.
+     *
+     * Everything but sizeof(HashTable) is allocated on demand and
+     * charged to the memory overhead stat by the hash table itself.
+     */
     size_t memorySize() {
         return sizeof(HashTable)
-            + (size * sizeof(StoredValue*))
-            + (n_locks * sizeof(Mutex));
+            + ((values ? size : 0) + oldSize) * bucketSize()
+            + (mutexes ? n_locks * sizeof(StripeMutex) : 0)
+            + (arena ? sizeof(SlabArena) + arena->getOverhead() : 0);
     }
 
     /**
@@ -700,6 +1247,105 @@ public:
      */
     size_t getNumLocks(void) { return n_locks; }
 
+    /**
+     * Get the bucket layout of this hash table.
+     */
+    enum hash_table_layout getLayout(void) { return layout; }
+
+    /**
+     * Get the number of items stored in this hash table.
+     */
+    size_t getNumItems(void) { return numItems.get(); }
+
+    /**
+     * Get the memory taken by the items in this hash table, as they
+     * count towards the current size (see StoredValue::size()).
+     */
+    size_t getMemSize(void) { return memSize.get(); }
+
+    /**
+     * Drop an item's value from memory (see StoredValue::ejectValue()),
+     * assuming you already locked its bucket.
+     *
+     * @return true if the value was ejected
+     */
+    bool unlocked_ejectValue(StoredValue *v) {
+        size_t oldsize = v->size();
+        bool rv = v->ejectValue(stats);
+        chargeMemSize(oldsize, v->size());
+        return rv;
+    }
+
+    /**
+     * Put a value fetched from disk back into an item (see
+     * StoredValue::restoreValue()), assuming you already locked its
+     * bucket.
+     *
+     * @return true if the value was restored
+     */
+    bool unlocked_restoreValue(StoredValue *v, const value_t &val) {
+        size_t oldsize = v->size();
+        bool rv = v->restoreValue(val, stats);
+        chargeMemSize(oldsize, v->size());
+        return rv;
+    }
+
+    /**
+     * Get the number of times this hash table has been resized.
+     */
+    size_t getNumResizes(void) { return numResizes.get(); }
+
+    /**
+     * True while buckets are being migrated to a new bucket array.
+     */
+    bool isResizing(void) { return oldValues != NULL; }
+
+    /**
+     * Begin resizing this hash table if its load factor is out of
+     * range.
+     *
+     * This only allocates the new bucket array; the items move over
+     * a stripe at a time through migrate().
+     *
+     * @return true if a resize was started
+     */
+    bool resize();
+
+    /**
+     * Set the initial capacity of a hash table that is expected to
+     * hold the given number of items.
+     *
+     * Until warmup is complete, resize() won't shrink the table
+     * below this, so it isn't shrunk while the items are still
+     * being loaded.  This has no effect once the buckets have been
+     * allocated.
+     *
+     * @param items the number of items expected
+     */
+    void reserve(size_t items);
+
+    /**
+     * Begin resizing this hash table to the given number of buckets.
+     *
+     * The size is rounded up to a multiple of the number of locks.
+     *
+     * @param to the desired number of buckets
+     * @return true if a resize was started
+     */
+    bool resize(size_t to);
+
+    /**
+     * Move the contents of some lock stripes into the new bucket
+     * array during a resize.
+     *
+     * Only one stripe lock is held at a time, so operations on the
+     * remaining stripes proceed while a stripe migrates.
+     *
+     * @param stripes the maximum number of stripes to migrate
+     * @return true if the resize is still in progress
+     */
+    bool migrate(size_t stripes);
+
     /**
      * Clear the hash table.
      *
@@ -726,9 +1372,10 @@ public:
      * Set a new Item into this hashtable.
      *
      * @param the Item to store
+     * @param ref if given, set to where the item is stored
      * @return a result indicating the status of the store
      */
-    mutation_type_t set(const Item &val) {
+    mutation_type_t set(const Item &val, StoredRef *ref = NULL) {
         assert(active());
         mutation_type_t rv = NOT_FOUND;
         int bucket_num = bucket(val.getKey());
@@ -752,9 +1399,14 @@ public:
             }
             itm.setCas();
             rv = v->isClean() ? WAS_CLEAN : WAS_DIRTY;
+            size_t oldsize = v->size();
             v->setValue(itm.getValue(),
                         itm.getFlags(), itm.getExptime(),
                         itm.getCas(), stats);
+            chargeMemSize(oldsize, v->size());
+            if (ref) {
+                *ref = StoredRef(v, bucket_num);
+            }
         } else {
             if (itm.getCas() != 0) {
                 return NOT_FOUND;
@@ -766,8 +1418,12 @@ public:
             }
 
             itm.setCas();
-            v = valFact(itm, values[bucket_num]);
-            values[bucket_num] = v;
+            v = valFact(itm, NULL);
+            memSize.incr(v->size());
+            link(v, bucket_num);
+            if (ref) {
+                *ref = StoredRef(v, bucket_num);
+            }
         }
         return rv;
     }
@@ -794,11 +1450,12 @@ public:
                 ++stats.oom_errors;
                 return NOMEM;
             }
-            v = valFact(itm, values[bucket_num], isDirty);
+            v = valFact(itm, NULL, isDirty, storeVal);
             if (!storeVal) {
                 v->ejectValue(stats);
             }
-            values[bucket_num] = v;
+            memSize.incr(v->size());
+            link(v, bucket_num);
         }
 
         return true;
@@ -808,43 +1465,115 @@ public:
      * Find an item within a specific bucket assuming you already
      * locked the bucket.
      *
+     * An expired item is deleted rather than returned, and its key
+     * kept for takeExpired() if setKeepExpired() asked for that.
+     *
      * @param key the key of the item to find
      * @param bucket_Num the bucket number
      *
      * @return a pointer to a StoredValue -- NULL if not found
      */
     StoredValue *unlocked_find(const std::string &key, int bucket_num) {
-        StoredValue *v = values[bucket_num];
-        while (v) {
-            if (v->hasKey(key)) {
-                // check the expiry time
-                if (v->getExptime() != 0 && v->getExptime() < ep_current_time()) {
-                    (void)unlocked_del(key, bucket_num);
-                    return NULL;
-                }
-                return v;
+        StoredValue *v = findInBucket(key, bucket_num);
+        // check the expiry time
+        if (v && v->isExpired(ep_current_time())) {
+            if (unlocked_del(key, bucket_num) && keepExpired) {
+                SpinLockHolder lh(&expiredLock);
+                expiredKeys.push_back(key);
             }
+            return NULL;
+        }
+        return v;
+    }
+
+    /**
+     * Take the keys of the items found expired and deleted by
+     * unlocked_find() since the last call.
+     *
+     * Whoever persists this table has to delete them on disk, too.
+     */
+    void takeExpired(std::vector<std::string> &out) {
+        SpinLockHolder lh(&expiredLock);
+        out.swap(expiredKeys);
+        expiredKeys.clear();
+    }
+
+    /**
+     * Find an item by where it was stored, assuming you already
+     * locked its bucket.
+     *
+     * Only its bucket is searched, by address, so the key isn't
+     * hashed or compared.  Another item that has since been given
+     * the same address in the same bucket is found in its place.
+     * Unlike finding by key, expired items are returned.
+     *
+     * @param ref where the item was stored
+     * @return the item, or NULL if it has been deleted since
+     */
+    StoredValue *unlocked_find(const StoredRef &ref) {
+        assert(active());
+        size_t i(0);
+        void *table = locate(ref.bucket, &i);
+        if (table == NULL) {
+            return NULL;
+        }
+        if (layout == fingerprinted) {
+            bool there = static_cast<FingerprintBucket*>(table)[i].contains(ref.value,
+                             FingerprintBucket::fingerprint(ref.bucket));
+            return there ? ref.value : NULL;
+        }
+        StoredValue *v = static_cast<StoredValue**>(table)[i];
+        while (v && v != ref.value) {
             v = v->next;
         }
-        return NULL;
+        return v;
     }
 
+    /**
+     * Delete an item if it has expired, assuming you already locked
+     * the bucket.
+     *
+     * @param key the key of the item
+     * @param bucket_num the bucket number
+     * @param asOf the time to check expiry against
+     *
+     * @return true if the item had expired and was deleted
+     */
+    bool unlocked_delExpired(const std::string &key, int bucket_num,
+                             rel_time_t asOf) {
+        StoredValue *v = findInBucket(key, bucket_num);
+        return v && v->isExpired(asOf) && unlocked_del(key, bucket_num);
+    }
+
+    /**
+     * Look up a key and hand what's found to the given reader.
+     *
+     * This doesn't take the stripe lock unless it has to.  The lookup
+     * runs inside an epoch (see Epoch) and is checked against the
+     * stripe's sequence number, and is retried if a writer held or
+     * took the lock in the meantime.  After a few failed tries, or to
+     * clean up an expired item, it's repeated under the lock.
+     *
+     * @param key the key to look up
+     * @param reader receives the item (or NULL)
+     */
+    void read(const std::string &key, HashTableReader &reader);
+
     /**
      * Get the bucket number for the given C string key.
      *
+     * The bucket number is the low 31 bits of the key's hash.  It
+     * doesn't change when the table is resized; it maps to a lock
+     * stripe directly, to a slot in the bucket array once that
+     * stripe's lock is held, and to the key's fingerprint.
+     *
      * @param str the string
      * @param len the number of bytes to use for hash computation
      * @return the bucket number for this key
      */
     inline int bucket(const char *str, const size_t len) {
         assert(active());
-        int h=5381;
-
-        for(size_t i=0; i < len; i++) {
-            h = ((h << 5) + h) ^ str[i];
-        }
-
-        return abs(h % (int)size);
+        return static_cast<int>(hashFunction(str, len) & INT_MAX);
     }
 
     /**
@@ -867,6 +1596,9 @@ public:
         assert(active());
         assert(lock_num < (int)n_locks);
         assert(lock_num >= 0);
+        if (mutexes == NULL) {
+            allocateMutexes();
+        }
         return mutexes[lock_num];
     }
 
@@ -880,6 +1612,41 @@ public:
         return getMutexForLock(mutexForBucket(bucket_num));
     }
 
+    /**
+     * Get the number of the lock covering a bucket.
+     *
+     * Buckets that share a lock number can be looked at under one
+     * getMutexForLock().
+     *
+     * @param bucket_num the bucket number
+     * @return the lock number
+     */
+    inline int getLockNum(int bucket_num) {
+        return mutexForBucket(bucket_num);
+    }
+
+    /**
+     * Start loading a bucket into the cache ahead of looking at it.
+     *
+     * This needs no lock.  A resize racing with it can only make it
+     * load the wrong line.
+     *
+     * @param bucket_num the bucket number
+     */
+    inline void prefetchBucket(int bucket_num) {
+        size_t sz(0);
+        void *table = stripeValues(mutexForBucket(bucket_num), &sz);
+        if (table == NULL || sz == 0) {
+            return;
+        }
+        size_t i = slotFor(bucket_num, sz);
+        if (layout == fingerprinted) {
+            __builtin_prefetch(&static_cast<FingerprintBucket*>(table)[i]);
+        } else {
+            __builtin_prefetch(&static_cast<StoredValue**>(table)[i]);
+        }
+    }
+
     /**
      * Delete a key from the cache without trying to lock the cache first
      * (Please note that you <b>MUST</b> acquire the mutex before calling
@@ -891,39 +1658,27 @@ public:
      */
     bool unlocked_del(const std::string &key, int bucket_num) {
         assert(active());
-        StoredValue *v = values[bucket_num];
-
-        // Special case empty bucket.
-        if (!v) {
+        StoredValue *v = findInBucket(key, bucket_num);
+        if (!v || v->isLocked(ep_current_time())) {
             return false;
         }
 
-        // Special case the first one
-        if (v->hasKey(key)) {
-            if (v->isLocked(ep_current_time())) {
-                return false;
-            }
-            values[bucket_num] = v->next;
-            v->reduceCurrentSize(stats, v->size());
-            delete v;
-            return true;
-        }
-
-        while (v->next) {
-            if (v->next->hasKey(key)) {
-                StoredValue *tmp = v->next;
-                if (tmp->isLocked(ep_current_time())) {
-                    return false;
-                }
-                v->next = v->next->next;
-                delete tmp;
-                return true;
-            } else {
-                v = v->next;
+        size_t i(0);
+        void *table = locate(bucket_num, &i);
+        if (layout == fingerprinted) {
+            static_cast<FingerprintBucket*>(table)[i].remove(v);
+        } else {
+            StoredValue **p = &static_cast<StoredValue**>(table)[i];
+            while (*p != v) {
+                p = &(*p)->next;
             }
+            *p = v->next;
         }
-
-        return false;
+        v->reduceCurrentSize(stats, v->size());
+        memSize.decr(v->size());
+        Epoch::retire(v, deleteStoredValue);
+        --numItems;
+        return true;
     }
 
     /**
@@ -939,11 +1694,90 @@ public:
         return unlocked_del(key, bucket_num);
     }
 
+    /**
+     * A place in a visit of a hash table that can be resumed from.
+     *
+     * It's only numbers, so it stays good across anything that
+     * happens to the table in the meantime; see pauseResumeVisit().
+     */
+    class Position {
+    public:
+        //! The start of a hash table.
+        Position() : lock(0), bucket(0), tableSize(0) {}
+
+        bool operator==(const Position &other) const {
+            return lock == other.lock && bucket == other.bucket
+                && tableSize == other.tableSize;
+        }
+
+        bool operator!=(const Position &other) const {
+            return !(*this == other);
+        }
+
+    private:
+        Position(int l, int b, size_t sz) : lock(l), bucket(b), tableSize(sz) {}
+
+        // The stripe being visited, the next bucket in it, and the
+        // size of the bucket array the stripe was in at the time.
+        int    lock;
+        int    bucket;
+        size_t tableSize;
+
+        friend class HashTable;
+    };
+
     /**
      * Visit all items within this hashtable.
+     *
+     * Stripe locks are held for at most VISIT_CHUNK_SIZE buckets at
+     * a time, and the visitor is asked whether to go on in between.
      */
     void visit(HashTableVisitor &visitor);
 
+    /**
+     * Visit all items in a range of lock stripes, the way visit()
+     * does.
+     *
+     * Disjoint ranges may be visited from different threads at once
+     * (see EventuallyPersistentStore::parallelVisit()).
+     *
+     * @param visitor the visitor
+     * @param first the first stripe to visit
+     * @param last the stripe after the last one to visit
+     */
+    void visitStripes(HashTableVisitor &visitor, int first, int last);
+
+    /**
+     * Visit the items in at most the given number of buckets.
+     *
+     * Stripe locks are only held while their buckets are visited, so
+     * a long walk can be done a piece at a time (e.g. one piece per
+     * dispatcher run) without holding up anyone else for long.  The
+     * visitor's shouldContinue() isn't consulted.
+     *
+     * If the table was resized while the visit was paused, the stripe
+     * it paused in is started over, so some items may be seen twice.
+     * Items stored meanwhile may or may not be seen.
+     *
+     * @param visitor the visitor
+     * @param start where to start, from Position() or an earlier call
+     * @param maxBuckets the most buckets to visit
+     *
+     * @return where to resume, or endPosition() if the visit is done
+     */
+    Position pauseResumeVisit(HashTableVisitor &visitor, const Position &start,
+                              size_t maxBuckets);
+
+    /**
+     * Get the position at which a visit of this hash table is done.
+     */
+    Position endPosition() const {
+        return Position(static_cast<int>(n_locks), 0, 0);
+    }
+
+    //! Buckets visit() visits under one lock.
+    static const size_t VISIT_CHUNK_SIZE = 256;
+
     /**
      * Visit all items within this call with a depth visitor.
      */
@@ -973,6 +1807,23 @@ public:
      */
     static void setDefaultNumLocks(size_t);
 
+    /**
+     * Set the size up to which values are kept inline in their
+     * StoredValue rather than in a shared Blob.
+     *
+     * Sizes over MAX_INLINE_VALUE_SIZE are clamped to it, and 0 keeps
+     * every value in a Blob.
+     */
+    static void setDefaultInlineValueSize(size_t);
+
+    /**
+     * Get the size up to which values are kept inline.
+     */
+    static size_t getDefaultInlineValueSize();
+
+    //! The largest value that may be kept inline.
+    static const size_t MAX_INLINE_VALUE_SIZE = 128;
+
     /**
      * Set the stored value type by name.
      *
@@ -997,26 +1848,131 @@ public:
      */
     static const char* getDefaultStorageValueTypeStr();
 
+    /**
+     * Set whether big bucket arrays are to be backed by huge pages
+     * (where madvise() can ask for them).
+     *
+     * This applies to bucket arrays allocated from then on.
+     */
+    static void setHugePages(bool to);
+
+    static bool getHugePages();
+
+    /**
+     * Set whether the keys of items found expired are kept for
+     * takeExpired().
+     *
+     * Only worth it when something persists the tables and drains
+     * them; otherwise they'd pile up.
+     */
+    static void setKeepExpired(bool to);
+
+    /**
+     * Set the default bucket layout by name.
+     *
+     * @param t either "chained" or "fingerprinted"
+     *
+     * @return true if the layout was recognized
+     */
+    static bool setDefaultLayout(const char *t);
+
+    /**
+     * Set the default bucket layout by enum value.
+     */
+    static void setDefaultLayout(enum hash_table_layout);
+
+    /**
+     * Get the default bucket layout.
+     */
+    static enum hash_table_layout getDefaultLayout();
+
+    /**
+     * Get the default bucket layout as a string.
+     */
+    static const char* getDefaultLayoutStr();
+
+    /**
+     * Set the default key hash function by name.
+     *
+     * @param t either "word" or "crc32c"
+     *
+     * @return true if the hash function was recognized
+     */
+    static bool setDefaultHashFunction(const char *t);
+
+    /**
+     * Set the default key hash function by enum value.
+     */
+    static void setDefaultHashFunction(enum hash_function_type);
+
+    /**
+     * Get the default key hash function.
+     */
+    static enum hash_function_type getDefaultHashFunction();
+
+    /**
+     * Get the default key hash function as a string.
+     */
+    static const char* getDefaultHashFunctionStr();
+
 private:
     inline bool active() { return activeState = true; }
     inline void active(bool newv) { activeState = newv; }
 
     size_t               size;
+    size_t               minSize;
+    // The size asked for by reserve(), kept until warmup is done.
+    size_t               reservedSize;
     size_t               n_locks;
-    StoredValue        **values;
-    Mutex               *mutexes;
+    enum hash_table_layout layout;
+    KeyHash::function_t  hashFunction;
+    // Either StoredValue* chain heads or FingerprintBuckets.
+    void                *values;
+    // While resizing, the stripes at or above `migrated' still live here.
+    void                *oldValues;
+    size_t               oldSize;
+    Atomic<size_t>       migrated;
+    StripeMutex         *mutexes;
+    // Where the StoredValues live; allocated along with `mutexes'.
+    SlabArena           *arena;
+    Mutex                resizeLock;
+    // Guards the on-demand allocation of `values' and `mutexes'.
+    Mutex                allocLock;
     EPStats&             stats;
     StoredValueFactory   valFact;
     Atomic<size_t>       visitors;
+    Atomic<size_t>       numItems;
+    Atomic<size_t>       memSize;
+    Atomic<size_t>       numResizes;
     bool                 activeState;
+    // Keys deleted on being found expired; see takeExpired().
+    SpinLock             expiredLock;
+    std::vector<std::string> expiredKeys;
 
     static size_t                 defaultNumBuckets;
     static size_t                 defaultNumLocks;
+    static size_t                 defaultInlineValueSize;
     static enum stored_value_type defaultStoredValueType;
+    static enum hash_table_layout defaultLayout;
+    static enum hash_function_type defaultHashFunction;
+    static bool                   hugePages;
+    static bool                   keepExpired;
+
+    // Visit at most maxBuckets buckets from start, stopping short of
+    // stripe last.
+    Position visitRange(HashTableVisitor &visitor, const Position &start,
+                        size_t maxBuckets, int last);
+
+    inline void chargeMemSize(size_t oldsize, size_t newsize) {
+        if (newsize > oldsize) {
+            memSize.incr(newsize - oldsize);
+        } else {
+            memSize.decr(oldsize - newsize);
+        }
+    }
 
     inline int mutexForBucket(int bucket_num) {
         assert(active());
-        assert(bucket_num < (int)size);
         assert(bucket_num >= 0);
         int lock_num = bucket_num % (int)n_locks;
         assert(lock_num < (int)n_locks);
@@ -1024,6 +1980,163 @@ private:
         return lock_num;
     }
 
+    /**
+     * Get the first slot of a lock stripe in a bucket array of the
+     * given size.
+     *
+     * A stripe's buckets are all next to each other, so they don't
+     * share cache lines with other stripes' buckets, and a stripe is
+     * walked in memory order.
+     */
+    inline int stripeStart(int lock_num, size_t sz) {
+        return lock_num * static_cast<int>(sz / n_locks);
+    }
+
+    /**
+     * Get the slot of a bucket number in a bucket array of the given
+     * (non-zero) size.
+     *
+     * It's within the stripe of the bucket's lock, and depends on
+     * nothing but the bucket number modulo the size.
+     */
+    inline size_t slotFor(int bucket_num, size_t sz) {
+        size_t perStripe = sz / n_locks;
+        return static_cast<size_t>(stripeStart(mutexForBucket(bucket_num), sz))
+            + (static_cast<size_t>(bucket_num) / n_locks) % perStripe;
+    }
+
+    /**
+     * Find the bucket array holding the given lock stripe.
+     *
+     * The caller must hold the lock for the stripe.
+     *
+     * @return the bucket array, or NULL if none is allocated yet
+     */
+    inline void *stripeValues(int lock_num, size_t *sz) {
+        if (oldValues != NULL && static_cast<size_t>(lock_num) >= migrated.get()) {
+            *sz = oldSize;
+            return oldValues;
+        }
+        *sz = values ? size : 0;
+        return values;
+    }
+
+    /**
+     * Find the bucket array and index for the given bucket number.
+     *
+     * The caller must hold the lock for the bucket.
+     *
+     * @return the bucket array, or NULL if none is allocated yet
+     */
+    inline void *locate(int bucket_num, size_t *idx) {
+        size_t sz(0);
+        void *table = stripeValues(mutexForBucket(bucket_num), &sz);
+        *idx = table ? slotFor(bucket_num, sz) : 0;
+        return table;
+    }
+
+    /**
+     * Find the item with the given key in its bucket.
+     *
+     * The caller must hold the lock for the bucket.
+     */
+    inline StoredValue *findInBucket(const std::string &key, int bucket_num) {
+        size_t i(0);
+        void *table = locate(bucket_num, &i);
+        if (table == NULL) {
+            return NULL;
+        }
+        return findAt(table, i, key, bucket_num);
+    }
+
+    inline StoredValue *findAt(void *table, size_t i,
+                               const std::string &key, int bucket_num) {
+        if (layout == fingerprinted) {
+            return static_cast<FingerprintBucket*>(table)[i].find(key,
+                         FingerprintBucket::fingerprint(bucket_num));
+        }
+        StoredValue *v = static_cast<StoredValue**>(table)[i];
+        while (v && !v->hasKey(key)) {
+            v = v->next;
+        }
+        return v;
+    }
+
+    /**
+     * Add a new item to its bucket.
+     *
+     * The caller must hold the lock for the bucket.
+     */
+    inline void link(StoredValue *v, int bucket_num) {
+        if (values == NULL) {
+            allocateValues();
+        }
+        size_t i(0);
+        void *table = locate(bucket_num, &i);
+        linkAt(table, i, v, bucket_num);
+        ++numItems;
+    }
+
+    inline void linkAt(void *table, size_t i, StoredValue *v, int bucket_num) {
+        if (layout == fingerprinted) {
+            static_cast<FingerprintBucket*>(table)[i].insert(v,
+                         FingerprintBucket::fingerprint(bucket_num));
+        } else {
+            StoredValue **chains = static_cast<StoredValue**>(table);
+            v->next = chains[i];
+            chains[i] = v;
+        }
+    }
+
+    bool optimisticRead(const std::string &key, int bucket_num,
+                        HashTableReader &reader);
+
+    static void deleteStoredValue(void *p) {
+        StoredValue::destroy(static_cast<StoredValue*>(p));
+    }
+
+    StoredValue *popAt(void *table, size_t i);
+    size_t depthAt(void *table, size_t i);
+
+    size_t bucketSize() {
+        return layout == fingerprinted ? sizeof(FingerprintBucket) : sizeof(StoredValue*);
+    }
+
+    void *allocateBuckets(size_t n);
+
+    /**
+     * Get the size resize() won't go below.
+     */
+    inline size_t floorSize() {
+        if (!stats.warmupComplete.get()) {
+            return std::max(minSize, reservedSize);
+        }
+        return minSize;
+    }
+
+    /**
+     * Get the smallest table size (in the doubling series starting at
+     * the initial size) that fits the given number of items.
+     */
+    inline size_t sizeClass(size_t items) {
+        size_t rv = minSize;
+        while (rv < items && rv <= static_cast<size_t>(INT_MAX) / 2) {
+            rv *= 2;
+        }
+        return rv;
+    }
+
+    void allocateValues();
+    void allocateMutexes();
+
+    /**
+     * Round a bucket count up to a multiple of the number of locks,
+     * so every stripe gets the same number of buckets.
+     */
+    inline size_t stripeMultiple(size_t n) {
+        return ((n + n_locks - 1) / n_locks) * n_locks;
+    }
+
     DISALLOW_COPY_AND_ASSIGN(HashTable);
 };
 
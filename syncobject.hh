@@ -15,7 +15,11 @@
  */
 class SyncObject : public Mutex {
 public:
-    SyncObject() : Mutex() {
+    /**
+     * @param ls the LockStats to profile this lock in, if any
+     */
+    explicit SyncObject(LockStats *ls = NULL) : Mutex(), lockStats(ls),
+                                               condWaitTime(0) {
         if (pthread_cond_init(&cond, NULL) != 0) {
             throw std::runtime_error("MUTEX ERROR: Failed to initialize cond.");
         }
@@ -28,10 +32,12 @@ public:
     }
 
     void wait() {
+        hrtime_t start = waitStart();
         if (pthread_cond_wait(&cond, &mutex) != 0) {
             throw std::runtime_error("Failed to wait for condition.");
         }
         setHolder();
+        waitEnd(start);
     }
 
     bool wait(const struct timeval &tv) {
@@ -39,12 +45,15 @@ public:
         ts.tv_sec = tv.tv_sec + 0;
         ts.tv_nsec = tv.tv_usec * 1000;
 
+        hrtime_t start = waitStart();
         switch (pthread_cond_timedwait(&cond, &mutex, &ts)) {
         case 0:
             setHolder();
+            waitEnd(start);
             return true;
         case ETIMEDOUT:
             setHolder();
+            waitEnd(start);
             return false;
         default:
             throw std::runtime_error("Failed timed_wait for condition.");
@@ -64,8 +73,29 @@ public:
         }
     }
 
+    LockStats *getLockStats() { return lockStats; }
+
+protected:
+
+    hrtime_t getCondWaitTime() { return condWaitTime; }
+
 private:
+
+    // Only profiled locks keep track of their waits.
+    hrtime_t waitStart() {
+        return lockStats != NULL && LockStats::isEnabled() ? gethrtime() : 0;
+    }
+
+    // Called with the lock held again.
+    void waitEnd(hrtime_t start) {
+        if (start != 0) {
+            condWaitTime += gethrtime() - start;
+        }
+    }
+
     pthread_cond_t cond;
+    LockStats     *lockStats;
+    hrtime_t       condWaitTime;
 
     DISALLOW_COPY_AND_ASSIGN(SyncObject);
 };
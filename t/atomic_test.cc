@@ -42,6 +42,56 @@ static void testAtomicInt() {
     assert(intgen.latest() == (numThreads * numIterations));
 }
 
+class ShardedCounterTest : public Generator<int> {
+public:
+
+    ShardedCounterTest(ShardedCounter<size_t> &c) : counter(c) {}
+
+    int operator()() {
+        for (size_t j = 0; j < numIterations; j++) {
+            counter.incr(3);
+            counter.decr(1);
+            ++counter;
+            counter -= 2;
+            counter += 1;
+        }
+        return static_cast<int>(getThreadSlot());
+    }
+
+private:
+    ShardedCounter<size_t> &counter;
+};
+
+static void testShardedCounter() {
+    ShardedCounter<size_t> counter(10);
+    assert(counter.get() == 10);
+
+    ShardedCounterTest gen(counter);
+    std::vector<int> slots(getCompletedThreads<int>(numThreads, &gen));
+    assert(counter.get() == 10 + 2 * numThreads * numIterations);
+
+    // Every thread got a slot of its own.
+    std::sort(slots.begin(), slots.end());
+    assert(std::unique(slots.begin(), slots.end()) == slots.end());
+
+    // Taking away more than a shard holds wraps that shard only.
+    counter.set(5);
+    counter.decr(3);
+    assert(counter == 2);
+    counter = 0;
+    assert(counter.get() == 0);
+
+    // The approximate total catches up once it's drifted too far.
+    counter = 1024;
+    assert(counter.getApprox() == 1024);
+    counter.incr(4);
+    assert(counter.getApprox() == 1024);
+    counter.incr(1);
+    assert(counter.getApprox() == 1029);
+    counter.decr(1000);
+    assert(counter.getApprox() == 29);
+}
+
 static void testSetIfLess() {
     Atomic<int> x;
 
@@ -65,6 +115,7 @@ static void testSetIfBigger() {
 int main() {
     alarm(60);
     testAtomicInt();
+    testShardedCounter();
     testSetIfLess();
     testSetIfBigger();
 }
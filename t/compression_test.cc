@@ -0,0 +1,120 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#include "config.h"
+#include <cassert>
+#include <cstring>
+#include <string>
+#include <unistd.h>
+
+#include "compression.hh"
+
+static std::string noise(size_t n) {
+    std::string rv;
+    uint32_t x = 1;
+    for (size_t i = 0; i < n; ++i) {
+        x = x * 1103515245 + 12345;
+        rv.push_back(static_cast<char>(x >> 16));
+    }
+    return rv;
+}
+
+static void roundTrip(const std::string &in) {
+    std::string out(in.length() * 2 + 16, '\0');
+    size_t n = ValueCompressor::compress(in.data(), in.length(),
+                                         &out[0], out.length());
+    assert(n > 0 || in.empty());
+
+    std::string back(in.length(), '\0');
+    size_t m = ValueCompressor::decompress(out.data(), n,
+                                           &back[0], back.length());
+    assert(m == in.length());
+    assert(back == in);
+}
+
+static void testRoundTrips() {
+    roundTrip("");
+    roundTrip("a");
+    roundTrip("abc");
+    roundTrip(std::string(1000, 'a'));
+    roundTrip(std::string(100000, 'z'));
+    roundTrip(noise(5000));
+
+    // Repeats further back than a reference reaches.
+    std::string far(noise(10000));
+    roundTrip(far + far);
+
+    // Every literal run length and match length around the limits.
+    for (size_t i = 1; i < 300; ++i) {
+        roundTrip(noise(i) + std::string(i, 'q') + noise(i));
+    }
+}
+
+static void testTooSmall() {
+    std::string in(noise(100));
+    char out[50];
+    assert(ValueCompressor::compress(in.data(), in.length(),
+                                     out, sizeof(out)) == 0);
+}
+
+static void testBadInput() {
+    std::string in(std::string(500, 'x') + noise(100));
+    std::string out(1000, '\0');
+    size_t n = ValueCompressor::compress(in.data(), in.length(),
+                                         &out[0], out.length());
+    assert(n > 0);
+
+    // Not enough room for the output.
+    std::string back(in.length(), '\0');
+    assert(ValueCompressor::decompress(out.data(), n,
+                                       &back[0], in.length() - 1) == 0);
+
+    // Cut short.
+    for (size_t i = 1; i < n; ++i) {
+        size_t m = ValueCompressor::decompress(out.data(), i,
+                                               &back[0], back.length());
+        assert(m < in.length());
+    }
+
+    // A reference to before the start.
+    const char ref[] = { 0, 'a', 0x20, 5 };
+    assert(ValueCompressor::decompress(ref, sizeof(ref),
+                                       &back[0], back.length()) == 0);
+
+    // Garbage never writes past the end.
+    std::string junk(noise(1000));
+    char small[64];
+    assert(ValueCompressor::decompress(junk.data(), junk.length(),
+                                       small, sizeof(small)) <= sizeof(small));
+}
+
+static void testValues() {
+    EPStats stats;
+    std::string json;
+    for (int i = 0; i < 100; ++i) {
+        json.append("{\"id\":12345,\"name\":\"some user\",\"active\":true},");
+    }
+    value_t v(Blob::New(json));
+    value_t c(ValueCompressor::compress(v, stats));
+    assert(c);
+    assert(c->length() < v->length() / 4);
+    assert(ValueCompressor::rawLength(c) == json.length());
+    assert(ValueCompressor::decompress(c, stats)->to_s() == json);
+    assert(stats.numCompressed.get() == 1);
+    assert(stats.compressedInBytes.get() == json.length());
+    assert(stats.compressedOutBytes.get() == c->length());
+    assert(stats.numDecompressions.get() == 1);
+
+    // Values that don't shrink enough aren't worth it.
+    value_t n(Blob::New(noise(1000)));
+    assert(!ValueCompressor::compress(n, stats));
+    assert(stats.numCompressions.get() == 2);
+    assert(stats.numCompressed.get() == 1);
+}
+
+int main(int argc, char **argv) {
+    (void)argc; (void)argv;
+    alarm(60);
+    testRoundTrips();
+    testTooSmall();
+    testBadInput();
+    testValues();
+}
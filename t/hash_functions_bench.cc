@@ -0,0 +1,71 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#include "config.h"
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "hash-functions.hh"
+
+/*
+ * Time each key hash function over a few typical key shapes.
+ *
+ * Usage: hash_functions_bench [iterations]
+ */
+
+// The byte at a time hash the hash table used to use, for comparison.
+static uint64_t djb(const char *str, size_t len) {
+    int h = 5381;
+    for (size_t i = 0; i < len; i++) {
+        h = ((h << 5) + h) ^ str[i];
+    }
+    return static_cast<uint64_t>(h & INT_MAX);
+}
+
+static std::vector<std::string> makeKeys(const char *fmt, size_t n) {
+    std::vector<std::string> rv;
+    char buf[256];
+    for (size_t i = 0; i < n; ++i) {
+        snprintf(buf, sizeof(buf), fmt, static_cast<int>(i));
+        rv.push_back(std::string(buf));
+    }
+    return rv;
+}
+
+static void bench(const char *name, KeyHash::function_t f,
+                  const std::vector<std::string> &keys, size_t iterations) {
+    uint64_t sum = 0;
+    hrtime_t start = gethrtime();
+    for (size_t i = 0; i < iterations; ++i) {
+        std::vector<std::string>::const_iterator it;
+        for (it = keys.begin(); it != keys.end(); ++it) {
+            sum += f(it->data(), it->length());
+        }
+    }
+    hrtime_t elapsed = gethrtime() - start;
+    double ns = static_cast<double>(elapsed) / (iterations * keys.size());
+    // Print the sum so the work can't be optimized away.
+    printf("  %-8s %8.2f ns/key  (%016llx)\n", name, ns,
+           static_cast<unsigned long long>(sum));
+}
+
+int main(int argc, char **argv) {
+    size_t iterations = argc > 1 ? static_cast<size_t>(atoi(argv[1])) : 100;
+    const char *shapes[] = {
+        "k%d",
+        "user:%08d",
+        "session:%d:0123456789abcdef0123456789abcdef",
+        "com.example.objects/%d/aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa",
+        NULL
+    };
+
+    printf("hardware crc32c: %s\n", KeyHash::hardwareCrc32c() ? "yes" : "no");
+    for (int i = 0; shapes[i]; ++i) {
+        std::vector<std::string> keys(makeKeys(shapes[i], 10000));
+        printf("%s (%d bytes)\n", shapes[i], static_cast<int>(keys[0].length()));
+        bench("djb", djb, keys, iterations);
+        bench("word", KeyHash::word, keys, iterations);
+        bench("crc32c", KeyHash::implementation(crc32c_hash), keys, iterations);
+        bench("crc32c-sw", KeyHash::crc32cSoftware, keys, iterations);
+    }
+    return 0;
+}
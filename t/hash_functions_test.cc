@@ -0,0 +1,131 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#include "config.h"
+#include <cassert>
+#include <cstdio>
+#include <iostream>
+#include <vector>
+#include <unistd.h>
+
+#include "hash-functions.hh"
+
+static const size_t numKeys = 100000;
+
+static std::string makeKey(size_t i) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "key%d", static_cast<int>(i));
+    return std::string(buf);
+}
+
+/**
+ * Chi-squared statistic of counts that should be uniform.
+ */
+static double chiSquared(const std::vector<size_t> &counts, size_t total) {
+    double expected = static_cast<double>(total) / counts.size();
+    double rv = 0;
+    for (size_t i = 0; i < counts.size(); ++i) {
+        double d = counts[i] - expected;
+        rv += d * d / expected;
+    }
+    return rv;
+}
+
+/**
+ * Make sure the keys spread evenly over n bins with the given slice
+ * of the hash.
+ */
+static void assertUniform(KeyHash::function_t f, size_t n, int shift,
+                          uint64_t mask, const char *what) {
+    std::vector<size_t> counts(n);
+    for (size_t i = 0; i < numKeys; ++i) {
+        std::string k(makeKey(i));
+        counts[((f(k.data(), k.length()) >> shift) & mask) % n]++;
+    }
+    double chi = chiSquared(counts, numKeys);
+    // The statistic averages n - 1 with a standard deviation of
+    // about sqrt(2n), so this only trips on a real problem.
+    double limit = (n - 1) + 6 * sqrt(2.0 * n);
+    if (chi > limit) {
+        std::cerr << what << " over " << n << " bins: chi-squared "
+                  << chi << " > " << limit << std::endl;
+        abort();
+    }
+}
+
+static void testDistribution(KeyHash::function_t f) {
+    // Hash table buckets and lock stripes, from the low 31 bits.
+    assertUniform(f, 3079, 0, INT_MAX, "buckets");
+    assertUniform(f, 4096, 0, INT_MAX, "power of two buckets");
+    assertUniform(f, 193, 0, INT_MAX, "stripes");
+    // Fingerprints, from the top of the bucket number.
+    assertUniform(f, 256, 23, 0xff, "fingerprints");
+    // Database shards, from the high half.
+    assertUniform(f, 4, 32, 0xffffffff, "shards");
+}
+
+static void testAvalanche(KeyHash::function_t f) {
+    // Flipping any one key bit should flip about half the hash bits.
+    size_t flipped = 0, trials = 0;
+    for (size_t i = 0; i < 1000; ++i) {
+        std::string k(makeKey(i));
+        uint64_t h = f(k.data(), k.length());
+        for (size_t b = 0; b < k.length() * 8; ++b) {
+            std::string k2(k);
+            k2[b / 8] ^= static_cast<char>(1 << (b % 8));
+            flipped += __builtin_popcountll(h ^ f(k2.data(), k2.length()));
+            ++trials;
+        }
+    }
+    double avg = static_cast<double>(flipped) / trials;
+    assert(avg > 31.0 && avg < 33.0);
+}
+
+static void testLengths(KeyHash::function_t f) {
+    // Keys that only differ by trailing zero bytes are still different.
+    const char zeros[16] = { 0 };
+    for (size_t i = 0; i < sizeof(zeros); ++i) {
+        assert(f(zeros, i) != f(zeros, i + 1));
+    }
+}
+
+static void testCrc32cImplementations() {
+    // Whatever the CPU, CRC32C hashes to the same values.
+    char buf[64];
+    for (size_t i = 0; i < sizeof(buf); ++i) {
+        buf[i] = static_cast<char>(i * 7 + 3);
+    }
+    for (size_t off = 0; off < 8; ++off) {
+        for (size_t len = 0; len + off <= sizeof(buf); ++len) {
+            assert(KeyHash::crc32c(buf + off, len)
+                   == KeyHash::crc32cSoftware(buf + off, len));
+        }
+    }
+}
+
+static void testNames() {
+    enum hash_function_type t;
+    assert(KeyHash::parse("word", &t));
+    assert(t == word_hash);
+    assert(KeyHash::parse("crc32c", &t));
+    assert(t == crc32c_hash);
+    assert(!KeyHash::parse("djb", &t));
+    assert(!KeyHash::parse(NULL, &t));
+    assert(strcmp(KeyHash::name(word_hash), "word") == 0);
+    assert(strcmp(KeyHash::name(crc32c_hash), "crc32c") == 0);
+    assert(KeyHash::hardwareCrc32c() == (KeyHash::fastest() == crc32c_hash));
+}
+
+static void testFunction(KeyHash::function_t f) {
+    testDistribution(f);
+    testAvalanche(f);
+    testLengths(f);
+}
+
+int main(int argc, char **argv) {
+    (void)argc; (void)argv;
+    alarm(60);
+    testNames();
+    testCrc32cImplementations();
+    testFunction(KeyHash::word);
+    testFunction(KeyHash::crc32cSoftware);
+    testFunction(KeyHash::implementation(crc32c_hash));
+}
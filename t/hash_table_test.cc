@@ -4,11 +4,14 @@
 #include <unistd.h>
 
 #include <algorithm>
+#include <map>
 
 #include <ep.hh>
 #include <item.hh>
 #include <stats.hh>
 
+#include "threadtests.hh"
+
 extern "C" {
     static rel_time_t basic_current_time(void) {
         return 0;
@@ -29,7 +32,7 @@ public:
     void visit(StoredValue *v) {
         count += 1;
         std::string key = v->getKey();
-        value_t val = v->getValue();
+        value_t val = v->getValue(global_stats);
         assert(key.compare(val->to_s()) == 0);
     }
 };
@@ -193,6 +196,112 @@ static void testAdd() {
     }
 }
 
+static void testDelExpired() {
+    HashTable h(global_stats, 5, 1);
+    std::string forever("forever"), mortal("mortal");
+    Item a(forever, 0, 0, forever.c_str(), forever.length());
+    Item b(mortal, 0, 100, mortal.c_str(), mortal.length());
+    assert(h.set(a) == NOT_FOUND);
+    assert(h.set(b) == NOT_FOUND);
+
+    int bucket_num = h.bucket(mortal);
+    LockHolder lh(h.getMutex(bucket_num));
+    assert(!h.unlocked_delExpired(mortal, bucket_num, 100));
+    assert(!h.unlocked_delExpired("missing", bucket_num, 200));
+    assert(h.unlocked_delExpired(mortal, bucket_num, 101));
+    assert(!h.unlocked_delExpired(mortal, bucket_num, 101));
+    lh.unlock();
+
+    bucket_num = h.bucket(forever);
+    LockHolder lh2(h.getMutex(bucket_num));
+    assert(!h.unlocked_delExpired(forever, bucket_num, 1000));
+    lh2.unlock();
+    assert(count(h) == 1);
+}
+
+extern "C" {
+    static rel_time_t later_current_time(void) {
+        return 200;
+    }
+}
+
+static void testLazyExpiry() {
+    HashTable::setKeepExpired(true);
+    HashTable h(global_stats, 5, 1);
+    std::string forever("forever"), mortal("mortal");
+    Item a(forever, 0, 0, forever.c_str(), forever.length());
+    Item b(mortal, 0, 100, mortal.c_str(), mortal.length());
+    assert(h.set(a) == NOT_FOUND);
+    assert(h.set(b) == NOT_FOUND);
+
+    std::vector<std::string> expired;
+    h.takeExpired(expired);
+    assert(expired.empty());
+
+    ep_current_time = later_current_time;
+    assert(h.find(forever));
+    assert(!h.find(mortal));
+    ep_current_time = basic_current_time;
+
+    // Found expired and deleted, so its disk delete is still owed.
+    h.takeExpired(expired);
+    assert(expired.size() == 1 && expired[0] == mortal);
+    h.takeExpired(expired);
+    assert(expired.empty());
+    assert(count(h) == 1);
+
+    // Nobody to drain them, so nothing's kept.
+    HashTable::setKeepExpired(false);
+    assert(h.set(b) == NOT_FOUND);
+    ep_current_time = later_current_time;
+    assert(!h.find(mortal));
+    ep_current_time = basic_current_time;
+    h.takeExpired(expired);
+    assert(expired.empty());
+}
+
+static void testNRU(enum stored_value_type type) {
+    HashTable::setDefaultStorageValueType(type);
+    HashTable h(global_stats, 5, 1);
+    std::string k("nrukey");
+    store(h, k);
+
+    StoredValue *v = h.find(k);
+    assert(v->getNRUValue() == StoredValue::INITIAL_NRU_VALUE);
+    for (int i = 0; i < 5; ++i) {
+        v->incrNRUValue();
+    }
+    assert(v->getNRUValue() == StoredValue::MAX_NRU_VALUE);
+    v->referenced();
+    assert(v->getNRUValue() == 0);
+    v->incrNRUValue();
+    assert(v->getNRUValue() == 1);
+
+    // The key is untouched by all that.
+    assert(v->getKey() == k);
+    HashTable::setDefaultStorageValueType(featured);
+}
+
+static void testLockNum() {
+    HashTable h(global_stats, 5, 3);
+    std::vector<std::string> keys = generateKeys(100);
+    // Before anything's allocated there's nothing to prefetch.
+    h.prefetchBucket(h.bucket(keys[0]));
+    storeMany(h, keys);
+
+    std::vector<std::string>::iterator it;
+    for (it = keys.begin(); it != keys.end(); ++it) {
+        int bucket_num = h.bucket(*it);
+        int lock_num = h.getLockNum(bucket_num);
+        assert(lock_num >= 0 && lock_num < 3);
+        assert(&h.getMutex(bucket_num) == &h.getMutexForLock(lock_num));
+
+        h.prefetchBucket(bucket_num);
+        LockHolder lh(h.getMutexForLock(lock_num));
+        assert(h.unlocked_find(*it, bucket_num));
+    }
+}
+
 static void testDepthCounting() {
     HashTable h(global_stats, 5, 1);
     const int nkeys = 5000;
@@ -206,6 +315,477 @@ static void testDepthCounting() {
     assert(depthCounter.max > 1000);
 }
 
+class BucketOrder : public HashTableDepthVisitor {
+public:
+    BucketOrder() : next(0), inOrder(true), items(0) {}
+
+    void visit(int bucket, int depth) {
+        inOrder = inOrder && bucket == next;
+        ++next;
+        items += depth;
+    }
+
+    int  next;
+    bool inOrder;
+    int  items;
+};
+
+static void testStripeLayout() {
+    HashTable h(global_stats, 12, 3);
+    std::vector<std::string> keys = generateKeys(100);
+    storeMany(h, keys);
+
+    // Every lock has a cache line to itself.
+    for (int l = 0; l < static_cast<int>(h.getNumLocks()); ++l) {
+        uintptr_t addr = reinterpret_cast<uintptr_t>(&h.getMutexForLock(l));
+        assert(addr % CACHE_LINE_SIZE == 0);
+    }
+
+    // One stripe after another is one pass over the buckets.
+    BucketOrder order;
+    h.visitDepth(order);
+    assert(order.inOrder);
+    assert(order.next == static_cast<int>(h.getSize()));
+    assert(order.items == 100);
+
+    // Huge pages or not, it works the same.
+    HashTable::setHugePages(true);
+    {
+        HashTable big(global_stats, 1 << 19, 3);
+        storeMany(big, keys);
+        assert(count(big) == 100);
+        BucketOrder bigOrder;
+        big.visitDepth(bigOrder);
+        assert(bigOrder.inOrder && bigOrder.items == 100);
+    }
+    HashTable::setHugePages(false);
+}
+
+static void testResize() {
+    HashTable h(global_stats, 5, 3);
+    // Sizes are rounded up to a multiple of the lock count.
+    assert(h.getSize() == 6);
+    assert(!h.resize());
+
+    const int nkeys = 5000;
+    std::vector<std::string> keys = generateKeys(nkeys);
+    storeMany(h, keys);
+    assert(h.getNumItems() == static_cast<size_t>(nkeys));
+
+    assert(h.resize());
+    assert(h.isResizing());
+    size_t perBucket = h.getLayout() == fingerprinted ? FingerprintBucket::SLOTS / 2 : 1;
+    assert(h.getSize() * perBucket >= static_cast<size_t>(nkeys));
+    assert(h.getSize() % h.getNumLocks() == 0);
+    // Only one resize at a time.
+    assert(!h.resize(12));
+
+    // Everything remains reachable while stripes are in flight.
+    assert(h.migrate(1));
+    assert(count(h) == nkeys);
+    std::vector<std::string>::iterator it;
+    for (it = keys.begin(); it != keys.end(); it++) {
+        std::string key = *it;
+        assert(h.find(key));
+    }
+    while (h.migrate(1)) {}
+    assert(!h.isResizing());
+    assert(h.getNumResizes() == 1);
+    assert(count(h) == nkeys);
+
+    HashTableDepthStatVisitor depthCounter;
+    h.visitDepth(depthCounter);
+    assert(depthCounter.size == static_cast<size_t>(nkeys));
+    assert(depthCounter.max < 100);
+
+    for (it = keys.begin(); it != keys.end(); it++) {
+        std::string key = *it;
+        assert(h.find(key));
+        assert(h.del(key));
+    }
+    assert(h.getNumItems() == 0);
+
+    // Shrinks back, but never below the initial size.
+    assert(h.resize());
+    while (h.migrate(1)) {}
+    assert(h.getSize() == 6);
+    assert(count(h) == 0);
+}
+
+static StoredValue *findRef(HashTable &h, const StoredRef &ref) {
+    LockHolder lh(h.getMutex(ref.bucket));
+    return h.unlocked_find(ref);
+}
+
+static void testStoredRef() {
+    HashTable h(global_stats, 5, 3);
+    const int nkeys = 1000;
+    std::vector<std::string> keys = generateKeys(nkeys);
+    std::vector<StoredRef> refs;
+    std::vector<std::string>::iterator it;
+    for (it = keys.begin(); it != keys.end(); it++) {
+        Item i(*it, 0, 0, it->c_str(), it->length());
+        StoredRef ref;
+        assert(h.set(i, &ref) == NOT_FOUND);
+        assert(ref.value != NULL);
+        assert(ref.bucket == h.bucket(*it));
+        refs.push_back(ref);
+    }
+
+    // Setting it again refers to the same item.
+    Item again(keys[0], 0, 0, "x", 1);
+    StoredRef ref;
+    assert(h.set(again, &ref) == WAS_DIRTY);
+    assert(ref.value == refs[0].value);
+
+    // Still found while and after the table grows.
+    assert(h.resize());
+    assert(h.migrate(1));
+    for (int i = 0; i < nkeys; ++i) {
+        assert(findRef(h, refs[i]) == refs[i].value);
+    }
+    while (h.migrate(1)) {}
+    for (int i = 0; i < nkeys; ++i) {
+        StoredValue *v = findRef(h, refs[i]);
+        assert(v == refs[i].value);
+        assert(v->getKey() == keys[i]);
+    }
+
+    // Not once deleted.
+    assert(h.del(keys[1]));
+    assert(findRef(h, refs[1]) == NULL);
+    assert(findRef(h, refs[2]) == refs[2].value);
+}
+
+class KeyCounter : public HashTableVisitor {
+public:
+    void visit(StoredValue *v) {
+        ++seen[v->getKey()];
+    }
+
+    std::map<std::string, int> seen;
+};
+
+static void testPauseResumeVisit() {
+    HashTable h(global_stats, 5, 3);
+    KeyCounter empty;
+    assert(h.pauseResumeVisit(empty, HashTable::Position(), 10) == h.endPosition());
+
+    const int nkeys = 2000;
+    std::vector<std::string> keys = generateKeys(nkeys);
+    storeMany(h, keys);
+
+    // A few buckets at a time sees everything exactly once.
+    KeyCounter kc;
+    HashTable::Position pos;
+    int calls = 0;
+    while (pos != h.endPosition()) {
+        pos = h.pauseResumeVisit(kc, pos, 7);
+        ++calls;
+    }
+    assert(kc.seen.size() == static_cast<size_t>(nkeys));
+    std::map<std::string, int>::iterator it;
+    for (it = kc.seen.begin(); it != kc.seen.end(); ++it) {
+        assert(it->second == 1);
+    }
+    assert(calls >= static_cast<int>(h.getSize() / 7));
+
+    // Resizing while paused may show some items again, but never
+    // loses any.
+    KeyCounter rc;
+    pos = h.pauseResumeVisit(rc, HashTable::Position(), 2);
+    assert(pos != h.endPosition());
+    assert(h.resize());
+    while (pos != h.endPosition()) {
+        h.migrate(1);
+        pos = h.pauseResumeVisit(rc, pos, 2);
+    }
+    assert(rc.seen.size() == static_cast<size_t>(nkeys));
+    while (h.migrate(1)) {}
+    assert(count(h) == nkeys);
+}
+
+struct StripeVisit {
+    HashTable *h;
+    int first;
+    int last;
+    KeyCounter kc;
+};
+
+extern "C" {
+    static void *runStripeVisit(void *arg) {
+        StripeVisit *sv = static_cast<StripeVisit*>(arg);
+        sv->h->visitStripes(sv->kc, sv->first, sv->last);
+        return NULL;
+    }
+}
+
+static void testVisitStripes() {
+    HashTable h(global_stats, 5, 7);
+    const int nkeys = 2000;
+    std::vector<std::string> keys = generateKeys(nkeys);
+    storeMany(h, keys);
+
+    // Disjoint stripe ranges visited at once cover everything once.
+    const int nthreads = 3;
+    int bounds[nthreads + 1] = { 0, 2, 5, 7 };
+    StripeVisit visits[nthreads];
+    pthread_t threads[nthreads];
+    for (int i = 0; i < nthreads; ++i) {
+        visits[i].h = &h;
+        visits[i].first = bounds[i];
+        visits[i].last = bounds[i + 1];
+        assert(pthread_create(&threads[i], NULL, runStripeVisit, &visits[i]) == 0);
+    }
+    std::map<std::string, int> seen;
+    for (int i = 0; i < nthreads; ++i) {
+        assert(pthread_join(threads[i], NULL) == 0);
+        std::map<std::string, int>::iterator it;
+        for (it = visits[i].kc.seen.begin(); it != visits[i].kc.seen.end(); ++it) {
+            seen[it->first] += it->second;
+        }
+    }
+    assert(seen.size() == static_cast<size_t>(nkeys));
+    std::map<std::string, int>::iterator it;
+    for (it = seen.begin(); it != seen.end(); ++it) {
+        assert(it->second == 1);
+    }
+}
+
+static void testLazyAllocation() {
+    size_t overhead = global_stats.memOverhead.get();
+    {
+        HashTable h(global_stats, 5, 1);
+        assert(h.memorySize() == sizeof(HashTable));
+        assert(count(h) == 0);
+
+        HashTableDepthStatVisitor depthCounter;
+        h.visitDepth(depthCounter);
+        assert(depthCounter.min == 0 && depthCounter.max == 0);
+        assert(h.memorySize() == sizeof(HashTable));
+
+        std::string k = "testkey";
+        store(h, k);
+        assert(h.memorySize() > sizeof(HashTable));
+        assert(global_stats.memOverhead.get()
+               == overhead + h.memorySize() - sizeof(HashTable));
+    }
+    assert(global_stats.memOverhead.get() == overhead);
+}
+
+static void setValue(HashTable &h, const std::string &k, const std::string &val) {
+    Item i(k, 0, 0, val.data(), val.length());
+    h.set(i);
+}
+
+static void testMemSize() {
+    HashTable h(global_stats, 5, 1);
+    size_t before = global_stats.currentSize.get();
+    std::vector<std::string> keys = generateKeys(100);
+    storeMany(h, keys);
+    assert(h.getMemSize() > 0);
+    assert(h.getMemSize() == global_stats.currentSize.get() - before);
+
+    // Bigger values are charged, and ejected ones given back.
+    std::string k("memkey");
+    std::string big(1000, 'x');
+    setValue(h, k, big);
+    size_t withBig = h.getMemSize();
+    int bucket_num = h.bucket(k);
+    StoredValue *v = h.unlocked_find(k, bucket_num);
+    v->markClean(NULL);
+    assert(h.unlocked_ejectValue(v));
+    assert(h.getMemSize() == withBig - big.length());
+    value_t fetched(Blob::New(big));
+    assert(h.unlocked_restoreValue(v, fetched));
+    assert(h.getMemSize() == withBig);
+    assert(h.getMemSize() == global_stats.currentSize.get() - before);
+
+    std::vector<std::string>::iterator it;
+    for (it = keys.begin(); it != keys.end(); ++it) {
+        assert(h.del(*it));
+    }
+    assert(h.getMemSize() == v->size());
+    h.clear();
+    assert(h.getMemSize() == 0);
+    assert(global_stats.currentSize.get() == before);
+}
+
+static void testInlineValues() {
+    size_t currentSize = global_stats.currentSize.get();
+    std::string k("inlinekey");
+    std::string big(HashTable::MAX_INLINE_VALUE_SIZE + 1, 'x');
+    {
+        HashTable h(global_stats, 5, 1);
+        setValue(h, k, "small");
+        StoredValue *v = h.find(k);
+        assert(v->isInline());
+        assert(v->getValue(global_stats)->to_s() == "small");
+        assert(v->valLength() == 5);
+
+        // Too big for the room left after the key goes into a Blob...
+        setValue(h, k, big);
+        assert(!v->isInline());
+        assert(v->getValue(global_stats)->to_s() == big);
+
+        // ...and a small one comes back inline.
+        setValue(h, k, "smaller");
+        assert(v->isInline());
+        assert(v->getValue(global_stats)->to_s() == "smaller");
+
+        // Ejected values come back inline, too.
+        v->markClean(NULL);
+        assert(v->ejectValue(global_stats));
+        assert(!v->isResident());
+        assert(!v->isInline());
+        assert(!v->getValue(global_stats));
+        assert(v->valLength() == 7);
+        value_t fetched(Blob::New(std::string("smaller")));
+        assert(v->restoreValue(fetched, global_stats));
+        assert(v->isInline());
+        assert(v->getValue(global_stats)->to_s() == "smaller");
+
+        // Big values are never inline.
+        std::string k2("bigkey");
+        setValue(h, k2, big);
+        StoredValue *v2 = h.find(k2);
+        assert(!v2->isInline());
+
+        // Ejecting leaves nothing but the StoredValue.
+        size_t before = global_stats.currentSize.get();
+        v2->markClean(NULL);
+        assert(v2->ejectValue(global_stats));
+        assert(!v2->getValue(global_stats));
+        assert(v2->valLength() == big.length());
+        assert(global_stats.currentSize.get() == before - big.length());
+        assert(v2->size() == StoredValue::sizeOf(false) + k2.length());
+    }
+
+    HashTable::setDefaultInlineValueSize(0);
+    {
+        HashTable h(global_stats, 5, 1);
+        setValue(h, k, "small");
+        assert(!h.find(k)->isInline());
+        assert(h.find(k)->getValue(global_stats)->to_s() == "small");
+    }
+    HashTable::setDefaultInlineValueSize(HashTable::MAX_INLINE_VALUE_SIZE + 1);
+    assert(HashTable::getDefaultInlineValueSize() == HashTable::MAX_INLINE_VALUE_SIZE);
+    {
+        HashTable h(global_stats, 5, 1);
+        setValue(h, k, big.substr(1));
+        assert(h.find(k)->isInline());
+        assert(h.find(k)->getValue(global_stats)->to_s() == big.substr(1));
+    }
+    HashTable::setDefaultInlineValueSize(32);
+    assert(global_stats.currentSize.get() == currentSize);
+}
+
+static void testCompressedValues() {
+    size_t currentSize = global_stats.currentSize.get();
+    std::string k("compressedkey");
+    std::string val;
+    for (int i = 0; i < 50; ++i) {
+        val.append("{\"name\":\"value\",\"count\":42},");
+    }
+
+    StoredValue::setCompressionThreshold(100);
+    {
+        HashTable h(global_stats, 5, 1);
+        setValue(h, k, val);
+        StoredValue *v = h.find(k);
+        assert(v->isCompressed());
+        assert(v->valLength() == val.length());
+        assert(v->getValue(global_stats)->to_s() == val);
+        assert(v->getStoredValue()->length() < val.length() / 2);
+        assert(v->size() < StoredValue::sizeOf(false) + k.length() + val.length());
+
+        // Below the threshold values are kept as they are.
+        std::string plain(val.substr(0, 99));
+        setValue(h, k, plain);
+        assert(!v->isCompressed());
+        assert(v->getValue(global_stats)->to_s() == plain);
+
+        // And so are values that don't get any smaller.
+        std::string noise;
+        uint32_t x = 1;
+        for (int i = 0; i < 200; ++i) {
+            x = x * 1103515245 + 12345;
+            noise.push_back(static_cast<char>(x >> 16));
+        }
+        setValue(h, k, noise);
+        assert(!v->isCompressed());
+        assert(v->getValue(global_stats)->to_s() == noise);
+
+        // Ejecting remembers the raw length, and fetching compresses
+        // the value again.
+        setValue(h, k, val);
+        v->markClean(NULL);
+        assert(v->ejectValue(global_stats));
+        assert(!v->isCompressed());
+        assert(v->valLength() == val.length());
+        value_t fetched(Blob::New(val));
+        assert(v->restoreValue(fetched, global_stats));
+        assert(v->isCompressed());
+        assert(v->getValue(global_stats)->to_s() == val);
+    }
+    StoredValue::setCompressionThreshold(0);
+    assert(global_stats.currentSize.get() == currentSize);
+}
+
+static void testBlobPtr() {
+    value_t empty;
+    assert(!empty);
+    assert(empty.get() == NULL);
+
+    value_t a(Blob::New(std::string("a value")));
+    assert(a);
+    value_t b(a);
+    assert(b.get() == a.get());
+    assert(b->to_s() == "a value");
+
+    value_t c(Blob::New(std::string("another")));
+    c.swap(b);
+    assert(c.get() == a.get());
+    assert(b->to_s() == "another");
+
+    // The blob outlives the handle it came from.
+    a.reset();
+    assert(!a);
+    assert(c->to_s() == "a value");
+    c = b;
+    assert(c.get() == b.get());
+    c = c;
+    assert(c->to_s() == "another");
+}
+
+static void testReserve() {
+    HashTable h(global_stats, 5, 1);
+    h.reserve(1000);
+    assert(h.getSize() == 1280);
+
+    std::vector<std::string> keys = generateKeys(1000);
+    storeMany(h, keys);
+    assert(!h.resize());
+
+    // Too late to change the initial size now.
+    h.reserve(10);
+    assert(h.getSize() == 1280);
+    assert(count(h) == 1000);
+
+    // A reserved table isn't shrunk while it's still warming up.
+    HashTable w(global_stats, 5, 1);
+    w.reserve(1000);
+    std::vector<std::string> few = generateKeys(10);
+    storeMany(w, few);
+    assert(!w.resize());
+    assert(w.getSize() == 1280);
+
+    global_stats.warmupComplete.set(true);
+    assert(w.resize());
+    assert(w.getSize() < 1280);
+    global_stats.warmupComplete.set(false);
+}
+
 static void testPoisonKey() {
     std::string k("A\\NROBs_oc)$zqJ1C.9?XU}Vn^(LW\"`+K/4lykF[ue0{ram;fvId6h=p&Zb3T~SQ]82'ixDP");
 
@@ -215,9 +795,114 @@ static void testPoisonKey() {
     assert(count(h) == 1);
 }
 
-int main() {
-    global_stats.maxDataSize = 64*1024*1024;
-    alarm(60);
+class ValueReader : public HashTableReader {
+public:
+    ValueReader() : found(false) {}
+
+    void copy(StoredValue *v) {
+        found = v != NULL;
+        if (found) {
+            key = v->getKey();
+            value = v->getValue(global_stats);
+        } else {
+            value.reset();
+        }
+    }
+
+    bool found;
+    std::string key;
+    value_t value;
+};
+
+static void testRead() {
+    HashTable h(global_stats, 5, 3);
+    ValueReader r;
+    h.read("testkey", r);
+    assert(!r.found);
+
+    std::vector<std::string> keys = generateKeys(1000);
+    storeMany(h, keys);
+    std::vector<std::string>::iterator it;
+    for (it = keys.begin(); it != keys.end(); it++) {
+        h.read(*it, r);
+        assert(r.found);
+        assert(r.key == *it);
+        assert(r.value->to_s() == *it);
+    }
+
+    assert(h.del(keys[0]));
+    h.read(keys[0], r);
+    assert(!r.found);
+}
+
+static const int readerThreads = 4;
+static const int writerThreads = 2;
+
+/**
+ * Readers check that every value they see matches its key while the
+ * writers replace, delete and move those items around.
+ */
+class ConcurrentReadTest : public Generator<bool> {
+public:
+    ConcurrentReadTest(HashTable &ht, std::vector<std::string> &k) :
+        h(ht), keys(k), threads(0), writersDone(0) {}
+
+    bool operator()() {
+        int n = threads++;
+        if (n < writerThreads) {
+            write(n);
+            ++writersDone;
+        } else {
+            read();
+        }
+        return true;
+    }
+
+private:
+    void write(int n) {
+        for (int round = 0; round < 20; ++round) {
+            for (size_t i = n; i < keys.size(); i += writerThreads) {
+                Item itm(keys[i], 0, 0, keys[i].c_str(), keys[i].length());
+                h.set(itm);
+                if (i % 3 == 0) {
+                    h.del(keys[i]);
+                }
+            }
+            if (n == 0) {
+                h.resize(round % 2 ? 6 : 3000);
+                while (h.migrate(1)) {}
+            }
+        }
+    }
+
+    void read() {
+        ValueReader r;
+        size_t i = 0;
+        while (writersDone.get() < static_cast<size_t>(writerThreads)) {
+            const std::string &k = keys[i++ % keys.size()];
+            h.read(k, r);
+            if (r.found) {
+                assert(r.key == k);
+                assert(r.value->to_s() == k);
+            }
+        }
+    }
+
+    HashTable &h;
+    std::vector<std::string> &keys;
+    Atomic<int> threads;
+    Atomic<size_t> writersDone;
+};
+
+static void testConcurrentRead() {
+    HashTable h(global_stats, 6, 3);
+    std::vector<std::string> keys = generateKeys(3000);
+    ConcurrentReadTest t(h, keys);
+    getCompletedThreads<bool>(readerThreads + writerThreads, &t);
+}
+
+static void testLayout(enum hash_table_layout layout) {
+    HashTable::setDefaultLayout(layout);
     testHashSize();
     testHashSizeTwo();
     testReverseDeletions();
@@ -225,7 +910,145 @@ int main() {
     testFind();
     testFindSmall();
     testAdd();
+    testDelExpired();
+    testLazyExpiry();
+    testLockNum();
+    testMemSize();
+    testNRU(featured);
+    testNRU(small);
     testDepthCounting();
+    testStripeLayout();
+    testResize();
+    testStoredRef();
+    testPauseResumeVisit();
+    testVisitStripes();
+    testLazyAllocation();
+    testInlineValues();
     testPoisonKey();
+    testRead();
+    testConcurrentRead();
+}
+
+static void testFingerprints() {
+    FingerprintBucket b;
+    std::memset(&b, 0, sizeof(b));
+    assert(sizeof(FingerprintBucket) <= 64);
+    assert(b.depth() == 0);
+    assert(b.pop() == NULL);
+
+    // Fingerprints are never the empty marker.
+    for (int i = 0; i < 100000; ++i) {
+        assert(FingerprintBucket::fingerprint(i) != 0);
+    }
+}
+
+static int reclaimed;
+
+static void reclaim(void *p) {
+    (void)p;
+    ++reclaimed;
+}
+
+class EpochReaderThread : public Generator<bool> {
+public:
+    EpochReaderThread(CountDownLatch &in, CountDownLatch &out) :
+        entered(in), release(out) {}
+
+    bool operator()() {
+        EpochHolder eh;
+        assert(eh.isEntered());
+        entered.decr();
+        release.wait();
+        return true;
+    }
+
+private:
+    CountDownLatch &entered;
+    CountDownLatch &release;
+};
+
+static void *runEpochReader(void *arg) {
+    (*static_cast<EpochReaderThread*>(arg))();
+    return NULL;
+}
+
+class EpochRetirerThread : public Generator<bool> {
+public:
+    EpochRetirerThread(void *p, CountDownLatch &in, CountDownLatch &out) :
+        thing(p), retiredIt(in), release(out) {}
+
+    bool operator()() {
+        Epoch::retire(thing, reclaim);
+        retiredIt.decr();
+        release.wait();
+        return true;
+    }
+
+private:
+    void           *thing;
+    CountDownLatch &retiredIt;
+    CountDownLatch &release;
+};
+
+static void *runEpochRetirer(void *arg) {
+    (*static_cast<EpochRetirerThread*>(arg))();
+    return NULL;
+}
+
+static void testEpochs() {
+    int thing;
+    reclaimed = 0;
+    Epoch::retire(&thing, reclaim);
+    assert(reclaimed == 0);
+    Epoch::synchronize();
+    assert(reclaimed == 1);
+
+    // Nothing is freed while a reader from before it was retired is
+    // still around.
+    CountDownLatch entered, release;
+    EpochReaderThread reader(entered, release);
+    pthread_t tid;
+    assert(pthread_create(&tid, NULL, runEpochReader, &reader) == 0);
+    entered.wait();
+
+    Epoch::retire(&thing, reclaim);
+    size_t e = Epoch::current();
+    for (int i = 0; i < 10; ++i) {
+        Epoch::advance();
+    }
+    assert(Epoch::current() <= e + 1);
+    Epoch::retire(&thing, reclaim);
+    assert(reclaimed == 1);
+
+    release.decr();
+    assert(pthread_join(tid, NULL) == 0);
+    Epoch::synchronize();
+    assert(reclaimed == 3);
+
+    // What a thread retired is freed once the epoch moves on, even if
+    // that thread never retires (or exits) again.
+    CountDownLatch retiredIt, idle;
+    EpochRetirerThread retirer(&thing, retiredIt, idle);
+    assert(pthread_create(&tid, NULL, runEpochRetirer, &retirer) == 0);
+    retiredIt.wait();
+    assert(reclaimed == 3);
+    for (int i = 0; i < 2; ++i) {
+        assert(Epoch::advance());
+    }
+    assert(reclaimed == 4);
+    idle.decr();
+    assert(pthread_join(tid, NULL) == 0);
+}
+
+int main() {
+    global_stats.maxDataSize = 64*1024*1024;
+    alarm(60);
+    testLayout(chained);
+    testReserve();
+    testLayout(fingerprinted);
+    testFingerprints();
+    testEpochs();
+    testBlobPtr();
+    testCompressedValues();
     exit(0);
 }
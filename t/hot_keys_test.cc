@@ -0,0 +1,92 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#include "config.h"
+#include <cassert>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <unistd.h>
+
+#include "hot-keys.hh"
+
+static std::string keyName(int i) {
+    std::stringstream ss;
+    ss << "key" << i;
+    return ss.str();
+}
+
+static void testExact() {
+    HotKeys hk(10);
+    for (int i = 0; i < 5; ++i) {
+        for (int j = 0; j <= i; ++j) {
+            hk.record(keyName(i), 2);
+        }
+    }
+
+    std::vector<HotKeys::Entry> top = hk.top(3);
+    assert(top.size() == 3);
+    assert(top[0].key == "key4" && top[0].count == 10 && top[0].error == 0);
+    assert(top[1].key == "key3" && top[1].count == 8);
+    assert(top[2].key == "key2" && top[2].count == 6);
+
+    assert(hk.top(100).size() == 5);
+    hk.reset();
+    assert(hk.top(100).empty());
+}
+
+static void testHeavyHitters() {
+    HotKeys hk(8);
+    // Three keys take a quarter of the operations each; the rest go
+    // to keys that are never seen twice.
+    int cold = 0;
+    for (int i = 0; i < 4000; ++i) {
+        if (i % 4 == 3) {
+            hk.record(keyName(10000 + cold++), 1);
+        } else {
+            hk.record(keyName(i % 4), 1);
+        }
+    }
+
+    std::vector<HotKeys::Entry> top = hk.top(3);
+    assert(top.size() == 3);
+    for (size_t i = 0; i < top.size(); ++i) {
+        assert(top[i].key == "key0" || top[i].key == "key1"
+               || top[i].key == "key2");
+        // Never undercounted, and the error bounds the overcount.
+        assert(top[i].count >= 1000);
+        assert(top[i].count - top[i].error <= 1000);
+    }
+}
+
+static void testSampling() {
+    HotKeys::setSampleRate(0);
+    for (int i = 0; i < 100; ++i) {
+        assert(HotKeys::sample() == 0);
+    }
+
+    HotKeys::setSampleRate(10);
+    size_t sampled = 0, weight = 0;
+    for (int i = 0; i < 1000; ++i) {
+        size_t w = HotKeys::sample();
+        if (w != 0) {
+            ++sampled;
+            weight += w;
+        }
+    }
+    assert(sampled >= 100 && sampled <= 101);
+    assert(weight == sampled * 10);
+
+    // Lowering the rate takes effect right away.
+    HotKeys::setSampleRate(1000);
+    HotKeys::sample();
+    HotKeys::setSampleRate(1);
+    assert(HotKeys::sample() == 1);
+    assert(HotKeys::sample() == 1);
+}
+
+int main(int argc, char **argv) {
+    (void)argc; (void)argv;
+    alarm(60);
+    testExact();
+    testHeavyHitters();
+    testSampling();
+}
@@ -0,0 +1,129 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#include "config.h"
+#include <algorithm>
+#include <cassert>
+#include <vector>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "locks.hh"
+
+static uint64_t histoTotal(LockStats &ls, bool wait) {
+    uint64_t rv = 0;
+    for (int i = 0; i < LockStats::HISTO_BUCKETS; ++i) {
+        rv += wait ? ls.getWaitHisto(i) : ls.getHoldHisto(i);
+    }
+    return rv;
+}
+
+static void testCounting() {
+    LockStats ls("counting");
+    ProfiledMutex m(ls);
+    assert(m.getLockStats() == &ls);
+
+    for (int i = 0; i < 1000; ++i) {
+        LockHolder lh(m);
+    }
+    assert(ls.getAcquisitions() == 1000);
+    assert(ls.getContended() == 0);
+    assert(ls.getWaitTime() == 0);
+    // All from one thread, so exactly one in HOLD_SAMPLE.
+    assert(ls.getHoldSamples() == 1000 / LockStats::HOLD_SAMPLE);
+    assert(histoTotal(ls, false) == ls.getHoldSamples());
+
+    // Nothing is counted for plain mutexes.
+    Mutex plain;
+    assert(plain.getLockStats() == NULL);
+    LockHolder lh(plain);
+}
+
+static void *holdBriefly(void *arg) {
+    ProfiledMutex *m = static_cast<ProfiledMutex*>(arg);
+    LockHolder lh(*m);
+    return NULL;
+}
+
+static void testContention() {
+    LockStats ls("contention");
+    ProfiledMutex m(ls);
+    pthread_t t;
+    {
+        LockHolder lh(m);
+        assert(pthread_create(&t, NULL, holdBriefly, &m) == 0);
+        usleep(20000);
+    }
+    assert(pthread_join(t, NULL) == 0);
+
+    assert(ls.getAcquisitions() == 2);
+    assert(ls.getContended() == 1);
+    assert(ls.getWaitTime() > 0);
+    assert(histoTotal(ls, true) == 1);
+    // Almost all of the 20ms was spent waiting.
+    int bucket = 0;
+    while (ls.getWaitHisto(bucket) == 0) {
+        ++bucket;
+    }
+    assert(LockStats::bucketStart(bucket) >= 1000);
+}
+
+static void testCondWait() {
+    LockStats ls("cond");
+    SyncObject so(&ls);
+    for (uint64_t i = 1; i < LockStats::HOLD_SAMPLE; ++i) {
+        LockHolder lh(so);
+    }
+    assert(ls.getHoldSamples() == 0);
+
+    // This hold is timed, but not the time spent waiting in it.
+    {
+        LockHolder lh(so);
+        so.wait(0.1);
+    }
+    assert(ls.getHoldSamples() == 1);
+    assert(ls.getHoldTime() < 50000000);
+}
+
+static void testBuckets() {
+    assert(LockStats::bucketStart(0) == 0);
+    assert(LockStats::bucketStart(1) == 1);
+    assert(LockStats::bucketStart(2) == 2);
+    assert(LockStats::bucketStart(11) == 1024);
+}
+
+static void testRegistry() {
+    LockStats ls("registry");
+    ProfiledMutex m(ls);
+    std::vector<LockStats*> all(LockStats::getAll());
+    assert(std::find(all.begin(), all.end(), &ls) != all.end());
+
+    LockStats::setEnabled(false);
+    assert(!LockStats::isEnabled());
+    {
+        LockHolder lh(m);
+    }
+    assert(ls.getAcquisitions() == 0);
+
+    LockStats::setEnabled(true);
+    {
+        LockHolder lh(m);
+    }
+    assert(ls.getAcquisitions() == 1);
+    LockStats::resetAll();
+    assert(ls.getAcquisitions() == 0);
+
+    {
+        LockStats gone("gone");
+        assert(LockStats::getAll().size() == all.size() + 1);
+    }
+    assert(LockStats::getAll().size() == all.size());
+}
+
+int main(int argc, char **argv) {
+    (void)argc; (void)argv;
+    alarm(60);
+    testCounting();
+    testContention();
+    testCondWait();
+    testBuckets();
+    testRegistry();
+}
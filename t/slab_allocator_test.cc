@@ -0,0 +1,172 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#include "config.h"
+#include <cassert>
+#include <cstring>
+#include <vector>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "slab-allocator.hh"
+
+EPStats global_stats;
+
+static void testSizeClasses() {
+    assert(SlabArena::chunkSize(1) == 16);
+    assert(SlabArena::chunkSize(16) == 16);
+    assert(SlabArena::chunkSize(17) == 32);
+    assert(SlabArena::chunkSize(SlabArena::MAX_CHUNK) == SlabArena::MAX_CHUNK);
+}
+
+static void testAllocate() {
+    SlabArena *arena = new SlabArena(global_stats);
+    std::vector<char*> chunks;
+    for (size_t i = 1; i <= SlabArena::MAX_CHUNK; ++i) {
+        char *p = static_cast<char*>(arena->allocate(i));
+        assert(reinterpret_cast<uintptr_t>(p) % SlabArena::GRANULARITY == 0);
+        memset(p, static_cast<int>(i), i);
+        chunks.push_back(p);
+    }
+    assert(global_stats.numSlabs.get() == arena->getNumSlabs());
+    assert(global_stats.slabRequestedBytes.get()
+           == SlabArena::MAX_CHUNK * (SlabArena::MAX_CHUNK + 1) / 2);
+    assert(global_stats.memOverhead.get() == arena->getOverhead());
+
+    // Nobody scribbled over anybody else.
+    for (size_t i = 1; i <= SlabArena::MAX_CHUNK; ++i) {
+        char *p = chunks[i - 1];
+        for (size_t j = 0; j < i; ++j) {
+            assert(p[j] == static_cast<char>(i));
+        }
+        SlabArena::release(p, i);
+    }
+    assert(global_stats.slabUsedBytes.get() == 0);
+    assert(global_stats.slabRequestedBytes.get() == 0);
+    // One empty slab is kept for each size class used.
+    assert(global_stats.slabBytes.get()
+           == arena->getNumSlabs() * SlabArena::SLAB_SIZE);
+    assert(global_stats.memOverhead.get() == arena->getOverhead());
+
+    // The owner settles the overhead it was charged.
+    global_stats.memOverhead.decr(arena->destroy(0));
+    assert(global_stats.numSlabs.get() == 0);
+    assert(global_stats.slabBytes.get() == 0);
+    assert(global_stats.memOverhead.get() == 0);
+}
+
+static void testReuse() {
+    SlabArena *arena = new SlabArena(global_stats);
+    std::vector<void*> chunks;
+    for (size_t i = 0; i < 10000; ++i) {
+        chunks.push_back(arena->allocate(40));
+    }
+    size_t slabs = arena->getNumSlabs();
+    // Packed, give or take the slab headers.
+    assert(slabs <= 10000 / (SlabArena::SLAB_SIZE / 48 - 4) + 1);
+
+    // Freeing most of them gives back the empty slabs.
+    for (size_t i = 0; i < chunks.size(); ++i) {
+        if (i % 1000 != 0) {
+            SlabArena::release(chunks[i], 40);
+        }
+    }
+    assert(arena->getNumSlabs() <= 11);
+
+    // And the freed chunks are handed out again.
+    for (size_t i = 0; i < chunks.size(); ++i) {
+        if (i % 1000 != 0) {
+            chunks[i] = arena->allocate(40);
+        }
+    }
+    assert(arena->getNumSlabs() == slabs);
+
+    global_stats.memOverhead.decr(arena->destroy(chunks.size()));
+    assert(global_stats.numSlabs.get() == 0);
+    assert(global_stats.slabUsedBytes.get() == 0);
+    assert(global_stats.memOverhead.get() == 0);
+}
+
+static void testReleaseAfterDestroy() {
+    SlabArena *arena = new SlabArena(global_stats);
+    void *kept = arena->allocate(100);
+    void *pending = arena->allocate(100);
+    size_t overhead = arena->getOverhead();
+
+    // The pending chunk keeps the slabs around, but the owner has
+    // settled the overhead.
+    assert(arena->destroy(1) == overhead);
+    global_stats.memOverhead.decr(overhead);
+    assert(global_stats.numSlabs.get() == 1);
+    (void)kept;
+
+    SlabArena::release(pending, 100);
+    assert(global_stats.numSlabs.get() == 0);
+    assert(global_stats.slabBytes.get() == 0);
+    assert(global_stats.slabRequestedBytes.get() == 0);
+    assert(global_stats.memOverhead.get() == 0);
+}
+
+struct ThreadArgs {
+    SlabArena *arena;
+    int id;
+    std::vector<void*> kept;
+};
+
+static void *allocateMany(void *arg) {
+    ThreadArgs *args = static_cast<ThreadArgs*>(arg);
+    std::vector<char*> chunks;
+    for (size_t i = 0; i < 5000; ++i) {
+        char *p = static_cast<char*>(args->arena->allocate(40));
+        memset(p, args->id, 40);
+        chunks.push_back(p);
+    }
+    for (size_t i = 0; i < chunks.size(); ++i) {
+        for (size_t j = 0; j < 40; ++j) {
+            assert(chunks[i][j] == static_cast<char>(args->id));
+        }
+        if (i % 2 == 0) {
+            SlabArena::release(chunks[i], 40);
+        } else {
+            args->kept.push_back(chunks[i]);
+        }
+    }
+    return NULL;
+}
+
+static void testThreads() {
+    SlabArena *arena = new SlabArena(global_stats);
+    const int n = 8;
+    pthread_t threads[n];
+    ThreadArgs args[n];
+    for (int i = 0; i < n; ++i) {
+        args[i].arena = arena;
+        args[i].id = i + 1;
+        assert(pthread_create(&threads[i], NULL, allocateMany, &args[i]) == 0);
+    }
+    for (int i = 0; i < n; ++i) {
+        assert(pthread_join(threads[i], NULL) == 0);
+    }
+    assert(global_stats.slabRequestedBytes.get() == n * 2500 * 40);
+
+    // Chunks can be released by any thread.
+    for (int i = 0; i < n; ++i) {
+        for (size_t j = 0; j < args[i].kept.size(); ++j) {
+            SlabArena::release(args[i].kept[j], 40);
+        }
+    }
+    assert(global_stats.slabUsedBytes.get() == 0);
+    assert(global_stats.memOverhead.get() == arena->getOverhead());
+
+    global_stats.memOverhead.decr(arena->destroy(0));
+    assert(global_stats.numSlabs.get() == 0);
+    assert(global_stats.memOverhead.get() == 0);
+}
+
+int main(int argc, char **argv) {
+    (void)argc; (void)argv;
+    alarm(60);
+    testSizeClasses();
+    testAllocate();
+    testReuse();
+    testReleaseAfterDestroy();
+    testThreads();
+}
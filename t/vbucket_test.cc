@@ -15,6 +15,14 @@
 static const size_t numThreads = 10;
 static const size_t vbucketsEach = 100;
 
+extern "C" {
+    static rel_time_t basic_current_time(void) {
+        return 0;
+    }
+
+    rel_time_t (*ep_current_time)() = basic_current_time;
+}
+
 EPStats global_stats;
 
 class VBucketGenerator {
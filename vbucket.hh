@@ -14,6 +14,7 @@
 
 #include "common.hh"
 #include "atomic.hh"
+#include "hot-keys.hh"
 #include "stored-value.hh"
 
 /**
@@ -54,10 +55,11 @@ class VBucket : public RCValue {
 public:
 
     VBucket(int i, vbucket_state_t initialState, EPStats &st) :
-        ht(st), id(i), state(initialState), stats(st) {
+        ht(st), hotKeys(HOT_KEYS_TRACKED), id(i), state(initialState),
+        stats(st) {
         pendingOpsStart = 0;
-        stats.memOverhead.incr(sizeof(VBucket)
-                               + ht.memorySize());
+        // The hash table charges its own allocations as they happen.
+        stats.memOverhead.incr(sizeof(VBucket));
     }
 
     ~VBucket() {
@@ -66,7 +68,7 @@ public:
                              "Have %d pending ops while destroying vbucket\n",
                              pendingOps.size());
         }
-        stats.memOverhead.decr(sizeof(VBucket) + ht.memorySize());
+        stats.memOverhead.decr(sizeof(VBucket));
         getLogger()->log(EXTENSION_LOG_INFO, NULL,
                          "Destroying vbucket %d\n", id);
     }
@@ -98,12 +100,41 @@ public:
     void fireAllOps(SERVER_CORE_API *core);
 
     size_t size(void) {
-        HashTableDepthStatVisitor v;
-        ht.visitDepth(v);
-        return v.size;
+        return ht.getNumItems();
+    }
+
+    /**
+     * Get the memory taken by this vbucket's items.
+     */
+    size_t getMemSize(void) {
+        return ht.getMemSize();
+    }
+
+    /**
+     * True if this vbucket's items take more memory than the soft
+     * quota, and should be paged out first.
+     */
+    bool overSoftQuota(void) {
+        size_t quota = stats.vbMemSoftQuota.get();
+        return quota != 0 && getMemSize() > quota;
+    }
+
+    /**
+     * True if storing the given item would take this vbucket's items
+     * over the hard quota.
+     */
+    bool exceedsHardQuota(const Item &itm) {
+        size_t quota = stats.vbMemHardQuota.get();
+        return quota != 0 && getMemSize() + sizeof(StoredValue)
+            + itm.getNKey() + itm.getNBytes() > quota;
     }
 
     HashTable               ht;
+    //! The most used keys of this vbucket.
+    HotKeys                 hotKeys;
+
+    //! Number of keys hotKeys keeps track of.
+    static const size_t HOT_KEYS_TRACKED = 16;
 
     static const char* toString(vbucket_state_t s) {
         switch(s) {